@@ -54,8 +54,9 @@
  * start:
  * 	1.IPv6addr will choice a proper interface for the new address.
  *	2.Then assign the new address to the interface.
- *	3.Wait until the new address is available (reply ICMPv6 ECHO packet)
- *	4.Send out the unsolicited advertisements.
+ *	3.Wait until the new address is available (the kernel is done with
+ *	  duplicate address detection, it tells us over netlink)
+ *	4.Send out the unsolicited advertisements, a fraction of a second apart.
  *
  *	return 0(OCF_SUCCESS) for success
  *	return 1(OCF_ERR_GENERIC) for failure
@@ -78,7 +79,8 @@
  *
  *
  * monitor:
- *	ping the address by ICMPv6 ECHO request.
+ *	ping the address by ICMPv6 ECHO request, again every 100 ms until
+ *	it answers or ping_timeout ms (1000 by default) have passed.
  *
  *	return 0(OCF_SUCCESS) for response correctly.
  *	return 1(OCF_NOT_RUNNING) for no response.
@@ -97,7 +99,6 @@
 #include <netinet/icmp6.h>
 #include <arpa/inet.h> /* for inet_pton */
 #include <net/if.h> /* for if_nametoindex */
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -105,6 +106,9 @@
 #include <signal.h>
 #include <errno.h>
 #include <poll.h>
+#include <time.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <clplumbing/cl_log.h>
 
 
@@ -148,18 +152,16 @@ const char*	RELOAD_CMD 	= "reload";
 const char*	META_DATA_CMD 	= "meta-data";
 const char*	VALIDATE_CMD 	= "validate-all";
 
-const int	QUERY_COUNT	= 5;
+const int	DAD_TIMEOUT	= 5000;	/* ms start waits for DAD, at most */
+const int	UA_INTERVAL	= 200;	/* ms between advertisements */
+const int	PING_INTERVAL	= 100;	/* ms between echo requests */
 
-struct in6_ifreq {
-	struct in6_addr ifr6_addr;
-	uint32_t ifr6_prefixlen;
-	unsigned int ifr6_ifindex;
-};
+static int	ping_timeout	= 1000;	/* ms monitor waits for a reply */
 
 static int start_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname);
 static int stop_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname);
 static int status_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname);
-static int monitor_addr6(struct in6_addr* addr6, int prefix_len);
+static int monitor_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname);
 static int advt_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname);
 static int meta_data_addr6(void);
 
@@ -175,7 +177,10 @@ static char* find_if(struct in6_addr* addr_target, int* plen_target, char* prov_
 static char* get_if(struct in6_addr* addr_target, int* plen_target, char* prov_ifname);
 static int assign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name);
 static int unassign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name);
-int is_addr6_available(struct in6_addr* addr6);
+int is_addr6_available(struct in6_addr* addr6, int ifindex, int timeout, double* rtt);
+static int open_addr_monitor(void);
+static int wait_for_dad(int fd, struct in6_addr* addr6, int ifindex, int timeout);
+static void send_ua_burst(struct in6_addr* addr6, char* if_name);
 
 int
 main(int argc, char* argv[])
@@ -258,6 +263,17 @@ main(int argc, char* argv[])
 	/* get provided interface name (optional) */
 	prov_ifname = getenv("OCF_RESKEY_nic");
 
+	/* how long monitor waits for an echo reply (optional) */
+	if ((cp = getenv("OCF_RESKEY_ping_timeout")) != NULL && *cp != 0) {
+		ping_timeout = atoi(cp);
+		if (ping_timeout <= 0) {
+			cl_log(LOG_ERR, "Invalid ping_timeout [%s], "
+				"should be a positive number of milliseconds", cp);
+			usage(argv[0]);
+			return OCF_ERR_ARGS;
+		}
+	}
+
 	if (inet_pton(AF_INET6, ipv6addr, &addr6) <= 0) {
 		cl_log(LOG_ERR, "Invalid IPv6 address [%s]", ipv6addr);
 		usage(argv[0]);
@@ -292,7 +308,7 @@ main(int argc, char* argv[])
 	}else if (0 == strncmp(STATUS_CMD,argv[1], strlen(STATUS_CMD))) {
 		ret = status_addr6(&addr6, prefix_len, prov_ifname);
 	}else if (0 ==strncmp(MONITOR_CMD,argv[1], strlen(MONITOR_CMD))) {
-		ret = monitor_addr6(&addr6, prefix_len);
+		ret = monitor_addr6(&addr6, prefix_len, prov_ifname);
 	}else if (0 ==strncmp(RELOAD_CMD,argv[1], strlen(RELOAD_CMD))) {
 		ret = OCF_ERR_UNIMPLEMENTED;
 	}else if (0 ==strncmp(RECOVER_CMD,argv[1], strlen(RECOVER_CMD))) {
@@ -315,8 +331,8 @@ main(int argc, char* argv[])
 int
 start_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 {
-	int	i;
 	char*	if_name;
+	int	fd;
 	if(OCF_SUCCESS == status_addr6(addr6,prefix_len,prov_ifname)) {
 		return OCF_SUCCESS;
 	}
@@ -328,29 +344,29 @@ start_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 		return OCF_ERR_GENERIC;
 	}
 
+	/* Listen before the address is there, so that no news is missed */
+	if ((fd = open_addr_monitor()) < 0) {
+		cl_log(LOG_ERR, "failed to open a netlink socket: %s", strerror(errno));
+		return OCF_ERR_GENERIC;
+	}
+
 	/* Assign the address */
 	if (0 != assign_addr6(addr6, prefix_len, if_name)) {
-		cl_log(LOG_ERR, "failed to assign the address to %s", if_name);
+		cl_log(LOG_ERR, "failed to assign the address to %s: %s"
+		,	if_name, strerror(errno));
+		close(fd);
 		return OCF_ERR_GENERIC;
 	}
 
-	/* Check whether the address available */
-	for (i = 0; i < QUERY_COUNT; i++) {
-		if (0 == is_addr6_available(addr6)) {
-			break;
-		}
-		sleep(1);
-	}
-	if (i == QUERY_COUNT) {
-		cl_log(LOG_ERR, "failed to ping the address");
+	/* Wait until the address is available */
+	if (0 != wait_for_dad(fd, addr6, if_nametoindex(if_name), DAD_TIMEOUT)) {
+		close(fd);
 		return OCF_ERR_GENERIC;
 	}
+	close(fd);
 
 	/* Send unsolicited advertisement packet to neighbor */
-	for (i = 0; i < UA_REPEAT_COUNT; i++) {
-		send_ua(addr6, if_name);
-		sleep(1);
-	}
+	send_ua_burst(addr6, if_name);
 	return OCF_SUCCESS;
 }
 
@@ -359,17 +375,27 @@ advt_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 {
 	/* First, we need to find a proper device to assign the address */
 	char*	if_name = get_if(addr6, &prefix_len, prov_ifname);
-	int	i;
 	if (NULL == if_name) {
 		cl_log(LOG_ERR, "no valid mechanisms");
 		return OCF_ERR_GENERIC;
 	}
 	/* Send unsolicited advertisement packet to neighbor */
+	send_ua_burst(addr6, if_name);
+	return OCF_SUCCESS;
+}
+
+/* UA_REPEAT_COUNT advertisements, UA_INTERVAL ms apart */
+void
+send_ua_burst(struct in6_addr* addr6, char* if_name)
+{
+	int	i;
+
 	for (i = 0; i < UA_REPEAT_COUNT; i++) {
+		if (i > 0) {
+			usleep(UA_INTERVAL * 1000);
+		}
 		send_ua(addr6, if_name);
-		sleep(1);
 	}
-	return OCF_SUCCESS;
 }
 
 int
@@ -390,7 +416,8 @@ stop_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 
 	/* Unassign the address */
 	if (0 != unassign_addr6(addr6, prefix_len, if_name)) {
-		cl_log(LOG_ERR, "failed to assign the address to %s", if_name);
+		cl_log(LOG_ERR, "failed to remove the address from %s: %s"
+		,	if_name, strerror(errno));
 		return OCF_ERR_GENERIC;
 	}
 
@@ -408,111 +435,233 @@ status_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 }
 
 int
-monitor_addr6(struct in6_addr* addr6, int prefix_len)
+monitor_addr6(struct in6_addr* addr6, int prefix_len, char* prov_ifname)
 {
-	if(0 == is_addr6_available(addr6)) {
+	int	ifindex = 0;
+	double	rtt;
+
+	/* a link-local address needs to know where it is */
+	if (prov_ifname != NULL && *prov_ifname != 0) {
+		ifindex = if_nametoindex(prov_ifname);
+	}
+	if(0 == is_addr6_available(addr6, ifindex, ping_timeout, &rtt)) {
+		cl_log(LOG_DEBUG, "the address replied in %.3f ms", rtt);
 		return OCF_SUCCESS;
 	}
+	cl_log(LOG_INFO, "no echo reply from the address in %d ms", ping_timeout);
 	return OCF_NOT_RUNNING;
 }
 
-/* find the network interface associated with an address */
-char*
-scan_if(struct in6_addr* addr_target, int* plen_target, int use_mask, char* prov_ifname)
+#define NLBUFSIZ	32768
+
+static void
+nl_addattr(void *req, int type, const void *data, int alen)
 {
-	FILE *f;
-	static char devname[21]="";
-	struct in6_addr addr;
-	struct in6_addr mask;
-	unsigned int plen, scope, dad_status, if_idx;
-	unsigned int addr6p[4];
-
-	/* open /proc/net/if_inet6 file */
-	if ((f = fopen(IF_INET6, "r")) == NULL) {
-		return NULL;
+	struct nlmsghdr	*n = req;
+	struct rtattr	*rta;
+
+	rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(n->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(alen);
+	memcpy(RTA_DATA(rta), data, alen);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/*
+ * Send a request on a fresh rtnetlink socket and hand every answer to
+ * cb (if any).  Returns 0, or an errno value (the kernel's one for
+ * NLMSG_ERROR; an ack is an NLMSG_ERROR of 0).
+ */
+static int
+nl_request(struct nlmsghdr *req, void (*cb)(struct nlmsghdr *, void *)
+,	void *arg)
+{
+	struct sockaddr_nl	nladdr;
+	struct nlmsghdr		*h;
+	static char	buf[NLBUFSIZ];
+	int	fd, len;
+	int	done = 0;
+	int	rc = 0;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		return errno;
+	}
+#ifdef NETLINK_GET_STRICT_CHK
+	/* lets the kernel filter dumps by ifa_index; older ones ignore it */
+	len = 1;
+	setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &len, sizeof(len));
+#endif
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	req->nlmsg_seq = 1;
+	if (sendto(fd, req, req->nlmsg_len, 0
+	,	(struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		rc = errno;
+		goto out;
 	}
 
-	/* Loop for each entry */
-	while (1) {
-		int		i;
-		int		n;
-		int		s;
-		gboolean	same = TRUE;
-
-		i = fscanf(f, "%08x%08x%08x%08x %x %02x %02x %02x %20s\n",
-		       	   &addr6p[0], &addr6p[1], &addr6p[2], &addr6p[3],
-			   &if_idx, &plen, &scope, &dad_status, devname);
-		if (i == EOF) {
-			break;
-		}
-		else if (i != 9) {
-			cl_log(LOG_INFO, "Error parsing %s, "
-			       "perhaps the format has changed\n", IF_INET6);
+	while (!done) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = errno;
 			break;
 		}
-
-		/* Consider link-local addresses (scope == 0x20) only when
-		 * the inerface name is provided, and global addresses
-		 * (scope == 0). Skip everything else.
-		 */
-		if (scope != 0) {
-			if (scope != 0x20 || prov_ifname == 0
-				|| *prov_ifname == 0)
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len)
+		;	h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != req->nlmsg_seq) {
 				continue;
+			}
+			if (h->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+				rc = -err->error;
+				done = 1;
+				break;
+			}
+			if (cb) {
+				cb(h, arg);
+			}
 		}
-
-		/* If specified prefix, only same prefix entry
-		 * would be considered.
-		 */
-		if (*plen_target!=0 && plen != *plen_target) {
-			continue;
+		if (!(req->nlmsg_flags & (NLM_F_DUMP | NLM_F_ACK))) {
+			done = 1;
 		}
+	}
 
-		/* If interface name provided, only same devname entry
-		 * would be considered
-		 */
-		if (prov_ifname!=0 && *prov_ifname!=0)
-		{
-			if (strcmp(devname, prov_ifname))
-				continue;
-		}
+  out:
+	close(fd);
+	return rc;
+}
 
-		for (i = 0; i< 4; i++) {
-			addr.s6_addr32[i] = htonl(addr6p[i]);
-		}
+/* What scan_if looks for, and what it found */
+struct addr6_query {
+	struct in6_addr*	addr;
+	int			plen;		/* 0: any prefix length */
+	int			use_mask;	/* any address in the prefix */
+	int			ifindex;	/* 0: any interface */
+	int			found;
+};
+
+static void
+match_addr6(struct nlmsghdr *h, void *arg)
+{
+	struct addr6_query	*q = arg;
+	struct ifaddrmsg	*ifa = NLMSG_DATA(h);
+	struct rtattr		*rta;
+	unsigned char		*addr = NULL;
+	int			attrlen = IFA_PAYLOAD(h);
+	int			i, bits;
+
+	if (h->nlmsg_type != RTM_NEWADDR || q->found
+	||	ifa->ifa_family != AF_INET6) {
+		return;
+	}
 
-		/* Make the mask based on prefix length */
-		memset(mask.s6_addr, 0xff, 16);
-		if (use_mask && plen < 128) {
-			n = plen / 32;
-			memset(mask.s6_addr32 + n + 1, 0, (3 - n) * 4);
-			s = 32 - plen % 32;
-			if (s == 32) 
-				mask.s6_addr32[n] = 0x0;
-			else
-				mask.s6_addr32[n] = 0xffffffff << s;
-			mask.s6_addr32[n] = htonl(mask.s6_addr32[n]);
+	/* Consider link-local addresses only when the interface name
+	 * is provided, and global addresses. Skip everything else.
+	 */
+	if (ifa->ifa_scope != RT_SCOPE_UNIVERSE
+	&&	(ifa->ifa_scope != RT_SCOPE_LINK || q->ifindex == 0)) {
+		return;
+	}
+
+	/* If specified prefix, only same prefix entry
+	 * would be considered.
+	 */
+	if (q->plen != 0 && ifa->ifa_prefixlen != q->plen) {
+		return;
+	}
+
+	/* If interface provided, only that one would be considered */
+	if (q->ifindex != 0 && (int)ifa->ifa_index != q->ifindex) {
+		return;
+	}
+
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		if (rta->rta_type == IFA_ADDRESS) {
+			addr = RTA_DATA(rta);
 		}
+	}
+	if (addr == NULL) {
+		return;
+	}
 
-		/* compare addr and addr_target */
-		same = TRUE;
-		for (i = 0; i < 4; i++) {
-			if ((addr.s6_addr32[i]&mask.s6_addr32[i]) !=
-			    (addr_target->s6_addr32[i]&mask.s6_addr32[i])) {
-				same = FALSE;
-				break;
-			}
+	/* compare addr and the target, under the mask if asked to */
+	for (i = 0; i < 16; i++) {
+		bits = q->use_mask ? ifa->ifa_prefixlen - 8 * i : 8;
+		if (bits <= 0) {
+			break;
+		}
+		if ((addr[i] ^ q->addr->s6_addr[i])
+		&	(bits >= 8 ? 0xff : 0xff << (8 - bits))) {
+			return;
 		}
-		
-		/* We found it!	*/
-		if (same) {
-			fclose(f);
-			*plen_target = plen;
-			return devname;
+	}
+
+	/* We found it!	*/
+	q->found = 1;
+	q->plen = ifa->ifa_prefixlen;
+	q->ifindex = ifa->ifa_index;
+}
+
+/*
+ * find the network interface associated with an address
+ *
+ * The address itself (!use_mask) the kernel looks up for us, with one
+ * RTM_GETADDR for it, however many addresses there are.  An address
+ * in the same prefix takes a dump of the IPv6 addresses (of the given
+ * interface only, where the kernel can filter).
+ */
+char*
+scan_if(struct in6_addr* addr_target, int* plen_target, int use_mask, char* prov_ifname)
+{
+	static char		devname[IF_NAMESIZE];
+	struct addr6_query	q;
+	struct {
+		struct nlmsghdr		n;
+		struct ifaddrmsg	ifa;
+		char			buf[64];
+	} req;
+	int			rc;
+
+	memset(&q, 0, sizeof(q));
+	q.addr = addr_target;
+	q.plen = *plen_target;
+	q.use_mask = use_mask;
+	if (prov_ifname != 0 && *prov_ifname != 0) {
+		if ((q.ifindex = if_nametoindex(prov_ifname)) == 0) {
+			return NULL;
 		}
 	}
-	fclose(f);
-	return NULL;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.n.nlmsg_type = RTM_GETADDR;
+	req.ifa.ifa_family = AF_INET6;
+	req.ifa.ifa_index = q.ifindex;
+	if (use_mask) {
+		req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	} else {
+		req.n.nlmsg_flags = NLM_F_REQUEST;
+		nl_addattr(&req, IFA_ADDRESS, addr_target, sizeof(*addr_target));
+	}
+
+	rc = nl_request(&req.n, match_addr6, &q);
+	if (rc != 0 && rc != EADDRNOTAVAIL && rc != ENODEV) {
+		cl_log(LOG_ERR, "failed to get the IPv6 addresses: %s"
+		,	strerror(rc));
+	}
+	if (rc != 0 || !q.found || if_indextoname(q.ifindex, devname) == NULL) {
+		return NULL;
+	}
+	*plen_target = q.plen;
+	return devname;
 }
 /* find a proper network interface to assign the address */
 char*
@@ -534,138 +683,347 @@ get_if(struct in6_addr* addr_target, int* plen_target, char* prov_ifname)
 {
 	return scan_if(addr_target, plen_target, 0, prov_ifname);
 }
-int
-assign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name)
+/* add (RTM_NEWADDR) or remove (RTM_DELADDR) the address, and wait for the ack */
+static int
+change_addr6(int cmd, struct in6_addr* addr6, int prefix_len, char* if_name)
 {
-	struct in6_ifreq ifr6;
-
-	/* Get socket first */
-	int		fd;
-	struct ifreq	ifr;
-
-	fd = socket(AF_INET6, SOCK_DGRAM, 0);
-	if (fd < 0) {
-		return 1;
-	}
-
-	/* Query the index of the if */
-	strcpy(ifr.ifr_name, if_name);
-	if (ioctl(fd, SIOGIFINDEX, &ifr) < 0) {
+	struct {
+		struct nlmsghdr		n;
+		struct ifaddrmsg	ifa;
+		char			buf[64];
+	} req;
+	int	ifindex;
+	int	rc;
+
+	if ((ifindex = if_nametoindex(if_name)) == 0) {
 		return -1;
 	}
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.n.nlmsg_type = cmd;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (cmd == RTM_NEWADDR) {
+		req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+	}
+	req.ifa.ifa_family = AF_INET6;
+	req.ifa.ifa_prefixlen = prefix_len;
+	req.ifa.ifa_index = ifindex;
+	nl_addattr(&req, IFA_LOCAL, addr6, sizeof(*addr6));
 
-	/* Assign the address to the if */
-	ifr6.ifr6_addr = *addr6;
-	ifr6.ifr6_ifindex = ifr.ifr_ifindex;
-	ifr6.ifr6_prefixlen = prefix_len;
-	if (ioctl(fd, SIOCSIFADDR, &ifr6) < 0) {
+	if ((rc = nl_request(&req.n, NULL, NULL)) != 0) {
+		errno = rc;
 		return -1;
 	}
-	close (fd);
 	return 0;
 }
 int
+assign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name)
+{
+	return change_addr6(RTM_NEWADDR, addr6, prefix_len, if_name);
+}
+int
 unassign_addr6(struct in6_addr* addr6, int prefix_len, char* if_name)
 {
+	return change_addr6(RTM_DELADDR, addr6, prefix_len, if_name);
+}
+
+/* A netlink socket that hears about IPv6 addresses coming and going */
+int
+open_addr_monitor(void)
+{
+	struct sockaddr_nl	nladdr;
 	int			fd;
-	struct ifreq		ifr;
-	struct in6_ifreq	ifr6;
 
-	/* Get socket first */
-	fd = socket(AF_INET6, SOCK_DGRAM, 0);
-	if (fd < 0) {
-		return 1;
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		return -1;
 	}
-
-	/* Query the index of the if */
-	strcpy(ifr.ifr_name, if_name);
-	if (ioctl(fd, SIOGIFINDEX, &ifr) < 0) {
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		close(fd);
 		return -1;
 	}
+	return fd;
+}
+
+static long
+now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	/* Unassign the address to the if */
-	ifr6.ifr6_addr = *addr6;
-	ifr6.ifr6_ifindex = ifr.ifr_ifindex;
-	ifr6.ifr6_prefixlen = prefix_len;
-	if (ioctl(fd, SIOCDIFADDR, &ifr6) < 0) {
+/*
+ * What one RTM_NEWADDR says about addr6 on ifindex: 1 if duplicate
+ * address detection is done with it, -1 if DAD found it in use
+ * elsewhere, 0 if it is still tentative (or this is another address).
+ */
+static int
+dad_state(struct nlmsghdr *h, struct in6_addr* addr6, int ifindex)
+{
+	struct ifaddrmsg	*ifa = NLMSG_DATA(h);
+	struct rtattr		*rta;
+	int			attrlen = IFA_PAYLOAD(h);
+
+	if (h->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET6
+	||	(int)ifa->ifa_index != ifindex) {
+		return 0;
+	}
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		if (rta->rta_type == IFA_ADDRESS
+		&&	memcmp(RTA_DATA(rta), addr6, sizeof(*addr6)) == 0) {
+			break;
+		}
+	}
+	if (!RTA_OK(rta, attrlen)) {
+		return 0;
+	}
+	if (ifa->ifa_flags & IFA_F_DADFAILED) {
 		return -1;
 	}
-	
-	close (fd);
-	return 0;
+	return (ifa->ifa_flags & IFA_F_TENTATIVE) ? 0 : 1;
+}
+
+/*
+ * Wait, at most timeout ms, until the kernel is done with duplicate
+ * address detection for the address just added.  It announces the
+ * address on fd (see open_addr_monitor) when it is added and again
+ * when IFA_F_TENTATIVE is cleared (right away if the interface does
+ * no DAD), or when IFA_F_DADFAILED is set.  Should the socket overrun
+ * and lose news, a dump of the addresses catches up.
+ * Returns 0 once the address can be used.
+ */
+int
+wait_for_dad(int fd, struct in6_addr* addr6, int ifindex, int timeout)
+{
+	static char		buf[16384];
+	struct nlmsghdr		*h;
+	struct pollfd		pfd;
+	long			deadline = now_ms() + timeout;
+	long			left;
+	int			len, rc;
+
+	while ((left = deadline - now_ms()) > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, left) < 1) {
+			continue;
+		}
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && errno == ENOBUFS) {
+			struct {
+				struct nlmsghdr		n;
+				struct ifaddrmsg	ifa;
+			} req;
+			struct sockaddr_nl	nladdr;
+
+			memset(&req, 0, sizeof(req));
+			req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+			req.n.nlmsg_type = RTM_GETADDR;
+			req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+			req.ifa.ifa_family = AF_INET6;
+			memset(&nladdr, 0, sizeof(nladdr));
+			nladdr.nl_family = AF_NETLINK;
+			sendto(fd, &req, req.n.nlmsg_len, 0
+			,	(struct sockaddr *)&nladdr, sizeof(nladdr));
+			continue;
+		}
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			cl_log(LOG_ERR, "failed to read from netlink: %s", strerror(errno));
+			return -1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len)
+		;	h = NLMSG_NEXT(h, len)) {
+			rc = dad_state(h, addr6, ifindex);
+			if (rc > 0) {
+				return 0;
+			}
+			if (rc < 0) {
+				cl_log(LOG_ERR, "duplicate address detected,"
+				       " the address is in use elsewhere");
+				return -1;
+			}
+		}
+	}
+	cl_log(LOG_ERR, "duplicate address detection not done after %d ms"
+	,	timeout);
+	return -1;
 }
 
 #define	MINPACKSIZE	64
+
+/*
+ * The echo requests carry the time they were sent, and the kernel
+ * stamps the replies (SO_TIMESTAMPNS) when they arrive, so the round
+ * trip time does not include our own scheduling.
+ */
+struct echo6 {
+	struct icmp6_hdr	hdr;
+	struct timespec		sent;
+};
+
+static double
+ts_diff_ms(const struct timespec* a, const struct timespec* b)
+{
+	return (a->tv_sec - b->tv_sec) * 1e3 + (a->tv_nsec - b->tv_nsec) / 1e6;
+}
+
+/*
+ * The ICMPv6 socket, opened once and kept for the whole run.  The
+ * kernel passes it echo replies only (ICMP6_FILTER), which still may
+ * be anybody's; is_addr6_available() sorts them out by id and seq.
+ */
+static int
+icmp6_socket(void)
+{
+	static int		icmp_sock = -1;
+	struct icmp6_filter	filter;
+	int			on = 1;
+
+	if (icmp_sock != -1) {
+		return icmp_sock;
+	}
+	if ((icmp_sock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC
+	,	IPPROTO_ICMPV6)) == -1) {
+		return -1;
+	}
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+	if (setsockopt(icmp_sock, IPPROTO_ICMPV6, ICMP6_FILTER
+	,	&filter, sizeof(filter)) < 0) {
+		cl_log(LOG_ERR, "setsockopt(ICMP6_FILTER) failed: %s"
+		,	strerror(errno));
+	}
+	/* without time stamps, the time we read the reply will do */
+	setsockopt(icmp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	return icmp_sock;
+}
+
+/*
+ * Ping addr6 (on ifindex, for a link-local one): an echo request
+ * every PING_INTERVAL ms until a reply to any of them comes back from
+ * addr6, or timeout ms have passed.  Returns 0 if it answered, with
+ * the round trip time in ms in *rtt.
+ */
 int
-is_addr6_available(struct in6_addr* addr6)
+is_addr6_available(struct in6_addr* addr6, int ifindex, int timeout, double* rtt)
 {
+	static uint16_t			seq = 0;
+	uint16_t			id = getpid() & 0xffff;
+	uint16_t			first = seq;
 	struct sockaddr_in6		addr;
-	struct icmp6_hdr		icmph;
-	u_char				outpack[MINPACKSIZE];
-	int				icmp_sock;
-	int				ret;
+	struct sockaddr_in6		from;
+	union {
+		struct echo6		echo;
+		u_char			buf[MINPACKSIZE];
+	}				outpack, packet;
+	union {
+		struct cmsghdr		cm;
+		char			buf[CMSG_SPACE(sizeof(struct timespec))];
+	}				control;
+	struct cmsghdr*			cmsg;
+	struct timespec			now;
 	struct iovec			iov;
-	u_char				packet[MINPACKSIZE];
 	struct msghdr			msg;
-	int				i;
 	struct pollfd			pfd;
+	long				deadline = now_ms() + timeout;
+	long				next = 0;
+	long				left;
+	int				icmp_sock;
+	int				ret;
 
-	if ((icmp_sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) == -1) {
+	if ((icmp_sock = icmp6_socket()) == -1) {
+		cl_log(LOG_ERR, "socket(IPPROTO_ICMPV6) failed: %s", strerror(errno));
 		return -1;
 	}
 
-	memset(&icmph, 0, sizeof(icmph));
-	icmph.icmp6_type = ICMP6_ECHO_REQUEST;
-	icmph.icmp6_code = 0;
-	icmph.icmp6_cksum = 0;
-	icmph.icmp6_seq = htons(0);
-	icmph.icmp6_id = 0;
-
-	memset(&outpack, 0, sizeof(outpack));
-	memcpy(&outpack, &icmph, sizeof(icmph));
-
 	memset(&addr, 0, sizeof(struct sockaddr_in6));
 	addr.sin6_family = AF_INET6;
-	addr.sin6_port = htons(IPPROTO_ICMPV6);
 	memcpy(&addr.sin6_addr,addr6,sizeof(struct in6_addr));
-
-	/* Only the first 8 bytes of outpack are meaningful... */
-	ret = sendto(icmp_sock, (char *)outpack, sizeof(outpack), 0,
-			   (struct sockaddr *) &addr,
-			   sizeof(struct sockaddr_in6));
-	if (0 >= ret) {
-		return -1;
+	if (IN6_IS_ADDR_LINKLOCAL(addr6)) {
+		addr.sin6_scope_id = ifindex;
 	}
 
-	iov.iov_base = (char *)packet;
-	iov.iov_len = sizeof(packet); 
-
-	msg.msg_name = &addr;
-	msg.msg_namelen = sizeof(addr);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = NULL;
-	msg.msg_controllen = 0;
+	memset(&outpack, 0, sizeof(outpack));
+	outpack.echo.hdr.icmp6_type = ICMP6_ECHO_REQUEST;
+	outpack.echo.hdr.icmp6_code = 0;
+	outpack.echo.hdr.icmp6_cksum = 0;	/* the kernel's job */
+	outpack.echo.hdr.icmp6_id = htons(id);
+
+	while ((left = deadline - now_ms()) > 0) {
+		if (now_ms() >= next) {
+			outpack.echo.hdr.icmp6_seq = htons(seq++);
+			clock_gettime(CLOCK_REALTIME, &outpack.echo.sent);
+			if (sendto(icmp_sock, &outpack, sizeof(outpack), 0
+			,	(struct sockaddr *)&addr, sizeof(addr)) <= 0) {
+				cl_log(LOG_ERR, "failed to send an echo request: %s"
+				,	strerror(errno));
+				return -1;
+			}
+			next = now_ms() + PING_INTERVAL;
+		}
+		if (next - now_ms() < left) {
+			left = next - now_ms();
+		}
 
-	for (i = 0; i < 3; i++) {
 		pfd.fd = icmp_sock;
 		pfd.events = POLLIN;
 		pfd.revents = 0;
-		ret = poll(&pfd, 1, 10);
-
-		if (ret < 1)
+		if (poll(&pfd, 1, left > 0 ? left : 0) < 1) {
 			continue;
+		}
+
+		iov.iov_base = &packet;
+		iov.iov_len = sizeof(packet);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
 
 		ret = recvmsg(icmp_sock, &msg, MSG_DONTWAIT);
-		if (ret > 0)
-			return 0;
-		if (ret == 0)
-			break;
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK
+			||	errno == EINTR) {
+				continue;
+			}
+			cl_log(LOG_ERR, "failed to read an echo reply: %s"
+			,	strerror(errno));
+			return -1;
+		}
 
-		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
-			break;
+		/* an answer to one of ours, from the address itself? */
+		if (ret < (int)sizeof(struct echo6)
+		||	packet.echo.hdr.icmp6_type != ICMP6_ECHO_REPLY
+		||	ntohs(packet.echo.hdr.icmp6_id) != id
+		||	(uint16_t)(ntohs(packet.echo.hdr.icmp6_seq) - first)
+				>= (uint16_t)(seq - first)
+		||	memcmp(&from.sin6_addr, addr6, sizeof(*addr6)) != 0) {
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL
+		;	cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET
+			&&	cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				memcpy(&now, CMSG_DATA(cmsg), sizeof(now));
+			}
+		}
+		*rtt = ts_diff_ms(&now, &packet.echo.sent);
+		return 0;
 	}
-	
+
 	return -1;
 }
 
@@ -884,6 +1242,15 @@ meta_data_addr6(void)
 	"      <shortdesc lang=\"en\">Network interface</shortdesc>\n"
 	"      <content type=\"string\" default=\"\" />\n"
 	"    </parameter>\n"
+	"    <parameter name=\"ping_timeout\" unique=\"0\">\n"
+	"      <longdesc lang=\"en\">\n"
+	"	How long, in milliseconds, monitor waits for the address to answer\n"
+	"	an ICMPv6 echo request (it asks again every 100 ms meanwhile)\n"
+	"	before it considers the address gone.\n"
+	"      </longdesc>\n"
+	"      <shortdesc lang=\"en\">Monitor ping timeout</shortdesc>\n"
+	"      <content type=\"integer\" default=\"1000\" />\n"
+	"    </parameter>\n"
 	"  </parameters>\n"
 	"  <actions>\n"
 	"    <action name=\"start\"   timeout=\"15s\" />\n"
@@ -212,6 +212,15 @@ findif()
   fi
   findif_check_params $family || return $?
 
+  # The findif helper asks the kernel for the route it would use
+  # (policy rules and all), which is much cheaper than listing and
+  # sorting the routing table here. It prints the same line we do.
+  if [ -z "$proto" ] && [ -x "$HA_BIN/findif" ] ; then
+    if OCF_RESKEY_cidr_netmask="$netmask" $HA_BIN/findif -s 2>/dev/null ; then
+      return $OCF_SUCCESS
+    fi
+  fi
+
   if [ -n "$netmask" ]; then
       match=$match/$netmask
   fi
@@ -5,6 +5,8 @@
  *
  *	This code is dependent on IPV4 addressing conventions...
  *		Sorry.
+ *	(IPv6 addresses are handled too, but only on Linux, where we
+ *	can ask the kernel through netlink.)
  *
  * Copyright (C) 2000 Alan Robertson <alanr@unix.sh>
  * Copyright (C) 2001 Matt Soffen <matt@soffen.com>
@@ -78,8 +80,14 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#endif
 #include <agent_config.h>
 #include <config.h>
+#include "findif_trie.h"
 
 #define DEBUG 0
 #define	EOS			'\0'
@@ -109,6 +117,8 @@
 #endif
 
 static int OutputInCIDR=0;
+static int OutputLikeScript=0;
+static int BatchMode=0;
 
 
 /*
@@ -128,10 +138,16 @@ typedef int SearchRoute (char *address, struct in_addr *in
 ,        unsigned long *best_netmask, char *errmsg
 ,	int errmsglen);
 
+#ifdef __linux__
+static SearchRoute SearchUsingNetlink;
+#endif
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
 
 static SearchRoute *search_mechs[] = {
+#ifdef __linux__
+	&SearchUsingNetlink,
+#endif
 	&SearchUsingProcRoute,
 	&SearchUsingRouteCmd,
 	NULL
@@ -142,7 +158,7 @@ void GetAddress (char **address, char **netmaskbits
 
 int ConvertNetmaskBitsToInt(char *netmaskbits);
 
-void ValidateNetmaskBits(int bits, unsigned long *netmask);
+int ValidateNetmaskBits(int bits, unsigned long *netmask);
 
 int ValidateIFName (const char *ifname, struct ifreq *ifr);
 
@@ -170,6 +186,804 @@ void usage(int ec);
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+#ifdef __linux__
+#ifndef RTM_F_FIB_MATCH
+#define RTM_F_FIB_MATCH	0x2000
+#endif
+#define NLBUFSIZ	32768
+
+/* What the kernel told us about the route to an address */
+struct nlroute {
+	int		family;
+	int		table;
+	int		type;
+	int		scope;
+	int		cloned;
+	int		ifindex;
+	int		prefixlen;
+	long		metric;
+	int		have_src;
+	unsigned char	dst[16];
+	unsigned char	src[16];
+	size_t		seq;		/* position in the snapshot dump */
+};
+
+/* Looking up one of our own addresses */
+struct nladdr {
+	int		family;
+	const void	*addr;
+	int		ifindex;
+	int		found;
+	int		prefixlen;
+	int		have_brd;
+	struct in_addr	brd;
+};
+
+static int
+addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+static void
+nl_addattr(void *req, int type, const void *data, int alen)
+{
+	struct nlmsghdr	*n = req;
+	struct rtattr	*rta;
+
+	rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(n->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(alen);
+	memcpy(RTA_DATA(rta), data, alen);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/*
+ * Send a request on a fresh rtnetlink socket and hand every answer to
+ * cb.  Returns 0, or an errno value (the kernel's one for NLMSG_ERROR).
+ */
+static int
+nl_request(struct nlmsghdr *req, void (*cb)(struct nlmsghdr *, void *)
+,	void *arg)
+{
+	struct sockaddr_nl	nladdr;
+	struct nlmsghdr		*h;
+	static char	buf[NLBUFSIZ];
+	int	fd, len;
+	int	done = 0;
+	int	rc = 0;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0) {
+		return errno;
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	req->nlmsg_seq = 1;
+	if (sendto(fd, req, req->nlmsg_len, 0
+	,	(struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		rc = errno;
+		goto out;
+	}
+
+	while (!done) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = errno;
+			break;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len)
+		;	h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != req->nlmsg_seq) {
+				continue;
+			}
+			if (h->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+				rc = -err->error;
+				done = 1;
+				break;
+			}
+			cb(h, arg);
+		}
+		if (!(req->nlmsg_flags & NLM_F_DUMP)) {
+			done = 1;
+		}
+	}
+
+  out:
+	close(fd);
+	return rc;
+}
+
+static void
+nl_parse_route(struct nlmsghdr *h, void *arg)
+{
+	struct nlroute	*rt = arg;
+	struct rtmsg	*r = NLMSG_DATA(h);
+	struct rtattr	*rta;
+	int		attrlen = RTM_PAYLOAD(h);
+
+	if (h->nlmsg_type != RTM_NEWROUTE) {
+		return;
+	}
+	rt->family = r->rtm_family;
+	rt->table = r->rtm_table;
+	rt->type = r->rtm_type;
+	rt->scope = r->rtm_scope;
+	rt->cloned = (r->rtm_flags & RTM_F_CLONED) != 0;
+	rt->prefixlen = r->rtm_dst_len;
+	for (rta = RTM_RTA(r); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			rt->table = *(__u32 *)RTA_DATA(rta);
+			break;
+		case RTA_DST:
+			if (RTA_PAYLOAD(rta) <= sizeof(rt->dst)) {
+				memcpy(rt->dst, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			}
+			break;
+		case RTA_OIF:
+			rt->ifindex = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			if (rt->ifindex == 0
+			&&	RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+				struct rtnexthop *nh = RTA_DATA(rta);
+				rt->ifindex = nh->rtnh_ifindex;
+			}
+			break;
+		case RTA_PRIORITY:
+			rt->metric = *(__u32 *)RTA_DATA(rta);
+			break;
+		case RTA_PREFSRC:
+			if (RTA_PAYLOAD(rta) <= sizeof(rt->src)) {
+				memcpy(rt->src, RTA_DATA(rta), RTA_PAYLOAD(rta));
+				rt->have_src = 1;
+			}
+			break;
+		}
+	}
+}
+
+static void
+nl_parse_addr(struct nlmsghdr *h, void *arg)
+{
+	struct nladdr		*a = arg;
+	struct ifaddrmsg	*ifa = NLMSG_DATA(h);
+	struct rtattr		*rta;
+	struct rtattr		*local = NULL, *address = NULL, *brd = NULL;
+	int			attrlen = IFA_PAYLOAD(h);
+
+	if (h->nlmsg_type != RTM_NEWADDR || a->found
+	||	ifa->ifa_family != a->family
+	||	(a->ifindex && (int)ifa->ifa_index != a->ifindex)) {
+		return;
+	}
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case IFA_LOCAL:		local = rta; break;
+		case IFA_ADDRESS:	address = rta; break;
+		case IFA_BROADCAST:	brd = rta; break;
+		}
+	}
+	if (local == NULL) {
+		local = address;
+	}
+	if (local == NULL
+	||	memcmp(RTA_DATA(local), a->addr, addr_len(a->family)) != 0) {
+		return;
+	}
+	a->found = 1;
+	a->ifindex = ifa->ifa_index;
+	a->prefixlen = ifa->ifa_prefixlen;
+	if (brd != NULL && a->family == AF_INET) {
+		memcpy(&a->brd, RTA_DATA(brd), sizeof(a->brd));
+		a->have_brd = 1;
+	}
+}
+
+static int LookupAddr(struct nladdr *a);
+
+/*
+ * Find one of our own addresses (on the given interface, if any).
+ * Returns 0 if it is there.
+ */
+static int
+NetlinkGetAddr(struct nladdr *a)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifaddrmsg	ifa;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.n.nlmsg_type = RTM_GETADDR;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ifa.ifa_family = a->family;
+	a->found = 0;
+	if (nl_request(&req.n, nl_parse_addr, a) != 0 || !a->found) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The address is one of ours: report the interface and the prefix it
+ * was configured with.  The metric of the subnet route is not known.
+ */
+static int
+RouteFromAddr(int family, const void *addr, int oif, struct nlroute *rt)
+{
+	struct nladdr	a;
+
+	memset(&a, 0, sizeof(a));
+	a.family = family;
+	a.addr = addr;
+	a.ifindex = oif;
+	if (LookupAddr(&a) != 0) {
+		return -1;
+	}
+	rt->ifindex = a.ifindex;
+	rt->prefixlen = a.prefixlen;
+	rt->metric = -1;
+	rt->scope = RT_SCOPE_LINK;
+	memcpy(rt->src, addr, addr_len(family));
+	rt->have_src = 1;
+	return 0;
+}
+
+/*
+ * Ask the kernel which route it would use for the address, going
+ * through the policy rules and whatever table they point at.  Returns
+ * the same codes as the SearchRoute mechanisms.
+ *
+ * With RTM_F_FIB_MATCH the kernel answers with the FIB entry that
+ * matched (prefix, table, metric and all) instead of a cloned host
+ * route, so the longest-prefix match is done for us and we do not
+ * have to read the whole routing table.  Kernels older than 4.13
+ * ignore the flag; we recognise the cloned answer and give up.
+ *
+ * If the address is already up on this node the lookup ends in the
+ * local table, whose host route says nothing about the subnet; we
+ * then report the prefix the address was configured with.
+ *
+ * An unreachable, prohibit or blackhole route is an answer, not a
+ * failure: the kernel refuses the lookup with EHOSTUNREACH, EACCES or
+ * EINVAL respectively, and that is "No route", which must not send the
+ * caller on to /proc/net/route (no rules, no route types there).
+ */
+static int
+NetlinkGetRoute(int family, char *address, const void *addr, int oif
+,	struct nlroute *rt, char *errmsg, int errmsglen)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct rtmsg	r;
+		char		buf[64];
+	} req;
+	int	alen = addr_len(family);
+	int	rc;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.r));
+	req.n.nlmsg_type = RTM_GETROUTE;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.r.rtm_family = family;
+	req.r.rtm_dst_len = 8 * alen;
+	req.r.rtm_flags = RTM_F_FIB_MATCH;
+	nl_addattr(&req, RTA_DST, addr, alen);
+	if (oif) {
+		nl_addattr(&req, RTA_OIF, &oif, sizeof(oif));
+	}
+
+	memset(rt, 0, sizeof(*rt));
+	rt->type = RTN_UNSPEC;
+	rc = nl_request(&req.n, nl_parse_route, rt);
+	if (rc == ENETUNREACH || rc == EHOSTUNREACH
+	||	rc == EACCES || rc == EINVAL) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return OCF_ERR_GENERIC;
+	}
+	if (rc != 0 || rt->type == RTN_UNSPEC || rt->cloned) {
+		return -1;
+	}
+
+	if (rt->type == RTN_LOCAL && rt->prefixlen == 8 * alen) {
+		if (RouteFromAddr(family, addr, oif, rt) != 0) {
+			return -1;
+		}
+	} else if (rt->type != RTN_UNICAST && rt->type != RTN_LOCAL) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return OCF_ERR_GENERIC;
+	}
+	if (rt->ifindex == 0) {
+		return -1;
+	}
+	return OCF_SUCCESS;
+}
+
+/*
+ * A copy of the routing tables, the policy rules and our addresses,
+ * taken once for batch mode (-b) so that every address does not cost
+ * another trip to the kernel.
+ *
+ * Only rules that select on the destination are kept: a lookup made
+ * on our behalf has no source address, mark or input interface for
+ * the others to match.  Host routes of the local table are left out,
+ * our own addresses are looked up in the address list instead.
+ * Routes through nexthop objects name no interface in the dump; the
+ * kernel is asked about addresses that get to their tables.
+ */
+struct snaprule {
+	int		family;
+	int		action;
+	int		table;
+	int		dst_len;
+	int		suppress;
+	unsigned char	dst[16];
+};
+
+/* The routes of one table, for longest prefix lookups */
+struct snaptable {
+	int		family;
+	int		table;
+	int		incomplete;	/* has routes without an interface */
+	struct lpm_trie	trie;
+};
+
+struct snapaddr {
+	int		family;
+	int		ifindex;
+	int		prefixlen;
+	int		have_brd;
+	unsigned char	addr[16];
+	struct in_addr	brd;
+};
+
+static struct {
+	int		loaded;
+	struct nlroute	*routes;
+	size_t		nroutes, maxroutes;
+	struct snaprule	*rules;
+	size_t		nrules, maxrules;
+	struct snaptable *tables;
+	size_t		ntables, maxtables;
+	struct snapaddr	*addrs;
+	size_t		naddrs, maxaddrs;
+} snap;
+
+static void *
+snap_grow(void *base, size_t *max, size_t n, size_t size)
+{
+	void	*p;
+
+	if (n < *max) {
+		return base;
+	}
+	*max = *max ? 2 * *max : 256;
+	if ((p = realloc(base, *max * size)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(OCF_ERR_GENERIC);
+	}
+	return p;
+}
+
+static void
+snap_add_route(struct nlmsghdr *h, void *arg)
+{
+	struct nlroute	rt;
+
+	memset(&rt, 0, sizeof(rt));
+	nl_parse_route(h, &rt);
+	if (rt.cloned) {
+		return;
+	}
+	switch (rt.type) {
+	case RTN_UNICAST:
+		break;
+	case RTN_LOCAL:
+		if (rt.ifindex == 0
+		||	rt.prefixlen == 8 * addr_len(rt.family)) {
+			return;
+		}
+		break;
+	case RTN_UNREACHABLE:
+	case RTN_BLACKHOLE:
+	case RTN_PROHIBIT:
+	case RTN_THROW:
+		break;
+	default:
+		return;
+	}
+	snap.routes = snap_grow(snap.routes, &snap.maxroutes
+	,	snap.nroutes, sizeof(*snap.routes));
+	rt.seq = snap.nroutes;
+	snap.routes[snap.nroutes++] = rt;
+}
+
+static void
+snap_add_rule(struct nlmsghdr *h, void *arg)
+{
+	struct fib_rule_hdr	*frh = NLMSG_DATA(h);
+	struct rtattr		*rta;
+	struct snaprule		rule;
+	int			attrlen = RTM_PAYLOAD(h);
+
+	if (h->nlmsg_type != RTM_NEWRULE
+	||	(frh->family != AF_INET && frh->family != AF_INET6)
+	||	frh->src_len != 0 || frh->tos != 0
+	||	(frh->flags & FIB_RULE_INVERT)) {
+		return;
+	}
+	switch (frh->action) {
+	case FR_ACT_TO_TBL:
+	case FR_ACT_BLACKHOLE:
+	case FR_ACT_UNREACHABLE:
+	case FR_ACT_PROHIBIT:
+		break;
+	default:
+		return;
+	}
+
+	memset(&rule, 0, sizeof(rule));
+	rule.family = frh->family;
+	rule.action = frh->action;
+	rule.table = frh->table;
+	rule.dst_len = frh->dst_len;
+	rule.suppress = -1;
+	for (rta = RTM_RTA(frh); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case FRA_DST:
+			if (RTA_PAYLOAD(rta) <= sizeof(rule.dst)) {
+				memcpy(rule.dst, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			}
+			break;
+		case FRA_TABLE:
+			rule.table = *(__u32 *)RTA_DATA(rta);
+			break;
+		case FRA_SUPPRESS_PREFIXLEN:
+			rule.suppress = *(__s32 *)RTA_DATA(rta);
+			break;
+		case FRA_SUPPRESS_IFGROUP:
+			if (*(__s32 *)RTA_DATA(rta) != -1) {
+				return;
+			}
+			break;
+		case FRA_IIFNAME:
+		case FRA_OIFNAME:
+		case FRA_FWMARK:
+		case FRA_TUN_ID:
+		case FRA_L3MDEV:
+		case FRA_UID_RANGE:
+		case FRA_IP_PROTO:
+		case FRA_SPORT_RANGE:
+		case FRA_DPORT_RANGE:
+			/* Cannot match a lookup made for us */
+			return;
+		}
+	}
+	snap.rules = snap_grow(snap.rules, &snap.maxrules
+	,	snap.nrules, sizeof(*snap.rules));
+	snap.rules[snap.nrules++] = rule;
+}
+
+static void
+snap_add_addr(struct nlmsghdr *h, void *arg)
+{
+	struct ifaddrmsg	*ifa = NLMSG_DATA(h);
+	struct rtattr		*rta;
+	struct rtattr		*local = NULL, *address = NULL, *brd = NULL;
+	struct snapaddr		*a;
+	int			attrlen = IFA_PAYLOAD(h);
+
+	if (h->nlmsg_type != RTM_NEWADDR
+	||	(ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)) {
+		return;
+	}
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case IFA_LOCAL:		local = rta; break;
+		case IFA_ADDRESS:	address = rta; break;
+		case IFA_BROADCAST:	brd = rta; break;
+		}
+	}
+	if (local == NULL) {
+		local = address;
+	}
+	if (local == NULL
+	||	RTA_PAYLOAD(local) != (unsigned)addr_len(ifa->ifa_family)) {
+		return;
+	}
+	snap.addrs = snap_grow(snap.addrs, &snap.maxaddrs
+	,	snap.naddrs, sizeof(*snap.addrs));
+	a = &snap.addrs[snap.naddrs++];
+	memset(a, 0, sizeof(*a));
+	a->family = ifa->ifa_family;
+	a->ifindex = ifa->ifa_index;
+	a->prefixlen = ifa->ifa_prefixlen;
+	memcpy(a->addr, RTA_DATA(local), RTA_PAYLOAD(local));
+	if (brd != NULL && ifa->ifa_family == AF_INET) {
+		memcpy(&a->brd, RTA_DATA(brd), sizeof(a->brd));
+		a->have_brd = 1;
+	}
+}
+
+/* Lowest metric first; otherwise keep the order of the dump */
+static int
+route_cmp(const void *a, const void *b)
+{
+	const struct nlroute *ra = a, *rb = b;
+
+	if (ra->metric != rb->metric) {
+		return ra->metric < rb->metric ? -1 : 1;
+	}
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static struct snaptable *
+snap_table(int family, int table)
+{
+	size_t	j;
+
+	for (j = 0; j < snap.ntables; ++j) {
+		if (snap.tables[j].family == family
+		&&	snap.tables[j].table == table) {
+			return &snap.tables[j];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put every route in the trie of its table.  Routes sharing a prefix
+ * go in metric order, so the first that fits is the one to use.
+ */
+static int
+snap_index(void)
+{
+	struct snaptable	*tb;
+	size_t			j;
+
+	qsort(snap.routes, snap.nroutes, sizeof(*snap.routes), route_cmp);
+	for (j = 0; j < snap.nroutes; ++j) {
+		struct nlroute *r = &snap.routes[j];
+
+		if ((tb = snap_table(r->family, r->table)) == NULL) {
+			snap.tables = snap_grow(snap.tables, &snap.maxtables
+			,	snap.ntables, sizeof(*snap.tables));
+			tb = &snap.tables[snap.ntables++];
+			tb->family = r->family;
+			tb->table = r->table;
+			tb->incomplete = 0;
+			lpm_init(&tb->trie);
+		}
+		if (r->type == RTN_UNICAST && r->ifindex == 0) {
+			tb->incomplete = 1;
+			continue;
+		}
+		if (lpm_insert(&tb->trie, r->dst, r->prefixlen, r) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+SnapshotLoad(void)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct rtmsg	r;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.r));
+	req.n.nlmsg_type = RTM_GETROUTE;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.r.rtm_family = AF_UNSPEC;
+	if (nl_request(&req.n, snap_add_route, NULL) != 0) {
+		goto fail;
+	}
+
+	/* struct fib_rule_hdr is laid out like struct rtmsg */
+	req.n.nlmsg_type = RTM_GETRULE;
+	if (nl_request(&req.n, snap_add_rule, NULL) != 0 || snap.nrules == 0) {
+		/* No rules to be had: the usual local, main, default */
+		static const int tables[] = {
+			RT_TABLE_LOCAL, RT_TABLE_MAIN, RT_TABLE_DEFAULT
+		};
+		size_t	j;
+
+		snap.nrules = 0;
+		for (j = 0; j < 2 * sizeof(tables)/sizeof(tables[0]); ++j) {
+			struct snaprule *rule;
+
+			snap.rules = snap_grow(snap.rules, &snap.maxrules
+			,	snap.nrules, sizeof(*snap.rules));
+			rule = &snap.rules[snap.nrules++];
+			memset(rule, 0, sizeof(*rule));
+			rule->family = j < 3 ? AF_INET : AF_INET6;
+			rule->action = FR_ACT_TO_TBL;
+			rule->table = tables[j % 3];
+			rule->suppress = -1;
+		}
+	}
+
+	/* struct ifaddrmsg fits in struct rtmsg; the family comes first */
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.n.nlmsg_type = RTM_GETADDR;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.r.rtm_family = AF_UNSPEC;
+	if (nl_request(&req.n, snap_add_addr, NULL) != 0
+	||	snap_index() != 0) {
+		goto fail;
+	}
+	snap.loaded = 1;
+	return 0;
+
+  fail:
+	while (snap.ntables > 0) {
+		lpm_free(&snap.tables[--snap.ntables].trie);
+	}
+	free(snap.tables);
+	free(snap.routes);
+	free(snap.rules);
+	free(snap.addrs);
+	memset(&snap, 0, sizeof(snap));
+	return -1;
+}
+
+static int
+SnapshotGetAddr(struct nladdr *a)
+{
+	size_t	j;
+
+	for (j = 0; j < snap.naddrs; ++j) {
+		struct snapaddr *sa = &snap.addrs[j];
+
+		if (sa->family != a->family
+		||	(a->ifindex && sa->ifindex != a->ifindex)
+		||	memcmp(sa->addr, a->addr, addr_len(a->family)) != 0) {
+			continue;
+		}
+		a->found = 1;
+		a->ifindex = sa->ifindex;
+		a->prefixlen = sa->prefixlen;
+		a->have_brd = sa->have_brd;
+		a->brd = sa->brd;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+route_via(void *value, void *arg)
+{
+	struct nlroute	*r = value;
+	int		oif = *(int *)arg;
+
+	return !oif || !r->ifindex || r->ifindex == oif;
+}
+
+/* Longest prefix in the table wins, then the lowest metric */
+static struct nlroute *
+snap_lookup_table(int family, int table, const void *addr, int oif)
+{
+	struct snaptable	*tb;
+
+	if ((tb = snap_table(family, table)) == NULL) {
+		return NULL;
+	}
+	return lpm_lookup(&tb->trie, addr, 8 * addr_len(family)
+	,	route_via, &oif);
+}
+
+/*
+ * Walk the rules the way the kernel does; same return codes as
+ * NetlinkGetRoute.
+ */
+static int
+SnapshotGetRoute(int family, char *address, const void *addr, int oif
+,	struct nlroute *rt, char *errmsg, int errmsglen)
+{
+	struct nlroute	*best = NULL;
+	struct snaptable *tb;
+	size_t		j;
+
+	memset(rt, 0, sizeof(*rt));
+	if (RouteFromAddr(family, addr, oif, rt) == 0) {
+		return OCF_SUCCESS;
+	}
+	for (j = 0; j < snap.nrules; ++j) {
+		struct snaprule *rule = &snap.rules[j];
+
+		if (rule->family != family
+		||	!lpm_prefix_match(rule->dst, addr, rule->dst_len)) {
+			continue;
+		}
+		if (rule->action != FR_ACT_TO_TBL) {
+			break;
+		}
+		tb = snap_table(family, rule->table);
+		if (tb != NULL && tb->incomplete) {
+			return NetlinkGetRoute(family, address, addr, oif
+			,	rt, errmsg, errmsglen);
+		}
+		best = snap_lookup_table(family, rule->table, addr, oif);
+		if (best == NULL || best->type == RTN_THROW
+		||	best->prefixlen <= rule->suppress) {
+			best = NULL;
+			continue;
+		}
+		break;
+	}
+	if (best == NULL
+	||	(best->type != RTN_UNICAST && best->type != RTN_LOCAL)) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return OCF_ERR_GENERIC;
+	}
+	*rt = *best;
+	return OCF_SUCCESS;
+}
+
+static int
+LookupAddr(struct nladdr *a)
+{
+	if (snap.loaded) {
+		return SnapshotGetAddr(a);
+	}
+	return NetlinkGetAddr(a);
+}
+
+static int
+LookupRoute(int family, char *address, const void *addr, int oif
+,	struct nlroute *rt, char *errmsg, int errmsglen)
+{
+	if (snap.loaded) {
+		return SnapshotGetRoute(family, address, addr, oif
+		,	rt, errmsg, errmsglen);
+	}
+	return NetlinkGetRoute(family, address, addr, oif
+	,	rt, errmsg, errmsglen);
+}
+
+static int
+SearchUsingNetlink (char *address, struct in_addr *in
+, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	struct nlroute	rt;
+	char		ifname[IF_NAMESIZE];
+	int		rc;
+
+	rc = LookupRoute(AF_INET, address, &in->s_addr, 0
+	,	&rt, errmsg, errmsglen);
+	if (rc != OCF_SUCCESS) {
+		return rc;
+	}
+	if (if_indextoname(rt.ifindex, ifname) == NULL) {
+		return -1;
+	}
+	strncpy(best_if, ifname, best_iflen);
+	*best_netmask = rt.prefixlen == 0 ? 0
+	:	htonl(0xffffffffUL << (32 - rt.prefixlen));
+	return(OCF_SUCCESS);
+}
+#endif /* __linux__ */
+
 static int
 SearchUsingProcRoute (char *address, struct in_addr *in
 , 	struct in_addr *addr_out, char *best_if, size_t best_iflen
@@ -383,18 +1197,31 @@ GetAddress (char **address, char **netmaskbits
 int
 ConvertNetmaskBitsToInt(char *netmaskbits)
 {
-	size_t	nmblen = strnlen(netmaskbits, 3);
+	size_t	nmblen = strnlen(netmaskbits, 4);
 
-	/* Maximum netmask is 32 */
+	/* Maximum netmask is 32 (128 for IPv6) */
 
-	if (nmblen > 2 || nmblen == 0
+	if (nmblen > 3 || nmblen == 0
 	||	(strspn(netmaskbits, "0123456789") != nmblen))
 		return -1;
 	else
 		return atoi(netmaskbits);
 }
 
-void
+/*
+ * A bad parameter ends findif, unless we are working through a batch
+ * of addresses.
+ */
+static int
+param_error(void)
+{
+	if (!BatchMode) {
+		usage(OCF_ERR_CONFIGURED);
+	}
+	return(OCF_ERR_CONFIGURED);
+}
+
+int
 ValidateNetmaskBits(int bits, unsigned long *netmask)
 {
 	/* Maximum netmask is 32 */
@@ -403,14 +1230,14 @@ ValidateNetmaskBits(int bits, unsigned long *netmask)
 		fprintf(stderr
 		,	"Invalid netmask specification [%d]"
 		,	bits);
-		usage(OCF_ERR_CONFIGURED);
-		/*not reached */
+		return param_error();
 	}
 
 	bits = 32 - bits;
 	*netmask = (1L<<(bits))-1L;
 	*netmask = ((~(*netmask))&0xffffffffUL);
 	*netmask = htonl(*netmask);
+	return 0;
 }
 
 int
@@ -558,62 +1385,146 @@ int ConvertQuadToInt(char *dest)
 	return netmask_bits(ntohl(ad.s_addr));
 }
 
-int
-main(int argc, char ** argv) {
+#ifdef __linux__
+/*
+ * IPv6 addresses, and the findif.sh style of output (-s), are only
+ * handled through netlink.
+ *
+ * The -s output is what heartbeat/findif.sh prints: the netmask in
+ * bits, the broadcast address of the local address that the route
+ * would use as source (unless we were given one), and the metric of
+ * the route.  Like findif.sh we then only accept directly connected
+ * IPv4 routes, refuse IPv6 host routes and never use a default route.
+ */
+static int
+FindIfNetlink(int family, char *address, const void *addr, int nmbits
+,	char *bcast_arg, char *if_specified)
+{
+	struct nlroute	rt;
+	struct ifreq	ifr;
+	char	best_if[IF_NAMESIZE];
+	char	brd[INET_ADDRSTRLEN] = "";
+	char	metric[24] = "";
+	char	errmsg[MAXSTR] = "";
+	int	oif = 0;
+	int	rc;
 
-	char *	address = NULL;
-	char *	bcast_arg = NULL;
-	char *	netmaskbits = NULL;
+	if (if_specified != NULL && *if_specified != EOS) {
+		memset(&ifr, 0, sizeof(ifr));
+		if (ValidateIFName(if_specified, &ifr) < 0
+		||	(oif = if_nametoindex(if_specified)) == 0) {
+			return param_error();
+		}
+	}
+
+	rc = LookupRoute(family, address, addr, oif, &rt
+	,	errmsg, sizeof(errmsg));
+	if (rc < 0) {
+		snprintf(errmsg, sizeof(errmsg)
+		,	"Cannot look up the route to %s\n", address);
+		rc = OCF_ERR_GENERIC;
+	} else if (rc == OCF_SUCCESS) {
+		if (rt.prefixlen == 0 && nmbits < 0) {
+			snprintf(errmsg, sizeof(errmsg)
+			,	"ERROR: Cannot use default route w/o netmask [%s]\n"
+			,	address);
+			rc = OCF_ERR_GENERIC;
+		} else if (rt.prefixlen == 0 && OutputLikeScript) {
+			/* findif.sh skips default routes even with nic
+			 * and netmask given: fail, so it looks for itself */
+			fprintf(stderr, "No route to %s but the default route\n"
+			,	address);
+			return(OCF_ERR_GENERIC);
+		} else if (OutputLikeScript && family == AF_INET
+		&&	rt.scope == RT_SCOPE_UNIVERSE) {
+			snprintf(errmsg, sizeof(errmsg)
+			,	"No directly connected route to %s\n", address);
+			rc = OCF_ERR_GENERIC;
+		} else if (OutputLikeScript && family == AF_INET6
+		&&	rt.prefixlen == 128 && !oif && nmbits < 0) {
+			snprintf(errmsg, sizeof(errmsg)
+			,	"Unable to find nic, or netmask mismatch.\n");
+			rc = OCF_ERR_GENERIC;
+		}
+	}
+	if (rc != OCF_SUCCESS) {
+		/* With both nic and netmask given we can do without a route */
+		if (!oif || nmbits < 0) {
+			fprintf(stderr, "%s", errmsg);
+			return(rc);
+		}
+	}
+
+	if (if_indextoname(oif ? oif : rt.ifindex, best_if) == NULL) {
+		fprintf(stderr, "Cannot find interface %d.\n", rt.ifindex);
+		return(OCF_ERR_GENERIC);
+	}
+	if (nmbits < 0) {
+		nmbits = rt.prefixlen;
+	}
+
+	if (bcast_arg != NULL && *bcast_arg != EOS) {
+		strncpy(brd, bcast_arg, sizeof(brd) - 1);
+	} else if (rc == OCF_SUCCESS && family == AF_INET && rt.have_src) {
+		struct nladdr a;
+
+		memset(&a, 0, sizeof(a));
+		a.family = AF_INET;
+		a.addr = rt.src;
+		if (LookupAddr(&a) == 0 && a.have_brd) {
+			inet_ntop(AF_INET, &a.brd, brd, sizeof(brd));
+		}
+	}
+	if (rc == OCF_SUCCESS && rt.metric >= 0) {
+		snprintf(metric, sizeof(metric), "%ld", rt.metric);
+	}
+
+	if (OutputLikeScript) {
+		printf("%s netmask %d broadcast %s metric %s\n"
+		,	best_if, nmbits, brd, metric);
+	}else{
+		printf("%s\tnetmask %d\tbroadcast %s\n"
+		,	best_if, nmbits, brd);
+	}
+	return(0);
+}
+#endif /* __linux__ */
+
+/*
+ * Find the interface for one address and print it.  Returns the exit
+ * code findif is to end with.
+ */
+static int
+FindIf(char *address, char *netmaskbits, char *bcast_arg
+,	char *if_specified)
+{
 	struct in_addr	in;
+	struct in6_addr	in6;
 	struct in_addr	addr_out;
 	unsigned long	netmask = 0;
 	char	best_if[MAXSTR];
-	char *	if_specified = NULL;
 	struct ifreq	ifr;
 	unsigned long	best_netmask = UINT_MAX;
-	int		argerrs	= 0;
-	int		nmbits;
-
-	cmdname=argv[0];
-
+	int		nmbits = -1;
+	int		family;
 
 	memset(&addr_out, 0, sizeof(addr_out));
 	memset(&in, 0, sizeof(in));
+	memset(&in6, 0, sizeof(in6));
 	memset(&ifr, 0, sizeof(ifr));
 
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
-			argerrs=1;
-		}
-		OutputInCIDR=1;
-		break;
-	default:
-		argerrs=1;
-		break;
-	}
-	if (argerrs) {
-		usage(OCF_ERR_ARGS);
-		/* not reached */
-		return(1);
-	}
-
-	GetAddress (&address, &netmaskbits, &bcast_arg
-	,	 &if_specified);
 	if (address == NULL || *address == EOS) {
 		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		return param_error();
 	}
 
 	/* Is the IP address we're supposed to find valid? */
 	 
-	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
+	family = strchr(address, ':') != NULL ? AF_INET6 : AF_INET;
+	if (inet_pton(family, address
+	,	family == AF_INET6 ? (void *)&in6 : (void *)&in) <= 0) {
 		fprintf(stderr, "IP address [%s] not valid.", address);
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		return param_error();
 	}
 
 	if (netmaskbits != NULL && *netmaskbits != EOS) {
@@ -627,19 +1538,40 @@ main(int argc, char ** argv) {
 		if (nmbits < 0) {
 			fprintf(stderr, "Invalid netmask specification"
 			" [%s]", netmaskbits);
-			usage(OCF_ERR_CONFIGURED);
-			/*not reached */
+			return param_error();
 		}
 
 		/* Validate the netmaskbits field */
-		ValidateNetmaskBits (nmbits, &netmask);
+		if (family == AF_INET6) {
+			if (nmbits < 1 || nmbits > 128) {
+				fprintf(stderr
+				,	"Invalid netmask specification [%d]"
+				,	nmbits);
+				return param_error();
+			}
+		}else{
+			if (ValidateNetmaskBits (nmbits, &netmask) != 0) {
+				return(OCF_ERR_CONFIGURED);
+			}
+		}
+	}
+
+	if (family == AF_INET6 || OutputLikeScript) {
+#ifdef __linux__
+		return FindIfNetlink(family, address
+		,	family == AF_INET6 ? (void *)&in6 : (void *)&in
+		,	nmbits, bcast_arg, if_specified);
+#else
+		fprintf(stderr, "%s is only supported on Linux.\n"
+		,	family == AF_INET6 ? "IPv6" : "-s");
+		return(OCF_ERR_UNIMPLEMENTED);
+#endif
 	}
 
 
 	if (if_specified != NULL && *if_specified != EOS) {
 		if(ValidateIFName(if_specified, &ifr) < 0) {
-			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+			return param_error();
 		}
 		strncpy(best_if, if_specified, sizeof(best_if) - 1);
 		*(best_if + sizeof(best_if) - 1) = '\0';
@@ -658,6 +1590,11 @@ main(int argc, char ** argv) {
 			if (!rc) {		/* Mechanism worked */
 				break;
 			}
+#ifdef __linux__
+			if (rc > 0 && *sr == &SearchUsingNetlink) {
+				break;		/* The kernel said no route */
+			}
+#endif
 			sr++;
 		}
 		if (rc != 0) {	/* No route, or all mechanisms failed */
@@ -700,8 +1637,7 @@ main(int argc, char ** argv) {
  		struct in_addr bcast_addr;
  		if (inet_pton(AF_INET, bcast_arg, (void *)&bcast_addr) <= 0) {
  			fprintf(stderr, "Invalid broadcast address [%s].", bcast_arg);
- 			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+ 			return param_error();
  		}
 
 		best_netmask = htonl(best_netmask);
@@ -757,16 +1693,112 @@ main(int argc, char ** argv) {
 	return(0);
 }
 
+/*
+ * Batch mode: read "address[/netmask] [nic]" lines from stdin and
+ * answer each one with the address, a tab and the usual output, or
+ * "failed" and the exit code.  On Linux the routing table is read
+ * once up front instead of once for every address.
+ */
+static int
+FindIfBatch(char *bcast_arg)
+{
+	char	buf[MAXSTR];
+	int	rc = 0;
+
+#ifdef __linux__
+	if (SnapshotLoad() < 0) {
+		fprintf(stderr, "Warning: cannot read the routing table"
+		", looking the addresses up one by one.\n");
+	}
+#endif
+	while (fgets(buf, sizeof(buf), stdin) != NULL) {
+		char *	address;
+		char *	netmaskbits;
+		char *	if_specified;
+		char *	save;
+		int	ec;
+
+		address = strtok_r(buf, " \t\n", &save);
+		if (address == NULL || *address == '#') {
+			continue;
+		}
+		if_specified = strtok_r(NULL, " \t\n", &save);
+		if ((netmaskbits = strchr(address, DELIM)) != NULL) {
+			*netmaskbits++ = EOS;
+		}
+
+		printf("%s\t", address);
+		ec = FindIf(address, netmaskbits, bcast_arg, if_specified);
+		if (ec != 0) {
+			printf("failed %d\n", ec);
+			rc = ec;
+		}
+		fflush(stdout);
+	}
+	return(rc);
+}
+
+int
+main(int argc, char ** argv) {
+
+	char *	address = NULL;
+	char *	bcast_arg = NULL;
+	char *	netmaskbits = NULL;
+	char *	if_specified = NULL;
+	int	argerrs	= 0;
+	int	c;
+
+	cmdname=argv[0];
+
+	while ((c = getopt(argc, argv, "Csb")) != -1) {
+		switch (c) {
+		case 'C':
+			OutputInCIDR=1;
+			break;
+		case 's':
+			OutputLikeScript=1;
+			break;
+		case 'b':
+			BatchMode=1;
+			break;
+		default:
+			argerrs=1;
+			break;
+		}
+	}
+	if (optind < argc) {
+		argerrs=1;
+	}
+	if (argerrs) {
+		usage(OCF_ERR_ARGS);
+		/* not reached */
+		return(1);
+	}
+
+	GetAddress (&address, &netmaskbits, &bcast_arg
+	,	 &if_specified);
+	if (BatchMode) {
+		return FindIfBatch(bcast_arg);
+	}
+	return FindIf(address, netmaskbits, bcast_arg, if_specified);
+}
+
 void
 usage(int ec)
 {
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C] [-s] [-b]\n"
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
+		"    -s: Output \"nic netmask bits broadcast addr "
+			"metric n\" like findif.sh\n"
+		"        (Linux only; IPv6 addresses always use bits)\n"
+		"    -b: Read \"ip[/netmask] [nic]\" lines from stdin and "
+			"answer each\n"
+		"        with \"ip<TAB>result\" or \"ip<TAB>failed rc\"\n"
 		"Environment variables:\n"
 		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
@@ -0,0 +1,281 @@
+/*
+ * findif_bench.c:	Compare route lookups with a linear scan and the trie
+ *
+ * findif_bench [-n <routes>[,<routes>...]] [-l <lookups>] [-s <seed>]
+ *
+ *	For every table size (1000, 100000 and 1000000 routes by
+ *	default) a random IPv4 table is made up, shaped roughly like a
+ *	full BGP table: mostly /24s, the rest spread over /8 to /23,
+ *	with some prefixes present more than once at different metrics,
+ *	plus a default route.  The same random addresses, half of them
+ *	inside some route, are then looked up by scanning the table the
+ *	way findif -b used to and through findif_trie.c, and the answers
+ *	checked against each other.  The scan gets fewer lookups for the
+ *	big tables, the time reported is per lookup.
+ *
+ *	Not installed: "make findif_bench".
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "findif_trie.h"
+
+#define MAXSIZES	16
+#define SCAN_BUDGET	200000000UL	/* route comparisons per size */
+
+struct route {
+	unsigned char	dst[4];
+	int		len;
+	long		metric;
+};
+
+static const char *cmdname = "findif_bench";
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n routes[,routes...]] [-l lookups]"
+	" [-s seed]\n", cmdname);
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+random_addr(unsigned char *a)
+{
+	unsigned long	r = (unsigned long)random();
+
+	a[0] = r >> 24; a[1] = r >> 16; a[2] = r >> 8; a[3] = r;
+	a[0] ^= random() & 0x80;
+}
+
+static int
+random_len(void)
+{
+	return random() % 100 < 60 ? 24 : 8 + random() % 16;
+}
+
+static void
+mask(unsigned char *a, int len)
+{
+	int	j;
+
+	for (j = 0; j < 4; ++j, len -= 8) {
+		if (len <= 0) {
+			a[j] = 0;
+		} else if (len < 8) {
+			a[j] &= 0xff << (8 - len);
+		}
+	}
+}
+
+/* What findif -b did before the trie */
+static struct route *
+scan(struct route *routes, size_t n, const unsigned char *addr)
+{
+	struct route	*best = NULL;
+	size_t		j;
+
+	for (j = 0; j < n; ++j) {
+		struct route *r = &routes[j];
+
+		if (!lpm_prefix_match(r->dst, addr, r->len)) {
+			continue;
+		}
+		if (best == NULL || r->len > best->len
+		||	(r->len == best->len && r->metric < best->metric)) {
+			best = r;
+		}
+	}
+	return best;
+}
+
+static int
+route_cmp(const void *a, const void *b)
+{
+	const struct route *ra = a, *rb = b;
+
+	if (ra->metric != rb->metric) {
+		return ra->metric < rb->metric ? -1 : 1;
+	}
+	return 0;
+}
+
+static int
+run(size_t nroutes, unsigned long nlookups)
+{
+	struct route	*routes;
+	unsigned char	(*addrs)[4];
+	struct lpm_trie	trie;
+	unsigned long	nscan, j, mismatch = 0;
+	double		t0, t_build, t_scan, t_trie;
+	volatile size_t	sink = 0;
+
+	routes = calloc(nroutes, sizeof(*routes));
+	addrs = calloc(nlookups, sizeof(*addrs));
+	if (routes == NULL || addrs == NULL) {
+		fprintf(stderr, "%s: out of memory\n", cmdname);
+		return 1;
+	}
+
+	/* Route 0 is the default route */
+	routes[0].metric = 100;
+	for (j = 1; j < nroutes; ++j) {
+		if (j > 1 && random() % 20 == 0) {
+			/* The same prefix again, another path */
+			routes[j] = routes[random() % (j - 1) + 1];
+		} else {
+			random_addr(routes[j].dst);
+			routes[j].len = random_len();
+			mask(routes[j].dst, routes[j].len);
+		}
+		routes[j].metric = random() % 1000;
+	}
+	for (j = 0; j < nlookups; ++j) {
+		random_addr(addrs[j]);
+		if (j % 2 && nroutes > 1) {
+			struct route *r = &routes[random() % (nroutes - 1) + 1];
+			unsigned char host[4];
+			int k;
+
+			memcpy(host, addrs[j], 4);
+			memcpy(addrs[j], r->dst, 4);
+			for (k = r->len; k < 32; ++k) {
+				if (host[k / 8] & (0x80 >> (k % 8))) {
+					addrs[j][k / 8] |= 0x80 >> (k % 8);
+				}
+			}
+		}
+	}
+
+	/* The scan decides ties by metric; the trie wants them in order */
+	qsort(routes, nroutes, sizeof(*routes), route_cmp);
+	t0 = now();
+	lpm_init(&trie);
+	for (j = 0; j < nroutes; ++j) {
+		if (lpm_insert(&trie, routes[j].dst, routes[j].len
+		,	&routes[j]) != 0) {
+			fprintf(stderr, "%s: out of memory\n", cmdname);
+			return 1;
+		}
+	}
+	t_build = now() - t0;
+
+	nscan = SCAN_BUDGET / nroutes;
+	if (nscan > nlookups) {
+		nscan = nlookups;
+	}
+	if (nscan < 100) {
+		nscan = nlookups < 100 ? nlookups : 100;
+	}
+	t0 = now();
+	for (j = 0; j < nscan; ++j) {
+		struct route *r = scan(routes, nroutes, addrs[j]);
+
+		sink += (r != NULL);
+	}
+	t_scan = now() - t0;
+
+	t0 = now();
+	for (j = 0; j < nlookups; ++j) {
+		struct route *r = lpm_lookup(&trie, addrs[j], 32, NULL, NULL);
+
+		sink += (r != NULL);
+	}
+	t_trie = now() - t0;
+
+	for (j = 0; j < nscan; ++j) {
+		struct route *a = scan(routes, nroutes, addrs[j]);
+		struct route *b = lpm_lookup(&trie, addrs[j], 32, NULL, NULL);
+
+		if (a != b && (a == NULL || b == NULL || a->len != b->len
+		||	a->metric != b->metric)) {
+			mismatch++;
+		}
+	}
+
+	printf("%9lu %10lu %9.1f %12.1f %9.1f %9.0fx %s\n"
+	,	(unsigned long)nroutes, trie.nodes, t_build * 1e3
+	,	t_scan / nscan * 1e9, t_trie / nlookups * 1e9
+	,	(t_scan / nscan) / (t_trie / nlookups)
+	,	mismatch ? "MISMATCH" : "ok");
+
+	lpm_free(&trie);
+	free(routes);
+	free(addrs);
+	return mismatch != 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t		sizes[MAXSIZES] = { 1000, 100000, 1000000 };
+	int		nsizes = 3;
+	unsigned long	nlookups = 1000000;
+	unsigned int	seed = 1;
+	int		c, j, rc = 0;
+	char		*p;
+
+	cmdname = argv[0];
+	while ((c = getopt(argc, argv, "n:l:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			nsizes = 0;
+			for (p = strtok(optarg, ","); p != NULL
+			;	p = strtok(NULL, ",")) {
+				if (nsizes == MAXSIZES || atol(p) < 1) {
+					usage();
+				}
+				sizes[nsizes++] = atol(p);
+			}
+			break;
+		case 'l':
+			if ((nlookups = strtoul(optarg, NULL, 10)) == 0) {
+				usage();
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc || nsizes == 0) {
+		usage();
+	}
+
+	srandom(seed);
+	printf("%9s %10s %9s %12s %9s %10s\n", "routes", "trie nodes"
+	,	"build ms", "scan ns/lkp", "trie ns/lkp", "speedup");
+	for (j = 0; j < nsizes; ++j) {
+		rc |= run(sizes[j], nlookups);
+	}
+	return rc;
+}
@@ -0,0 +1,199 @@
+/*
+ * findif_trie.c:	Longest prefix match over a routing table snapshot
+ *
+ *	A lookup walks at most one node per prefix length that is
+ *	actually present in the table, instead of looking at every
+ *	route, so a full BGP table costs findif -b no more per address
+ *	than a handful of routes does.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include "findif_trie.h"
+
+#define LPM_MAXBYTES	16
+
+struct lpm_node {
+	struct lpm_node	*child[2];
+	unsigned char	key[LPM_MAXBYTES];
+	int		len;
+	int		nvalues;
+	void		**values;
+};
+
+static int
+bit_at(const unsigned char *key, int n)
+{
+	return (key[n / 8] >> (7 - n % 8)) & 1;
+}
+
+int
+lpm_prefix_match(const unsigned char *a, const unsigned char *b, int bits)
+{
+	int	bytes = bits / 8;
+
+	if (memcmp(a, b, bytes) != 0) {
+		return 0;
+	}
+	bits %= 8;
+	return bits == 0
+	||	((a[bytes] ^ b[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+/* How many leading bits, up to max, do a and b share? */
+static int
+common_bits(const unsigned char *a, const unsigned char *b, int max)
+{
+	int	n = 0;
+
+	while (n + 8 <= max && a[n / 8] == b[n / 8]) {
+		n += 8;
+	}
+	while (n < max && bit_at(a, n) == bit_at(b, n)) {
+		n++;
+	}
+	return n;
+}
+
+static struct lpm_node *
+new_node(struct lpm_trie *t, const unsigned char *key, int len)
+{
+	struct lpm_node	*n;
+	int		bytes = (len + 7) / 8;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL) {
+		return NULL;
+	}
+	memcpy(n->key, key, bytes);
+	if (len % 8) {
+		n->key[bytes - 1] &= 0xff << (8 - len % 8);
+	}
+	n->len = len;
+	t->nodes++;
+	return n;
+}
+
+static int
+add_value(struct lpm_node *n, void *value)
+{
+	void	**v;
+
+	v = realloc(n->values, (n->nvalues + 1) * sizeof(*v));
+	if (v == NULL) {
+		return -1;
+	}
+	v[n->nvalues++] = value;
+	n->values = v;
+	return 0;
+}
+
+void
+lpm_init(struct lpm_trie *t)
+{
+	t->root = NULL;
+	t->nodes = 0;
+}
+
+int
+lpm_insert(struct lpm_trie *t, const unsigned char *prefix, int len
+,	void *value)
+{
+	struct lpm_node	**pp = &t->root;
+	struct lpm_node	*n, *mid, *leaf;
+	int		common;
+
+	if (len < 0 || len > 8 * LPM_MAXBYTES) {
+		return -1;
+	}
+	while ((n = *pp) != NULL) {
+		common = common_bits(n->key, prefix
+		,	n->len < len ? n->len : len);
+		if (common < n->len) {
+			/* The prefix forks off (or ends) inside n: split */
+			if ((mid = new_node(t, prefix, common)) == NULL) {
+				return -1;
+			}
+			mid->child[bit_at(n->key, common)] = n;
+			*pp = mid;
+			if (common == len) {
+				return add_value(mid, value);
+			}
+			if ((leaf = new_node(t, prefix, len)) == NULL) {
+				return -1;
+			}
+			mid->child[bit_at(prefix, common)] = leaf;
+			return add_value(leaf, value);
+		}
+		if (n->len == len) {
+			return add_value(n, value);
+		}
+		pp = &n->child[bit_at(prefix, n->len)];
+	}
+	if ((n = new_node(t, prefix, len)) == NULL) {
+		return -1;
+	}
+	*pp = n;
+	return add_value(n, value);
+}
+
+/*
+ * The first acceptable value of the longest prefix covering addr,
+ * which is bits long.
+ */
+void *
+lpm_lookup(const struct lpm_trie *t, const unsigned char *addr, int bits
+,	lpm_filter *ok, void *arg)
+{
+	const struct lpm_node	*n = t->root;
+	void			*best = NULL;
+	int			j;
+
+	while (n != NULL && n->len <= bits
+	&&	lpm_prefix_match(n->key, addr, n->len)) {
+		for (j = 0; j < n->nvalues; ++j) {
+			if (ok == NULL || ok(n->values[j], arg)) {
+				best = n->values[j];
+				break;
+			}
+		}
+		if (n->len == bits) {
+			break;
+		}
+		n = n->child[bit_at(addr, n->len)];
+	}
+	return best;
+}
+
+static void
+free_node(struct lpm_node *n)
+{
+	if (n == NULL) {
+		return;
+	}
+	free_node(n->child[0]);
+	free_node(n->child[1]);
+	free(n->values);
+	free(n);
+}
+
+void
+lpm_free(struct lpm_trie *t)
+{
+	free_node(t->root);
+	lpm_init(t);
+}
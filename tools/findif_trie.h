@@ -0,0 +1,48 @@
+/*
+ * findif_trie.h:	Longest prefix match over a routing table snapshot
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FINDIF_TRIE_H
+#define FINDIF_TRIE_H
+
+/*
+ * A path compressed binary trie keyed by address prefixes (up to 128
+ * bits, in network byte order).  Several values may share a prefix;
+ * they are kept in the order they were inserted.
+ */
+struct lpm_node;
+
+struct lpm_trie {
+	struct lpm_node	*root;
+	unsigned long	nodes;
+};
+
+/* Is this value acceptable to the caller? */
+typedef int lpm_filter(void *value, void *arg);
+
+void	lpm_init(struct lpm_trie *t);
+int	lpm_insert(struct lpm_trie *t, const unsigned char *prefix
+,	int len, void *value);
+void *	lpm_lookup(const struct lpm_trie *t, const unsigned char *addr
+,	int bits, lpm_filter *ok, void *arg);
+void	lpm_free(struct lpm_trie *t);
+
+/* Do the first bits of a and b agree? */
+int	lpm_prefix_match(const unsigned char *a, const unsigned char *b
+,	int bits);
+
+#endif /* FINDIF_TRIE_H */
@@ -49,13 +49,13 @@
 
 #ifdef HAVE_LIBNET_1_0_API
 #	define	LTYPE	struct libnet_link_int
-	static u_char *mk_packet(u_int32_t ip, u_char *device, u_char *macaddr, u_char *broadcast, u_char *netmask, u_short arptype);
-	static int send_arp(struct libnet_link_int *l, u_char *device, u_char *buf);
+	static u_char *mk_packet(u_int32_t ip, u_char device_mac[6], u_char *macaddr, u_short arptype, int *len);
+	static int send_arp(struct libnet_link_int *l, u_char *device, u_char *buf, int len);
 #endif
 #ifdef HAVE_LIBNET_1_1_API
 #	define	LTYPE	libnet_t
-	static libnet_t *mk_packet(libnet_t* lntag, u_int32_t ip, u_char *device, u_char macaddr[6], u_char *broadcast, u_char *netmask, u_short arptype);
-	int send_arp(libnet_t* lntag);
+	static u_char *mk_packet(libnet_t* lntag, u_int32_t ip, u_char device_mac[6], u_char macaddr[6], u_short arptype, int *len);
+	int send_arp(libnet_t* lntag, u_char *buf, int len);
 #endif
 
 #define PIDDIR       HA_VARRUNDIR "/" PACKAGE
@@ -64,7 +64,8 @@
 static char print_usage[]={
 "send_arp: sends out custom ARP packet.\n"
 "  usage: send_arp [-i repeatinterval-ms] [-r repeatcount] [-p pidfile] \\\n"
-"              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
+"              device src_ip_addr src_hw_addr broadcast_ip_addr netmask \\\n"
+"              [device src_ip_addr src_hw_addr broadcast_ip_addr netmask ...]\n"
 "\n"
 "  where:\n"
 "    repeatinterval-ms: timing, in milliseconds of sending arp packets\n"
@@ -91,6 +92,11 @@ static char print_usage[]={
 "    broadcast_ip_addr: ignored\n"
 "\n"
 "    netmask: ignored\n"
+"\n"
+"  Several addresses, on the same or on different devices, may be given.\n"
+"  They are announced together: each round sends the requests for all of\n"
+"  them, then the replies, so the total run time does not depend on the\n"
+"  number of addresses.\n"
 };
 
 static const char * SENDARPNAME = "send_arp";
@@ -102,6 +108,26 @@ int create_pid_directory(const char *piddirectory);
 
 #define AUTO_MAC_ADDR "auto"
 
+/*
+ * An interface we announce on: the libnet handle and the hardware
+ * address are looked up once, however many addresses go out on it.
+ */
+struct arp_if {
+	char		*device;
+	u_char		mac[6];
+	LTYPE		*l;
+};
+
+/* An address to announce, with both of its frames prebuilt */
+struct arp_target {
+	struct arp_if	*ifp;
+	char		*ipaddr;
+	u_char		*request;
+	u_char		*reply;
+	int		len;
+	int		failed;
+};
+
 
 #ifndef LIBNET_ERRBUF_SIZE
 #	define LIBNET_ERRBUF_SIZE 256
@@ -124,32 +150,125 @@ byebye(int nsig)
 }
 
 
+static struct arp_if *
+get_arp_if(struct arp_if *ifs, int *nifs, char *device)
+{
+	char	errbuf[LIBNET_ERRBUF_SIZE];
+	struct arp_if *ifp;
+	int	i;
+
+	for (i = 0; i < *nifs; i++) {
+		if (!strcmp(ifs[i].device, device)) {
+			return &ifs[i];
+		}
+	}
+	ifp = &ifs[*nifs];
+	ifp->device = device;
+
+#if defined(HAVE_LIBNET_1_0_API)
+	ifp->l = libnet_open_link_interface(device, errbuf);
+	if (!ifp->l) {
+		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
+		,	device, errbuf);
+		return NULL;
+	}
+#elif defined(HAVE_LIBNET_1_1_API)
+	/* advanced mode, so that we can cull the packets we build */
+	if ((ifp->l = libnet_init(LIBNET_LINK_ADV, device, errbuf)) == NULL) {
+		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
+		return NULL;
+	}
+#endif
+	if (get_hw_addr(device, ifp->mac) < 0) {
+		cl_log(LOG_ERR, "Cannot find mac address for %s", device);
+		return NULL;
+	}
+	(*nifs)++;
+	return ifp;
+}
+
+/*
+ * Send one frame, the request or the reply, for each address which has
+ * not failed yet. Returns the number of failures.
+ */
+static int
+send_round(struct arp_target *targets, int ntargets, int reply)
+{
+	struct arp_target *t;
+	int	failed = 0;
+	int	c;
+
+	for (t = targets; t < targets + ntargets; t++) {
+		if (t->failed) {
+			continue;
+		}
+#if defined(HAVE_LIBNET_1_0_API)
+		c = send_arp(t->ifp->l, (u_char *)t->ifp->device
+		,	reply ? t->reply : t->request, t->len);
+#elif defined(HAVE_LIBNET_1_1_API)
+		c = send_arp(t->ifp->l, reply ? t->reply : t->request, t->len);
+#endif
+		if (c < 0) {
+			cl_log(LOG_ERR, "Could not send ARP for %s on %s"
+			,	t->ipaddr, t->ifp->device);
+			t->failed = 1;
+			failed++;
+		}
+	}
+	return failed;
+}
+
+/*
+ * Sleep until "deadline" has passed. Keeping deadlines instead of
+ * sleeping for the interval stops the time spent sending from
+ * accumulating.
+ */
+static void
+sleep_until(const struct timeval *deadline)
+{
+	struct timeval	now;
+	long	ms;
+
+	gettimeofday(&now, NULL);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000
+	+	(deadline->tv_usec - now.tv_usec) / 1000;
+	if (ms > 0) {
+		mssleep(ms);
+	}
+}
+
+static void
+tv_add_ms(struct timeval *tv, long ms)
+{
+	tv->tv_sec += ms / 1000;
+	tv->tv_usec += (ms % 1000) * 1000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
 	int	c = -1;
-	char	errbuf[LIBNET_ERRBUF_SIZE];
 	char*	device;
 	char*	ipaddr;
 	char*	macaddr;
-	char*	broadcast;
-	char*	netmask;
 	u_int32_t	ip;
 	u_char	src_mac[6];
 	int	repeatcount = 1;
-	int	j;
+	int	i, j;
 	long	msinterval = 1000;
 	int	flag;
 	char	*pidfilename = NULL;
 	int	pidflen;
 	struct sigaction act;
-
-#ifdef HAVE_LIBNET_1_0_API
-	LTYPE*	l;
-	u_char *request, *reply;
-#elif defined(HAVE_LIBNET_1_1_API)
-	LTYPE *request, *reply;
-#endif
+	struct arp_if *ifs, *ifp;
+	struct arp_target *targets, *t;
+	int	nifs = 0, ntargets;
+	int	failed = 0;
+	struct timeval	next;
 
 	memset(&act, 0, sizeof(struct sigaction));
 	act.sa_flags &= ~SA_RESTART; /* redundant - to stress syscalls should fail */
@@ -181,10 +300,11 @@ main(int argc, char *argv[])
 				break;
 		}
 	}
-	if (argc-optind != 5) {
+	if (argc-optind < 5 || (argc-optind) % 5 != 0) {
 		fprintf(stderr, "%s\n\n", print_usage);
 		return 1;
 	}
+	ntargets = (argc-optind) / 5;
 
 	/*
 	 *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
@@ -192,15 +312,12 @@ main(int argc, char *argv[])
 	 *	argv[optind+3] MAC ADDR		00a0cc34a878
 	 *	argv[optind+4] BROADCAST	192.168.195.186
 	 *	argv[optind+5] NETMASK		ffffffffffff
+	 *
+	 * and so on for further addresses.
 	 */
 
-	device    = argv[optind];
-	ipaddr    = argv[optind+1];
-	macaddr   = argv[optind+2];
-	broadcast = argv[optind+3];
-	netmask   = argv[optind+4];
-
 	if (!pidfilename) {
+		ipaddr = argv[optind+1];
 		pidflen = strlen(PIDFILE_BASE) + strlen(ipaddr);
 		pidfilename = calloc(1, pidflen);
 		snprintf(pidfilename, pidflen, "%s%s",
@@ -211,111 +328,87 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (!strcasecmp(macaddr, AUTO_MAC_ADDR)) {
-		if (get_hw_addr(device, src_mac) < 0) {
-			 cl_log(LOG_ERR, "Cannot find mac address for %s",
-					 device);
-			 unlink(pidfilename);
-			 return EXIT_FAILURE;
-		}
-	}
-	else {
-		convert_macaddr((unsigned char *)macaddr, src_mac);
+	ifs = calloc(ntargets, sizeof(*ifs));
+	targets = calloc(ntargets, sizeof(*targets));
+	if (!ifs || !targets) {
+		cl_log(LOG_ERR, "Memory allocation failure");
+		unlink(pidfilename);
+		return EXIT_FAILURE;
 	}
 
 /*
  * We need to send both a broadcast ARP request as well as the ARP response we
  * were already sending.  All the interesting research work for this fix was
  * done by Masaki Hasegawa <masaki-h@pp.iij4u.or.jp> and his colleagues.
+ *
+ * All the frames are built up front, so that the loop below only sends.
  */
+	for (i = 0; i < ntargets; i++) {
+		t = &targets[i];
+		device    = argv[optind + 5*i];
+		ipaddr    = argv[optind + 5*i + 1];
+		macaddr   = argv[optind + 5*i + 2];
+
+		if ((ifp = get_arp_if(ifs, &nifs, device)) == NULL) {
+			unlink(pidfilename);
+			return EXIT_FAILURE;
+		}
+		t->ifp = ifp;
+		t->ipaddr = ipaddr;
+
+		if (!strcasecmp(macaddr, AUTO_MAC_ADDR)) {
+			memcpy(src_mac, ifp->mac, 6);
+		}
+		else {
+			convert_macaddr((unsigned char *)macaddr, src_mac);
+		}
 
 #if defined(HAVE_LIBNET_1_0_API)
 #ifdef ON_DARWIN
-	if ((ip = libnet_name_resolve((unsigned char*)ipaddr, 1)) == -1UL) {
+		if ((ip = libnet_name_resolve((unsigned char*)ipaddr, 1)) == -1UL) {
 #else
-	if ((ip = libnet_name_resolve(ipaddr, 1)) == -1UL) {
+		if ((ip = libnet_name_resolve(ipaddr, 1)) == -1UL) {
 #endif
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-
-	l = libnet_open_link_interface(device, errbuf);
-	if (!l) {
-		cl_log(LOG_ERR, "libnet_open_link_interface on %s: %s"
-		,	device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	request = mk_packet(ip, (unsigned char*)device, src_mac
-		, (unsigned char*)broadcast, (unsigned char*)netmask
-		, ARPOP_REQUEST);
-	reply = mk_packet(ip, (unsigned char*)device, src_mac
-		, (unsigned char *)broadcast
-		, (unsigned char *)netmask, ARPOP_REPLY);
-	if (!request || !reply) {
-		cl_log(LOG_ERR, "could not create packets");
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	for (j=0; j < repeatcount; ++j) {
-		c = send_arp(l, (unsigned char*)device, request);
-		if (c < 0) {
-			break;
-		}
-		mssleep(msinterval / 2);
-		c = send_arp(l, (unsigned char*)device, reply);
-		if (c < 0) {
-			break;
-		}
-		if (j != repeatcount-1) {
-			mssleep(msinterval / 2);
+			cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
+			unlink(pidfilename);
+			return EXIT_FAILURE;
 		}
-	}
+		t->request = mk_packet(ip, ifp->mac, src_mac, ARPOP_REQUEST
+		,	&t->len);
+		t->reply = mk_packet(ip, ifp->mac, src_mac, ARPOP_REPLY
+		,	&t->len);
 #elif defined(HAVE_LIBNET_1_1_API)
-	if ((request=libnet_init(LIBNET_LINK, device, errbuf)) == NULL) {
-		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	if ((reply=libnet_init(LIBNET_LINK, device, errbuf)) == NULL) {
-		cl_log(LOG_ERR, "libnet_init failure on %s: %s", device, errbuf);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	if ((signed)(ip = libnet_name2addr4(request, ipaddr, 1)) == -1) {
-		cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	request = mk_packet(request, ip, (unsigned char*)device, src_mac
-		, (unsigned char*)broadcast, (unsigned char*)netmask
-		, ARPOP_REQUEST);
-	reply = mk_packet(reply, ip, (unsigned char*)device, src_mac
-		, (unsigned char *)broadcast
-		, (unsigned char *)netmask, ARPOP_REPLY);
-	if (!request || !reply) {
-		cl_log(LOG_ERR, "could not create packets");
-		unlink(pidfilename);
-		return EXIT_FAILURE;
-	}
-	for (j=0; j < repeatcount; ++j) {
-		c = send_arp(request);
-		if (c < 0) {
-			break;
+		if ((signed)(ip = libnet_name2addr4(ifp->l, ipaddr, 1)) == -1) {
+			cl_log(LOG_ERR, "Cannot resolve IP address [%s]", ipaddr);
+			unlink(pidfilename);
+			return EXIT_FAILURE;
 		}
-		mssleep(msinterval / 2);
-		c = send_arp(reply);
-		if (c < 0) {
-			break;
+		t->request = mk_packet(ifp->l, ip, ifp->mac, src_mac
+		,	ARPOP_REQUEST, &t->len);
+		t->reply = mk_packet(ifp->l, ip, ifp->mac, src_mac
+		,	ARPOP_REPLY, &t->len);
+#else
+#	error "Must have LIBNET API version defined."
+#endif
+		if (!t->request || !t->reply) {
+			cl_log(LOG_ERR, "could not create packets");
+			unlink(pidfilename);
+			return EXIT_FAILURE;
 		}
+	}
+
+	gettimeofday(&next, NULL);
+	for (j=0; j < repeatcount && failed < ntargets; ++j) {
+		failed += send_round(targets, ntargets, 0);
+		tv_add_ms(&next, msinterval / 2);
+		sleep_until(&next);
+		failed += send_round(targets, ntargets, 1);
 		if (j != repeatcount-1) {
-			mssleep(msinterval / 2);
+			tv_add_ms(&next, msinterval / 2);
+			sleep_until(&next);
 		}
 	}
-#else
-#	error "Must have LIBNET API version defined."
-#endif
+	c = failed ? -1 : 0;
 
 	unlink(pidfilename);
 	return c < 0  ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -435,11 +528,10 @@ get_hw_addr(char *device, u_char mac[6])
 
 #ifdef HAVE_LIBNET_1_0_API
 u_char *
-mk_packet(u_int32_t ip, u_char *device, u_char *macaddr, u_char *broadcast, u_char *netmask, u_short arptype)
+mk_packet(u_int32_t ip, u_char device_mac[6], u_char *macaddr, u_short arptype, int *len)
 {
 	u_char *buf;
 	u_char *target_mac;
-	u_char device_mac[6];
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
@@ -449,15 +541,7 @@ mk_packet(u_int32_t ip, u_char *device, u_char *macaddr, u_char *broadcast, u_ch
 		return NULL;
 	}
 
-	/* Convert ASCII Mac Address to 6 Hex Digits. */
-
 	/* Ethernet header */
-	if (get_hw_addr((char*)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return NULL;
-	}
-
 	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
 	,	buf) == -1) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
@@ -495,6 +579,7 @@ mk_packet(u_int32_t ip, u_char *device, u_char *macaddr, u_char *broadcast, u_ch
 		libnet_destroy_packet(&buf);
 		return NULL;
 	}
+	*len = LIBNET_ARP_H + LIBNET_ETH_H;
 	return buf;
 }
 #endif /* HAVE_LIBNET_1_0_API */
@@ -503,11 +588,13 @@ mk_packet(u_int32_t ip, u_char *device, u_char *macaddr, u_char *broadcast, u_ch
 
 
 #ifdef HAVE_LIBNET_1_1_API
-libnet_t*
-mk_packet(libnet_t* lntag, u_int32_t ip, u_char *device, u_char macaddr[6], u_char *broadcast, u_char *netmask, u_short arptype)
+u_char *
+mk_packet(libnet_t* lntag, u_int32_t ip, u_char device_mac[6], u_char macaddr[6], u_short arptype, int *len)
 {
 	u_char *target_mac;
-	u_char device_mac[6];
+	u_char *buf;
+	u_int8_t *packet;
+	u_int32_t packet_s;
 	u_char bcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 	u_char zero_mac[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
@@ -540,32 +627,43 @@ mk_packet(libnet_t* lntag, u_int32_t ip, u_char *device, u_char macaddr[6], u_ch
 		0		/* packet id */
 	) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_arp failed:");
+		libnet_clear_packet(lntag);
 		return NULL;
 	}
 
 	/* Ethernet header */
-	if (get_hw_addr((char *)device, device_mac) < 0) {
-		cl_log(LOG_ERR, "Cannot find mac address for %s",
-				device);
-		return NULL;
-	}
-
 	if (libnet_build_ethernet(bcast_mac, device_mac, ETHERTYPE_ARP, NULL, 0
 	,	lntag, 0) == -1 ) {
 		cl_log(LOG_ERR, "libnet_build_ethernet failed:");
+		libnet_clear_packet(lntag);
+		return NULL;
+	}
+
+	/* take a copy of the frame, and leave lntag free for the next one */
+	if (libnet_adv_cull_packet(lntag, &packet, &packet_s) == -1) {
+		cl_log(LOG_ERR, "libnet_adv_cull_packet failed: %s"
+		,	libnet_geterror(lntag));
+		libnet_clear_packet(lntag);
 		return NULL;
 	}
-	return lntag;
+	buf = malloc(packet_s);
+	if (buf) {
+		memcpy(buf, packet, packet_s);
+		*len = packet_s;
+	}
+	libnet_adv_free_packet(lntag, packet);
+	libnet_clear_packet(lntag);
+	return buf;
 }
 #endif /* HAVE_LIBNET_1_1_API */
 
 #ifdef HAVE_LIBNET_1_0_API
 int
-send_arp(struct libnet_link_int *l, u_char *device, u_char *buf)
+send_arp(struct libnet_link_int *l, u_char *device, u_char *buf, int len)
 {
 	int n;
 
-	n = libnet_write_link_layer(l, (char*)device, buf, LIBNET_ARP_H + LIBNET_ETH_H);
+	n = libnet_write_link_layer(l, (char*)device, buf, len);
 	if (n == -1) {
 		cl_log(LOG_ERR, "libnet_write_link_layer failed");
 	}
@@ -575,13 +673,14 @@ send_arp(struct libnet_link_int *l, u_char *device, u_char *buf)
 
 #ifdef HAVE_LIBNET_1_1_API
 int
-send_arp(libnet_t* lntag)
+send_arp(libnet_t* lntag, u_char *buf, int len)
 {
 	int n;
 
-	n = libnet_write(lntag);
+	n = libnet_adv_write_link(lntag, buf, len);
 	if (n == -1) {
-		cl_log(LOG_ERR, "libnet_write failed");
+		cl_log(LOG_ERR, "libnet_adv_write_link failed: %s"
+		,	libnet_geterror(lntag));
 	}
 	return (n);
 }
@@ -37,8 +37,17 @@
 #include <net/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <net/if_arp.h>
 #include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
 #ifdef CAPABILITIES
 #include <sys/prctl.h>
 #include <sys/capability.h>
@@ -51,6 +60,10 @@
 #include <errno.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
 #include <arpa/inet.h>
 
 #ifdef USE_SYSFS
@@ -83,6 +96,9 @@ static void usage(void) __attribute__((noreturn));
 struct device {
 	const char *name;
 	int ifindex;
+	/* from find_device_by_netlink() */
+	unsigned char brd[32];
+	size_t brdlen;
 #ifndef WITHOUT_IFADDRS
 	struct ifaddrs *ifa;
 #endif
@@ -97,6 +113,8 @@ struct device device = {
 };
 char *source;
 struct in_addr src, dst;
+struct in6_addr dst6;
+int na_mode;
 char *target;
 int dad, unsolicited, advert;
 int quiet;
@@ -114,6 +132,17 @@ struct timeval start, last;
 int sent, brd_sent;
 int received, brd_recv, req_recv;
 
+/*
+ * Pacing schedule: pace[i] is the delay in ms before the (i+1)th packet,
+ * the last entry repeats. The default is the classic arping cadence.
+ */
+#define PACE_MAX	16
+
+static int pace[PACE_MAX] = { 0, 1000 };
+static int pace_num = 2;
+static int pace_idx;
+static int tfd = -1;
+
 #ifndef CAPABILITIES
 static uid_t euid;
 #endif
@@ -140,7 +169,8 @@ static char print_usage[]={
 "              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
 "\n"
 "  where:\n"
-"    repeatinterval-ms: ignored\n"
+"    repeatinterval-ms: interval between ARP packets in milliseconds,\n"
+"                       ignored if -P is given.\n"
 "\n"
 "    repeatcount: how many ARP packets to send.\n"
 "\n"
@@ -157,9 +187,37 @@ static char print_usage[]={
 "\n"
 "    netmask: ignored\n"
 "\n"
+"  src_ip_addr may also be an IPv6 address: unsolicited neighbor\n"
+"  advertisements are sent instead of ARPs then (Ethernet only).\n"
+"\n"
 "  Notes: Other options of iputils-arping may be accepted but it's not\n"
 "         intended to be supported in this binary.\n"
 "\n"
+"  -P ms[,ms...]: pacing schedule, the delay before each packet in\n"
+"         milliseconds; the last value repeats. E.g. -P 0,20,100,500,1000\n"
+"         sends the first packets within tens of milliseconds, then\n"
+"         backs off to one per second.\n"
+"\n"
+"  -N ip[,ip...]: after announcing, check that these neighbors send their\n"
+"         traffic for src_ip_addr to us, and report after how many ms\n"
+"         from the first announcement; wait at most -T ms (3000).\n"
+"\n"
+"  announcer: send_arp [-A] [-q] [-P ms[,ms...]] -S socket\n"
+"         keeps running and sends gratuitous ARPs on request, see below.\n"
+"\n"
+"  announcer client: send_arp -C socket [-i ms | -P ms[,ms...]] -r count \\\n"
+"              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
+"         has the announcer on socket send the ARPs and returns at once;\n"
+"         src_hw_addr may be \"auto\" or a hardware address.\n"
+"    send_arp -C socket -K src_ip_addr\n"
+"         cancels announcements for src_ip_addr.\n"
+"\n"
+"  burst mode: send_arp -U|-A -B [-c count] [-w timeout] [-P ms[,ms...]] \\\n"
+"              -I device [ip_addr ...]\n"
+"         sends gratuitous ARPs (unsolicited NAs for IPv6 addresses)\n"
+"         for all given addresses, read from stdin\n"
+"         (one per line) if none or \"-\" is given.\n"
+"\n"
 };
 
 void usage(void)
@@ -183,6 +241,7 @@ void usage(void)
 		"  -V : print version and exit\n"
 		"  -c count : how many packets to send\n"
 		"  -w timeout : how long to wait for a reply\n"
+		"  -P ms[,ms...] : delay before each packet, the last value repeats\n"
 		"  -I device : which ethernet device to use"
 #ifdef DEFAULT_DEVICE_STR
 			" (" DEFAULT_DEVICE_STR ")"
@@ -324,12 +383,9 @@ static void drop_capabilities(void)
 #endif
 }
 
-static int send_pack(int s, struct in_addr src, struct in_addr dst,
+static int build_pack(unsigned char *buf, struct in_addr src, struct in_addr dst,
 	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
 {
-	int err;
-	struct timeval now;
-	unsigned char buf[256];
 	struct arphdr *ah = (struct arphdr*)buf;
 	unsigned char *p = (unsigned char *)(ah+1);
 
@@ -356,9 +412,153 @@ static int send_pack(int s, struct in_addr src, struct in_addr dst,
 	memcpy(p, &dst, 4);
 	p+=4;
 
+	return p-buf;
+}
+
+static unsigned short icmp6_cksum(const struct ip6_hdr *ip6,
+				  const unsigned char *p, int len)
+{
+	const unsigned short *w = (const unsigned short *)&ip6->ip6_src;
+	unsigned long sum = 0;
+	int i;
+
+	/* pseudo header: source, destination, length, next header */
+	for (i = 0; i < 16; i++)
+		sum += w[i];
+	sum += htons(len);
+	sum += htons(IPPROTO_ICMPV6);
+
+	w = (const unsigned short *)p;
+	for (i = 0; i < len / 2; i++)
+		sum += w[i];
+	if (len & 1)
+		sum += htons(p[len - 1] << 8);
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/*
+ * build_na()
+ *
+ * Build an unsolicited neighbor advertisement for target, the IPv6 flavour
+ * of a gratuitous ARP (RFC 4861, 7.2.6), to go out on our packet socket.
+ * We fill in the IPv6 header and the checksum ourselves; TO is set up for
+ * the all-nodes multicast group. Ethernet only, returns -1 otherwise.
+ */
+static int build_na(unsigned char *buf, const struct in6_addr *target,
+		    struct sockaddr_ll *ME, struct sockaddr_ll *TO)
+{
+	static const unsigned char all_nodes_ll[ETH_ALEN] =
+		{ 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
+	struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+	struct nd_neighbor_advert *na = (struct nd_neighbor_advert *)(ip6 + 1);
+	struct nd_opt_hdr *opt = (struct nd_opt_hdr *)(na + 1);
+	int plen = sizeof(*na) + sizeof(*opt) + ETH_ALEN;
+
+	if (ME->sll_hatype != ARPHRD_ETHER || ME->sll_halen != ETH_ALEN)
+		return -1;
+
+	memset(buf, 0, sizeof(*ip6) + plen);
+	ip6->ip6_flow = htonl(6 << 28);
+	ip6->ip6_plen = htons(plen);
+	ip6->ip6_nxt = IPPROTO_ICMPV6;
+	ip6->ip6_hlim = 255;	/* required, RFC 4861 7.1.2 */
+	ip6->ip6_src = *target;
+	inet_pton(AF_INET6, "ff02::1", &ip6->ip6_dst);
+
+	na->nd_na_type = ND_NEIGHBOR_ADVERT;
+	na->nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE;
+	na->nd_na_target = *target;
+	opt->nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	opt->nd_opt_len = 1;	/* in units of 8 octets */
+	memcpy(opt + 1, ME->sll_addr, ETH_ALEN);
+	na->nd_na_cksum = icmp6_cksum(ip6, (unsigned char *)na, plen);
+
+	*TO = *ME;
+	TO->sll_protocol = htons(ETH_P_IPV6);
+	memcpy(TO->sll_addr, all_nodes_ll, ETH_ALEN);
+	return sizeof(*ip6) + plen;
+}
+
+/*
+ * An address to announce: gratuitous ARP for IPv4, unsolicited neighbor
+ * advertisement for IPv6.
+ */
+struct target {
+	int family;
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} u;
+};
+
+static int target_parse(const char *arg, struct target *t)
+{
+	memset(t, 0, sizeof(*t));
+	if (inet_pton(AF_INET6, arg, &t->u.in6) == 1) {
+		t->family = AF_INET6;
+		return 0;
+	}
+	if (inet_aton(arg, &t->u.in) == 1) {
+		t->family = AF_INET;
+		return 0;
+	}
+	return -1;
+}
+
+static int target_equal(const struct target *a, const struct target *b)
+{
+	if (a->family != b->family)
+		return 0;
+	if (a->family == AF_INET6)
+		return IN6_ARE_ADDR_EQUAL(&a->u.in6, &b->u.in6);
+	return a->u.in.s_addr == b->u.in.s_addr;
+}
+
+static const char *target_ntop(const struct target *t)
+{
+	static char buf[INET6_ADDRSTRLEN];
+
+	return inet_ntop(t->family, &t->u, buf, sizeof(buf));
+}
+
+/*
+ * build_announce()
+ *
+ * Build the announcement for t into buf and its destination into TO,
+ * which must have room for a sockaddr_storage. Returns the packet length,
+ * or -1 if t cannot be announced on this device.
+ */
+static int build_announce(unsigned char *buf, const struct target *t,
+			  struct sockaddr_ll *ME, struct sockaddr_ll *HE,
+			  struct sockaddr_ll *TO)
+{
+	if (t->family == AF_INET6)
+		return build_na(buf, &t->u.in6, ME, TO);
+	memcpy(TO, HE, SLL_LEN(HE->sll_halen));
+	return build_pack(buf, t->u.in, t->u.in, ME, HE);
+}
+
+static int send_pack(int s, struct in_addr src, struct in_addr dst,
+	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	int err, len;
+	struct timeval now;
+	unsigned char buf[256];
+
+	if (na_mode) {
+		struct sockaddr_storage to;
+
+		len = build_na(buf, &dst6, ME, (struct sockaddr_ll *)&to);
+		HE = (struct sockaddr_ll *)&to;
+	} else {
+		len = build_pack(buf, src, dst, ME, HE);
+	}
 	gettimeofday(&now, NULL);
-	err = sendto(s, buf, p-buf, 0, (struct sockaddr*)HE, SLL_LEN(ah->ar_hln));
-	if (err == p-buf) {
+	err = sendto(s, buf, len, 0, (struct sockaddr*)HE, SLL_LEN(ME->sll_halen));
+	if (err == len) {
 		last = now;
 		sent++;
 		if (!unicasting)
@@ -367,8 +567,310 @@ static int send_pack(int s, struct in_addr src, struct in_addr dst,
 	return err;
 }
 
+/*
+ * verification mode (-N neighbor[,neighbor...])
+ *
+ * Measure how long the given neighbors (gateway, peers) take to send their
+ * traffic for the announced address to us. Before announcing, the hardware
+ * address of each neighbor is learned with an ARP probe from 0.0.0.0, which
+ * leaves its ARP cache alone. From the first announcement on, ICMP echo
+ * requests from the announced address go to every neighbor each
+ * VERIFY_PROBE_MSEC. A neighbor addresses its reply by its ARP cache, so
+ * the first reply we see is when it took our MAC. Once announcing is over
+ * we wait for the rest, at most -T ms from the first announcement.
+ */
+#define VERIFY_PROBE_MSEC	20
+#define VERIFY_RESOLVE_MSEC	1000
+#define VERIFY_RESOLVE_TRIES	3
+
+struct verify_peer {
+	struct in_addr addr;
+	unsigned char hwaddr[32];
+	int resolved;
+	int updated;
+	long msec;
+};
+
+static struct verify_peer *peers;
+static int npeers;
+static long verify_budget = 3000;
+static int verify_fd = -1;
+static int verify_tfd = -1;
+static int verify_done;
+static int announce_done;
+static unsigned short verify_id, verify_seq;
+
+static void finish(void);
+
+static void verify_add(char *list)
+{
+	char *p, *save;
+
+	for (p = strtok_r(list, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		peers = realloc(peers, (npeers + 1) * sizeof(*peers));
+		if (!peers) {
+			perror("malloc");
+			exit(2);
+		}
+		memset(&peers[npeers], 0, sizeof(*peers));
+		if (inet_aton(p, &peers[npeers].addr) != 1) {
+			fprintf(stderr, "send_arp: invalid neighbor %s\n", p);
+			exit(2);
+		}
+		npeers++;
+	}
+}
+
+/* needs CAP_NET_RAW */
+static void verify_open(void)
+{
+	struct sockaddr_ll sll;
+	struct itimerspec its;
+
+	enable_capability_raw();
+	verify_fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_IP));
+	disable_capability_raw();
+	if (verify_fd < 0) {
+		perror("send_arp: socket");
+		exit(2);
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_ifindex = device.ifindex;
+	if (bind(verify_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("send_arp: bind");
+		exit(2);
+	}
+
+	verify_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (verify_tfd < 0) {
+		perror("send_arp: timerfd_create");
+		exit(2);
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = VERIFY_PROBE_MSEC * 1000000L;
+	its.it_interval = its.it_value;
+	timerfd_settime(verify_tfd, 0, &its, NULL);
+	verify_id = getpid() & 0xffff;
+}
+
+/*
+ * verify_resolve()
+ *
+ * Learn the hardware addresses of the neighbors, before we announce.
+ */
+static void verify_resolve(int s, struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	struct in_addr any = { 0 };
+	unsigned char buf[256];
+	int saved = advert;
+	int i, try, pending = npeers;
+
+	for (try = 0; try < VERIFY_RESOLVE_TRIES && pending; try++) {
+		struct timeval t0, now;
+
+		/* a probe is a request, even in -A mode */
+		advert = 0;
+		for (i = 0; i < npeers; i++) {
+			int len;
+
+			if (peers[i].resolved)
+				continue;
+			len = build_pack(buf, any, peers[i].addr, ME, HE);
+			sendto(s, buf, len, 0, (struct sockaddr *)HE, SLL_LEN(ME->sll_halen));
+		}
+		advert = saved;
+
+		gettimeofday(&t0, NULL);
+		now = t0;
+		while (pending && MS_TDIFF(now, t0) < VERIFY_RESOLVE_MSEC / VERIFY_RESOLVE_TRIES) {
+			struct pollfd pfd = { .fd = s, .events = POLLIN };
+			struct arphdr *ah = (struct arphdr *)buf;
+			unsigned char *p = (unsigned char *)(ah + 1);
+			struct in_addr spa;
+			int n;
+
+			if (poll(&pfd, 1, VERIFY_RESOLVE_MSEC / VERIFY_RESOLVE_TRIES -
+					  MS_TDIFF(now, t0)) > 0 &&
+			    (n = recv(s, buf, sizeof(buf), 0)) >= (int)sizeof(*ah) &&
+			    ah->ar_op == htons(ARPOP_REPLY) &&
+			    ah->ar_pro == htons(ETH_P_IP) && ah->ar_pln == 4 &&
+			    ah->ar_hln <= sizeof(peers[0].hwaddr) &&
+			    n >= (int)sizeof(*ah) + 2 * (ah->ar_hln + 4)) {
+				memcpy(&spa, p + ah->ar_hln, 4);
+				for (i = 0; i < npeers; i++) {
+					if (!peers[i].resolved &&
+					    peers[i].addr.s_addr == spa.s_addr) {
+						memcpy(peers[i].hwaddr, p, ah->ar_hln);
+						peers[i].resolved = 1;
+						pending--;
+					}
+				}
+			}
+			gettimeofday(&now, NULL);
+		}
+	}
+}
+
+static unsigned short in_cksum(const void *data, int len)
+{
+	const unsigned short *w = data;
+	unsigned long sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *w++;
+	if (len)
+		sum += htons(*(const unsigned char *)w << 8);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static void verify_probe(void)
+{
+	struct {
+		struct iphdr ip;
+		struct icmphdr icmp;
+	} pkt;
+	struct sockaddr_storage to;
+	struct sockaddr_ll *TO = (struct sockaddr_ll *)&to;
+	int i;
+
+	if (start.tv_sec == 0)
+		return;		/* not announcing yet */
+
+	for (i = 0; i < npeers; i++) {
+		if (!peers[i].resolved || peers[i].updated)
+			continue;
+
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.ip.version = 4;
+		pkt.ip.ihl = sizeof(pkt.ip) / 4;
+		pkt.ip.tot_len = htons(sizeof(pkt));
+		pkt.ip.id = htons(verify_seq);
+		pkt.ip.ttl = 64;
+		pkt.ip.protocol = IPPROTO_ICMP;
+		pkt.ip.saddr = src.s_addr;
+		pkt.ip.daddr = peers[i].addr.s_addr;
+		pkt.ip.check = in_cksum(&pkt.ip, sizeof(pkt.ip));
+		pkt.icmp.type = ICMP_ECHO;
+		pkt.icmp.un.echo.id = htons(verify_id);
+		pkt.icmp.un.echo.sequence = htons(verify_seq++);
+		pkt.icmp.checksum = in_cksum(&pkt.icmp, sizeof(pkt.icmp));
+
+		memcpy(&to, &me, sizeof(to));
+		TO->sll_protocol = htons(ETH_P_IP);
+		memcpy(TO->sll_addr, peers[i].hwaddr, TO->sll_halen);
+		sendto(verify_fd, &pkt, sizeof(pkt), 0, (struct sockaddr *)TO,
+		       SLL_LEN(TO->sll_halen));
+	}
+}
+
+static int verify_complete(void);
+
+static void verify_recv(void)
+{
+	unsigned char packet[4096];
+	struct iphdr *ip = (struct iphdr *)packet;
+	struct icmphdr *icmp;
+	struct sockaddr_ll from;
+	socklen_t alen = sizeof(from);
+	struct timeval now;
+	int n, i;
+
+	n = recvfrom(verify_fd, packet, sizeof(packet), 0,
+		     (struct sockaddr *)&from, &alen);
+	/* only what was sent to our MAC counts */
+	if (n < (int)sizeof(*ip) || from.sll_pkttype != PACKET_HOST)
+		return;
+	if (ip->version != 4 || ip->protocol != IPPROTO_ICMP ||
+	    n < ip->ihl * 4 + (int)sizeof(*icmp))
+		return;
+	icmp = (struct icmphdr *)(packet + ip->ihl * 4);
+	if (icmp->type != ICMP_ECHOREPLY || icmp->un.echo.id != htons(verify_id) ||
+	    ip->daddr != src.s_addr)
+		return;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < npeers; i++) {
+		if (!peers[i].updated && peers[i].addr.s_addr == ip->saddr) {
+			peers[i].updated = 1;
+			peers[i].msec = MS_TDIFF(now, start);
+		}
+	}
+	if (announce_done && verify_complete())
+		finish();
+}
+
+/*
+ * verify_complete()
+ *
+ * True once every neighbor we could resolve has updated, or the time
+ * budget is spent.
+ */
+static int verify_complete(void)
+{
+	struct timeval now;
+	int i;
+
+	if (verify_done)
+		return 1;
+	for (i = 0; i < npeers; i++)
+		if (peers[i].resolved && !peers[i].updated)
+			break;
+	if (i == npeers)
+		return 1;
+	gettimeofday(&now, NULL);
+	return start.tv_sec && MS_TDIFF(now, start) >= verify_budget;
+}
+
+static int verify_report(void)
+{
+	long max = 0, sum = 0;
+	int i, n = 0;
+
+	for (i = 0; i < npeers; i++) {
+		if (!peers[i].updated)
+			continue;
+		n++;
+		sum += peers[i].msec;
+		if (peers[i].msec > max)
+			max = peers[i].msec;
+	}
+	if (!quiet) {
+		for (i = 0; i < npeers; i++) {
+			printf("Neighbor %s: ", inet_ntoa(peers[i].addr));
+			if (!peers[i].resolved)
+				printf("no ARP reply\n");
+			else if (peers[i].updated)
+				printf("updated after %ld ms\n", peers[i].msec);
+			else
+				printf("not updated within %ld ms\n", verify_budget);
+		}
+		printf("%d of %d neighbor(s) updated", n, npeers);
+		if (n)
+			printf(", max %ld ms, avg %ld ms", max, sum / n);
+		printf("\n");
+	}
+	return n != npeers;
+}
+
+static void interrupt(void)
+{
+	verify_done = 1;
+	finish();
+}
+
 static void finish(void)
 {
+	if (npeers && !verify_done) {
+		/* keep going until the neighbors are done, or time is up */
+		announce_done = 1;
+		if (!verify_complete())
+			return;
+		verify_done = 1;
+	}
 	if (!quiet) {
 		printf("Sent %d probes (%d broadcast(s))\n", sent, brd_sent);
 		printf("Received %d response(s)", received);
@@ -385,6 +887,8 @@ static void finish(void)
 		printf("\n");
 		fflush(stdout);
 	}
+	if (npeers)
+		exit(verify_report());
 	fflush(stdout);
 	if (dad)
 		exit(!!received);
@@ -393,9 +897,70 @@ static void finish(void)
 	exit(!received);
 }
 
+/*
+ * pace_next()
+ *
+ * Return the delay before the next packet and advance the schedule.
+ */
+static int pace_next(void)
+{
+	int ms = pace[pace_idx];
+
+	if (pace_idx < pace_num - 1)
+		pace_idx++;
+	return ms;
+}
+
+static int pace_parse(const char *arg, int *sched, int *num)
+{
+	char *e;
+	int n = 0;
+
+	do {
+		long v = strtol(arg, &e, 10);
+
+		if (e == arg || v < 0 || v > INT_MAX || n == PACE_MAX ||
+		    (*e && *e != ','))
+			return -1;
+		sched[n++] = v;
+		arg = e + 1;
+	} while (*e);
+	*num = n;
+	return 0;
+}
+
+static void pace_arm(int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	/* a zero it_value would disarm the timer */
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L ? : 1;
+	if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		perror("arping: timerfd_settime");
+		exit(2);
+	}
+}
+
+static void pace_wait(void)
+{
+	uint64_t expired;
+
+	while (read(tfd, &expired, sizeof(expired)) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * catcher()
+ *
+ * Called whenever the pacing timer expires: send the next packet, or
+ * finish once count or timeout is exhausted, and re-arm the timer.
+ */
 static void catcher(void)
 {
 	struct timeval tv, tv_s, tv_o;
+	long gap;
 
 	gettimeofday(&tv, NULL);
 
@@ -406,19 +971,28 @@ static void catcher(void)
 	tv_o.tv_sec = timeout;
 	tv_o.tv_usec = 500 * 1000;
 
-	if (count-- == 0 || (timeout && timercmp(&tv_s, &tv_o, >)))
+	/* finish() only returns while verifying, and then we're done here */
+	if (count-- == 0 || (timeout && timercmp(&tv_s, &tv_o, >))) {
 		finish();
+		return;
+	}
+
+	send_pack(s, src, dst,
+		  (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
+	if (count == 0 && unsolicited) {
+		finish();
+		return;
+	}
 
-	timersub(&tv, &last, &tv_s);
-	tv_o.tv_sec = 0;
+	gap = pace_next();
+	if (timeout) {
+		/* wake up in time to honour the deadline */
+		long left = timeout * 1000L + 500 - MS_TDIFF(tv, start) + 1;
 
-	if (last.tv_sec==0 || timercmp(&tv_s, &tv_o, >)) {
-		send_pack(s, src, dst,
-			  (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
-		if (count == 0 && unsolicited)
-			finish();
+		if (left < gap)
+			gap = left;
 	}
-	alarm(1);
+	pace_arm(gap);
 }
 
 static void print_hex(unsigned char *p, int len)
@@ -627,6 +1201,9 @@ static void byebye(int nsig)
  * "device" variable for later reference.
  *
  * We have several implementations for this.
+ *	by_netlink():	requires the device name; asks rtnetlink for just
+ *			that device in one round trip. preferred, as the
+ *			others walk all interfaces.
  *	by_ifaddrs():	requires getifaddr() in glibc, and rtnetlink in
  *			kernel. default and recommended for recent systems.
  *	by_sysfs():	requires libsysfs , and sysfs in kernel.
@@ -656,6 +1233,128 @@ static int check_ifflags(unsigned int ifflags, int fatal)
 	return 0;
 }
 
+/*
+ * netlink_getlink()
+ *
+ * Ask rtnetlink for one link, by name or by index, and fill in ifindex
+ * and the broadcast address of dev, and *flags if given.
+ *
+ * Return value:
+ *	0	: found
+ *	>0	: no such device
+ *	<0	: netlink failed, try something else
+ */
+static int netlink_getlink(const char *name, int ifindex, struct device *dev,
+			   unsigned int *flags)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+		char attrbuf[RTA_SPACE(IFNAMSIZ) + RTA_SPACE(4)];
+	} req;
+	struct sockaddr_nl sa;
+	struct rtattr *rta;
+	union {
+		struct nlmsghdr nh;
+		char buf[8192];
+	} ans;
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	int fd, len, rc = -1;
+
+	if (name && strlen(name) >= IFNAMSIZ)
+		return 1;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = 1;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+	if (name) {
+		rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+		rta->rta_type = IFLA_IFNAME;
+		rta->rta_len = RTA_LENGTH(strlen(name) + 1);
+		strcpy(RTA_DATA(rta), name);
+		req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	}
+#ifdef RTEXT_FILTER_SKIP_STATS
+	/* we don't need the counters, keep the answer small */
+	rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	rta->rta_type = IFLA_EXT_MASK;
+	rta->rta_len = RTA_LENGTH(4);
+	*(__u32 *)RTA_DATA(rta) = RTEXT_FILTER_SKIP_STATS;
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+#endif
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (sendto(fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto out;
+	do {
+		len = recv(fd, &ans, sizeof(ans), 0);
+	} while (len < 0 && errno == EINTR);
+
+	for (nh = &ans.nh; len > 0 && NLMSG_OK(nh, (unsigned int)len);
+	     nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_seq != req.nh.nlmsg_seq)
+			continue;
+		if (nh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+
+			if (err->error == -ENODEV)
+				rc = 1;
+			break;
+		}
+		if (nh->nlmsg_type != RTM_NEWLINK)
+			continue;
+
+		ifi = NLMSG_DATA(nh);
+		dev->ifindex = ifi->ifi_index;
+		dev->brdlen = 0;
+		if (flags)
+			*flags = ifi->ifi_flags;
+		len = IFLA_PAYLOAD(nh);
+		for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+			if (rta->rta_type == IFLA_BROADCAST &&
+			    RTA_PAYLOAD(rta) <= sizeof(dev->brd)) {
+				dev->brdlen = RTA_PAYLOAD(rta);
+				memcpy(dev->brd, RTA_DATA(rta), dev->brdlen);
+			}
+		}
+		rc = 0;
+		break;
+	}
+out:
+	close(fd);
+	return rc;
+}
+
+static int find_device_by_netlink(void)
+{
+	unsigned int flags;
+	int rc;
+
+	/* searching for a suitable device needs the full list */
+	if (!device.name)
+		return -1;
+
+	rc = netlink_getlink(device.name, 0, &device, &flags);
+	if (rc)
+		return rc;
+	check_ifflags(flags, 1);
+	if (!device.brdlen) {
+		/* no link layer address, as the ifaddrs walk would skip it */
+		device.ifindex = 0;
+		return 1;
+	}
+	return 0;
+}
+
 static int find_device_by_ifaddrs(void)
 {
 #ifndef WITHOUT_IFADDRS
@@ -977,6 +1676,9 @@ out:
 static int find_device(void)
 {
 	int rc;
+	rc = find_device_by_netlink();
+	if (rc >= 0)
+		goto out;
 	rc = find_device_by_ifaddrs();
 	if (rc >= 0)
 		goto out;
@@ -1041,6 +1743,20 @@ static int set_device_broadcast_sysfs(struct device *device, unsigned char *ba,
 #endif
 }
 
+static int set_device_broadcast_netlink(struct device *device, unsigned char *ba, size_t balen)
+{
+	if (!device)
+		return -1;
+	/* e.g. the announcer, which only knows the ifindex */
+	if (!device->brdlen && device->ifindex &&
+	    netlink_getlink(NULL, device->ifindex, device, NULL) < 0)
+		return -1;
+	if (device->brdlen != balen)
+		return -1;
+	memcpy(ba, device->brd, balen);
+	return 0;
+}
+
 static int set_device_broadcast_fallback(struct device *device, unsigned char *ba, size_t balen)
 {
 	if (!quiet)
@@ -1051,6 +1767,8 @@ static int set_device_broadcast_fallback(struct device *device, unsigned char *b
 
 static void set_device_broadcast(struct device *dev, unsigned char *ba, size_t balen)
 {
+	if (!set_device_broadcast_netlink(dev, ba, balen))
+		return;
 	if (!set_device_broadcast_ifaddrs_one(dev, ba, balen, 0))
 		return;
 	if (!set_device_broadcast_sysfs(dev, ba, balen))
@@ -1058,12 +1776,663 @@ static void set_device_broadcast(struct device *dev, unsigned char *ba, size_t b
 	set_device_broadcast_fallback(dev, ba, balen);
 }
 
+/*
+ * burst mode (-B)
+ *
+ * Announce many addresses on one device from one process: the device is
+ * resolved and the socket set up once, and every round sends one
+ * gratuitous ARP (or unsolicited NA, for IPv6) per address, passed to the
+ * kernel in sendmmsg() batches. Addresses come from the command line, or
+ * from stdin (one per line) if none or "-" is given.
+ */
+#define BURST_BATCH	64
+
+struct burst_pack {
+	unsigned char buf[256];
+	int len;
+	struct sockaddr_storage to;
+};
+
+static struct target *burst_addrs;
+static int burst_num, burst_max;
+
+static void burst_add(const char *arg)
+{
+	struct target a;
+
+	if (target_parse(arg, &a) < 0) {
+		fprintf(stderr, "send_arp: invalid address %s\n", arg);
+		exit(2);
+	}
+	if (burst_num == burst_max) {
+		burst_max = burst_max ? burst_max * 2 : 64;
+		burst_addrs = realloc(burst_addrs, burst_max * sizeof(*burst_addrs));
+		if (!burst_addrs) {
+			perror("malloc");
+			exit(2);
+		}
+	}
+	burst_addrs[burst_num++] = a;
+}
+
+static void burst_read(FILE *f)
+{
+	char line[256];
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line, *e;
+
+		while (isspace((unsigned char)*p))
+			p++;
+		for (e = p; *e && !isspace((unsigned char)*e); e++)
+			;
+		*e = '\0';
+		if (*p && *p != '#')
+			burst_add(p);
+	}
+}
+
+/*
+ * burst_send()
+ *
+ * Send the prebuilt packets, BURST_BATCH per sendmmsg() call. A packet the
+ * kernel didn't take is retried once in the next call; a packet that
+ * fails is skipped.
+ */
+static void burst_send(int s, struct burst_pack *packs, int n)
+{
+	struct mmsghdr msgs[BURST_BATCH];
+	struct iovec iovs[BURST_BATCH];
+	int i = 0;
+
+	while (i < n) {
+		int j, batch = n - i < BURST_BATCH ? n - i : BURST_BATCH;
+		int rc;
+
+		memset(msgs, 0, sizeof(msgs[0]) * batch);
+		for (j = 0; j < batch; j++) {
+			struct sockaddr_ll *to = (struct sockaddr_ll *)&packs[i + j].to;
+
+			iovs[j].iov_base = packs[i + j].buf;
+			iovs[j].iov_len = packs[i + j].len;
+			msgs[j].msg_hdr.msg_name = to;
+			msgs[j].msg_hdr.msg_namelen = SLL_LEN(to->sll_halen);
+			msgs[j].msg_hdr.msg_iov = &iovs[j];
+			msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+		rc = sendmmsg(s, msgs, batch, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("send_arp: sendmmsg");
+			i++;
+			continue;
+		}
+		sent += rc;
+		brd_sent += rc;
+		i += rc;
+	}
+	gettimeofday(&last, NULL);
+}
+
+static void burst_run(int s, struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	struct burst_pack *packs;
+	struct timeval tv, tv_s;
+	int i;
+
+	packs = calloc(burst_num, sizeof(*packs));
+	if (!packs) {
+		perror("malloc");
+		exit(2);
+	}
+	for (i = 0; i < burst_num; i++) {
+		packs[i].len = build_announce(packs[i].buf, &burst_addrs[i], ME, HE,
+					      (struct sockaddr_ll *)&packs[i].to);
+		if (packs[i].len < 0) {
+			fprintf(stderr, "send_arp: %s: IPv6 needs an Ethernet device\n",
+				target_ntop(&burst_addrs[i]));
+			exit(2);
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	while (count-- != 0) {
+		pace_arm(pace_next());
+		pace_wait();
+		gettimeofday(&tv, NULL);
+		timersub(&tv, &start, &tv_s);
+		if (timeout && tv_s.tv_sec >= timeout)
+			break;
+		burst_send(s, packs, burst_num);
+	}
+	free(packs);
+	finish();
+}
+
+/*
+ * announcer mode (-S path)
+ *
+ * A long-lived process which keeps one PF_PACKET socket per interface and
+ * takes announcement requests on a Unix stream socket, one per line:
+ *
+ *	announce <device> <ip_addr> <hw_addr|auto> <count> [<ms>[,<ms>...]]
+ *	cancel <ip_addr>
+ *
+ * Each request is answered with "ok" or "error <reason>". Announcements
+ * run asynchronously, paced like the -P schedule (the daemon's own unless
+ * the request carries one); a new announcement for an address replaces
+ * the previous one. The socket is created with umask 077, so only its owner
+ * (root) can drive the announcer. The client side is send_arp -C path,
+ * see main().
+ */
+#define ANN_MAX_CLIENTS	16
+#define ANN_LINE_MAX	256
+
+struct ann_if {
+	char name[IFNAMSIZ];
+	int ifindex;
+	int fd;
+	struct sockaddr_storage me;
+	struct sockaddr_storage he;
+};
+
+struct ann_job {
+	int ifidx;			/* into ann_ifs[] */
+	struct target addr;
+	struct sockaddr_storage to;
+	int left;
+	int sched[PACE_MAX];
+	int sched_num;
+	int sched_idx;
+	struct timespec due;
+	unsigned char buf[256];
+	int len;
+};
+
+struct ann_client {
+	int fd;
+	int len;
+	char line[ANN_LINE_MAX];
+};
+
+static struct ann_if *ann_ifs;
+static int ann_nifs;
+static struct ann_job *ann_jobs;
+static int ann_njobs, ann_maxjobs;
+static struct ann_client ann_clients[ANN_MAX_CLIENTS];
+static const char *ann_path;
+
+static void ann_cleanup(void)
+{
+	if (ann_path)
+		unlink(ann_path);
+}
+
+static void ts_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int ann_if_setup(struct ann_if *ifp, int ifindex)
+{
+	struct device dev = { .name = ifp->name, .ifindex = ifindex };
+	struct sockaddr_ll *me = (struct sockaddr_ll *)&ifp->me;
+	socklen_t alen = sizeof(ifp->me);
+
+	memset(&ifp->me, 0, sizeof(ifp->me));
+	me->sll_family = AF_PACKET;
+	me->sll_ifindex = ifindex;
+	me->sll_protocol = htons(ETH_P_ARP);
+	if (bind(ifp->fd, (struct sockaddr *)&ifp->me, sizeof(ifp->me)) < 0 ||
+	    getsockname(ifp->fd, (struct sockaddr *)&ifp->me, &alen) < 0)
+		return -1;
+	if (me->sll_halen == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* we never read from it: keep the receive queue empty */
+	shutdown(ifp->fd, SHUT_RD);
+	ifp->he = ifp->me;
+	set_device_broadcast(&dev, ((struct sockaddr_ll *)&ifp->he)->sll_addr,
+			     me->sll_halen);
+	ifp->ifindex = ifindex;
+	return 0;
+}
+
+/*
+ * ann_if_get()
+ *
+ * Look up the interface in the cache, opening it on first use. The name
+ * is re-resolved on every request, which is a cheap ioctl, so that an
+ * interface which was re-created or went down is noticed.
+ */
+static struct ann_if *ann_if_get(const char *name, const char **err)
+{
+	struct ann_if *ifp = NULL;
+	struct ifreq ifr;
+	int i;
+
+	if (strlen(name) >= IFNAMSIZ) {
+		*err = "invalid device";
+		return NULL;
+	}
+	for (i = 0; i < ann_nifs; i++) {
+		if (!strcmp(ann_ifs[i].name, name)) {
+			ifp = &ann_ifs[i];
+			break;
+		}
+	}
+	if (!ifp) {
+		struct ann_if *n = realloc(ann_ifs, (ann_nifs + 1) * sizeof(*ann_ifs));
+
+		if (!n) {
+			*err = "out of memory";
+			return NULL;
+		}
+		ann_ifs = n;
+		ifp = &ann_ifs[ann_nifs++];
+		memset(ifp, 0, sizeof(*ifp));
+		strcpy(ifp->name, name);
+		ifp->fd = -1;
+	}
+
+	if (ifp->fd < 0) {
+		enable_capability_raw();
+		ifp->fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		disable_capability_raw();
+		if (ifp->fd < 0) {
+			*err = strerror(errno);
+			return NULL;
+		}
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, name);
+	if (ioctl(ifp->fd, SIOCGIFINDEX, &ifr) < 0) {
+		*err = "no such device";
+		return NULL;
+	}
+	if (ifr.ifr_ifindex != ifp->ifindex &&
+	    ann_if_setup(ifp, ifr.ifr_ifindex) < 0) {
+		ifp->ifindex = 0;
+		*err = strerror(errno);
+		return NULL;
+	}
+	if (ioctl(ifp->fd, SIOCGIFFLAGS, &ifr) < 0 ||
+	    !(ifr.ifr_flags & IFF_UP)) {
+		*err = "device is down";
+		return NULL;
+	}
+	if (ifr.ifr_flags & (IFF_NOARP | IFF_LOOPBACK)) {
+		*err = "device is not ARPable";
+		return NULL;
+	}
+	return ifp;
+}
+
+static void ann_cancel(const struct target *addr)
+{
+	int i;
+
+	for (i = 0; i < ann_njobs; ) {
+		if (target_equal(&ann_jobs[i].addr, addr))
+			ann_jobs[i] = ann_jobs[--ann_njobs];
+		else
+			i++;
+	}
+}
+
+static const char *ann_announce(char **argv, int argc)
+{
+	struct sockaddr_storage me;
+	struct sockaddr_ll *ME = (struct sockaddr_ll *)&me;
+	struct ann_if *ifp;
+	struct ann_job *job;
+	struct target addr;
+	const char *err;
+	int n;
+
+	if (argc < 4 || argc > 5)
+		return "usage: announce <device> <ip_addr> <hw_addr|auto> <count> [<ms>,...]";
+	if (target_parse(argv[1], &addr) < 0)
+		return "invalid address";
+	n = atoi(argv[3]);
+	if (n <= 0)
+		return "invalid count";
+	if (!(ifp = ann_if_get(argv[0], &err)))
+		return err;
+
+	me = ifp->me;
+	if (strcmp(argv[2], "auto")) {
+		unsigned char *p = ME->sll_addr;
+		const char *q = argv[2];
+		int i;
+
+		for (i = 0; i < ME->sll_halen; i++, p++) {
+			unsigned int b;
+
+			if (*q == ':')
+				q++;
+			if (sscanf(q, "%2x", &b) != 1 || !isxdigit((unsigned char)q[1]))
+				return "invalid hardware address";
+			*p = b;
+			q += 2;
+		}
+		if (*q)
+			return "invalid hardware address";
+	}
+
+	ann_cancel(&addr);
+	if (ann_njobs == ann_maxjobs) {
+		int max = ann_maxjobs ? ann_maxjobs * 2 : 16;
+		struct ann_job *j = realloc(ann_jobs, max * sizeof(*j));
+
+		if (!j)
+			return "out of memory";
+		ann_jobs = j;
+		ann_maxjobs = max;
+	}
+	job = &ann_jobs[ann_njobs];
+	memset(job, 0, sizeof(*job));
+	if (argc == 5) {
+		if (pace_parse(argv[4], job->sched, &job->sched_num) < 0)
+			return "invalid pacing schedule";
+	} else {
+		memcpy(job->sched, pace, sizeof(pace));
+		job->sched_num = pace_num;
+	}
+	job->ifidx = ifp - ann_ifs;
+	job->addr = addr;
+	job->left = n;
+	job->len = build_announce(job->buf, &addr, ME,
+				  (struct sockaddr_ll *)&ifp->he,
+				  (struct sockaddr_ll *)&job->to);
+	if (job->len < 0)
+		return "IPv6 needs an Ethernet device";
+	clock_gettime(CLOCK_MONOTONIC, &job->due);
+	ts_add_ms(&job->due, job->sched[job->sched_idx++]);
+	ann_njobs++;
+	return NULL;
+}
+
+static void ann_command(struct ann_client *c)
+{
+	char *argv[8];
+	int argc = 0;
+	const char *err = NULL;
+	char reply[ANN_LINE_MAX + 16];
+	char *p, *save;
+	struct target addr;
+
+	for (p = strtok_r(c->line, " \t\r", &save); p && argc < 8;
+	     p = strtok_r(NULL, " \t\r", &save))
+		argv[argc++] = p;
+	if (!argc)
+		return;
+
+	if (!strcmp(argv[0], "announce")) {
+		err = ann_announce(argv + 1, argc - 1);
+	} else if (!strcmp(argv[0], "cancel")) {
+		if (argc != 2 || target_parse(argv[1], &addr) < 0)
+			err = "usage: cancel <ip_addr>";
+		else
+			ann_cancel(&addr);
+	} else {
+		err = "unknown command";
+	}
+
+	if (err)
+		snprintf(reply, sizeof(reply), "error %s\n", err);
+	else
+		strcpy(reply, "ok\n");
+	if (send(c->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static void ann_read(struct ann_client *c)
+{
+	int n;
+	char *nl;
+
+	n = recv(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len, 0);
+	if (n <= 0) {
+		if (n < 0 && errno == EINTR)
+			return;
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += n;
+	c->line[c->len] = '\0';
+	while (c->fd >= 0 && (nl = strchr(c->line, '\n'))) {
+		int rest = c->len - (nl + 1 - c->line);
+
+		*nl = '\0';
+		ann_command(c);
+		memmove(c->line, nl + 1, rest + 1);
+		c->len = rest;
+	}
+	if (c->fd >= 0 && c->len == sizeof(c->line) - 1) {
+		/* overlong line, the client is not speaking our protocol */
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/*
+ * ann_run_jobs()
+ *
+ * Send every packet which is due, and arm the timer for the next one.
+ */
+static void ann_run_jobs(void)
+{
+	struct itimerspec its;
+	struct timespec now, *next = NULL;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < ann_njobs; ) {
+		struct ann_job *job = &ann_jobs[i];
+
+		if (!ts_before(&now, &job->due)) {
+			struct ann_if *ifp = &ann_ifs[job->ifidx];
+			struct sockaddr_ll *to = (struct sockaddr_ll *)&job->to;
+
+			if (sendto(ifp->fd, job->buf, job->len, 0,
+				   (struct sockaddr *)to, SLL_LEN(to->sll_halen)) < 0 &&
+			    !quiet)
+				fprintf(stderr, "send_arp: %s on %s: %s\n",
+					target_ntop(&job->addr), ifp->name,
+					strerror(errno));
+			if (--job->left == 0) {
+				ann_jobs[i] = ann_jobs[--ann_njobs];
+				continue;
+			}
+			ts_add_ms(&job->due, job->sched[job->sched_idx]);
+			if (job->sched_idx < job->sched_num - 1)
+				job->sched_idx++;
+			/* don't try to catch up after a stall */
+			if (ts_before(&job->due, &now))
+				job->due = now;
+		}
+		if (!next || ts_before(&job->due, next))
+			next = &job->due;
+		i++;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (next) {
+		its.it_value = *next;
+		/* a zero it_value would disarm the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("send_arp: timerfd_settime");
+		exit(2);
+	}
+}
+
+static int ann_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd, ret = -1;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "send_arp: socket path too long\n");
+		exit(2);
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("send_arp: socket");
+		exit(2);
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+		fprintf(stderr, "send_arp: an announcer is already listening on %s\n", path);
+		exit(2);
+	}
+	/* a left-over socket from an announcer which is gone */
+	unlink(path);
+	close(fd);
+
+	/* anyone who can connect can announce any address anywhere */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0) {
+		mode_t mask = umask(077);
+
+		ret = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+		umask(mask);
+	}
+	if (fd < 0 || ret < 0 || listen(fd, ANN_MAX_CLIENTS) < 0) {
+		perror("send_arp: control socket");
+		exit(2);
+	}
+	ann_path = path;
+	atexit(ann_cleanup);
+	return fd;
+}
+
+static void ann_serve(const char *path)
+{
+	struct pollfd pfd[ANN_MAX_CLIENTS + 2];
+	int lfd, i;
+
+	lfd = ann_listen(path);
+	for (i = 0; i < ANN_MAX_CLIENTS; i++)
+		ann_clients[i].fd = -1;
+	if (!quiet)
+		printf("send_arp: announcer listening on %s\n", path);
+	fflush(stdout);
+
+	for (;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = tfd;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < ANN_MAX_CLIENTS; i++) {
+			pfd[i + 2].fd = ann_clients[i].fd;
+			pfd[i + 2].events = POLLIN;
+		}
+		if (poll(pfd, ANN_MAX_CLIENTS + 2, -1) < 0) {
+			if (errno != EINTR) {
+				perror("send_arp: poll");
+				exit(2);
+			}
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			pace_wait();
+		for (i = 0; i < ANN_MAX_CLIENTS; i++)
+			if (pfd[i + 2].fd >= 0 && pfd[i + 2].revents)
+				ann_read(&ann_clients[i]);
+		if (pfd[0].revents & POLLIN) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+			for (i = 0; fd >= 0 && i < ANN_MAX_CLIENTS; i++) {
+				if (ann_clients[i].fd < 0) {
+					ann_clients[i].fd = fd;
+					ann_clients[i].len = 0;
+					break;
+				}
+			}
+			if (fd >= 0 && i == ANN_MAX_CLIENTS)
+				close(fd);
+		}
+		ann_run_jobs();
+	}
+}
+
+/*
+ * ann_request()
+ *
+ * Client side: pass one request line to the announcer, print its reply.
+ * Returns 0 on "ok", 1 on an error reply and 2 if the announcer could
+ * not be reached.
+ */
+static int ann_request(const char *path, const char *req)
+{
+	struct sockaddr_un sun;
+	char reply[ANN_LINE_MAX];
+	int fd, n, len = 0;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "send_arp: %s: %s\n", path, strerror(errno));
+		return 2;
+	}
+	if (send(fd, req, strlen(req), MSG_NOSIGNAL) < 0) {
+		perror("send_arp: send");
+		return 2;
+	}
+	while (len < (int)sizeof(reply) - 1 &&
+	       (n = recv(fd, reply + len, sizeof(reply) - 1 - len, 0)) > 0) {
+		len += n;
+		if (reply[len - 1] == '\n')
+			break;
+	}
+	close(fd);
+	reply[len] = '\0';
+	if (strcmp(reply, "ok\n")) {
+		fprintf(stderr, "send_arp: %s", len ? reply : "no reply from announcer\n");
+		return len ? 1 : 2;
+	}
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
 	int socket_errno;
 	int ch;
 	int hb_mode = 0;
+	int burst = 0;
+	int interval = -1;
+	int paced = 0;
+	char *ann_server = NULL;
+	char *ann_client = NULL;
+	char *ann_cancel_ip = NULL;
 
 	signal(SIGTERM, byebye);
 	signal(SIGPIPE, byebye);
@@ -1081,11 +2450,14 @@ main(int argc, char **argv)
 
 	disable_capability_raw();
 
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:BP:S:C:K:N:T:")) != EOF) {
 		switch(ch) {
 		case 'b':
 			broadcast_only=1;
 			break;
+		case 'B':
+			burst = 1;
+			break;
 		case 'D':
 			dad++;
 			quit_on_reply=1;
@@ -1121,10 +2493,35 @@ main(int argc, char **argv)
 		case 'V':
 			printf("send_arp utility, based on arping from iputils-%s\n", SNAPSHOT);
 			exit(0);
+		case 'P':
+			if (pace_parse(optarg, pace, &pace_num) < 0) {
+				fprintf(stderr, "send_arp: invalid pacing schedule %s\n", optarg);
+				exit(2);
+			}
+			paced = 1;
+			break;
+		case 'N':
+			verify_add(optarg);
+			break;
+		case 'T':
+			verify_budget = atol(optarg);
+			break;
+		case 'S':
+			ann_server = optarg;
+			break;
+		case 'C':
+			ann_client = optarg;
+			break;
+		case 'K':
+			ann_cancel_ip = optarg;
+			break;
+		case 'i': /* send_arp.libnet compatibility option */
+			hb_mode = 1;
+			interval = atoi(optarg);
+			break;
 		case 'p':
-		case 'i':
 		    hb_mode = 1;
-		    /* send_arp.libnet compatibility options, ignore */
+		    /* send_arp.libnet compatibility option, ignore */
 		    break;
 		case 'h':
 		case '?':
@@ -1133,12 +2530,57 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (ann_server) {
+	    if (optind != argc || dad)
+		usage();
+	    close(s);
+	    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	    if (tfd < 0) {
+		perror("send_arp: timerfd_create");
+		exit(2);
+	    }
+	    ann_serve(ann_server);
+	}
+
+	if (ann_client) {
+	    char req[ANN_LINE_MAX], sched[ANN_LINE_MAX] = "";
+	    int i, len = 0;
+
+	    if (ann_cancel_ip) {
+		if (optind != argc)
+		    usage();
+		snprintf(req, sizeof(req), "cancel %s\n", ann_cancel_ip);
+		exit(ann_request(ann_client, req));
+	    }
+	    /* same arguments as send_arp.libnet compatibility mode */
+	    if (argc - optind != 5)
+		usage();
+	    if (count <= 0) {
+		fprintf(stderr, "send_arp: -C requires a repeat count (-r)\n");
+		exit(2);
+	    }
+	    if (paced) {
+		for (i = 0; i < pace_num; i++)
+		    len += snprintf(sched + len, sizeof(sched) - len, "%s%d",
+				    i ? "," : " ", pace[i]);
+	    } else if (interval > 0) {
+		snprintf(sched, sizeof(sched), " 0,%d", interval);
+	    }
+	    snprintf(req, sizeof(req), "announce %s %s %s %d%s\n",
+		     argv[optind], argv[optind+1], argv[optind+2], count, sched);
+	    exit(ann_request(ann_client, req));
+	}
+
 	if(hb_mode) {
 	    /* send_arp.libnet compatibility mode */
 	    if (argc - optind != 5) {
 		usage();
 		return 1;
 	    }
+	    if (interval > 0 && !paced) {
+		pace[1] = interval;
+		pace_num = 2;
+	    }
 	    /*
 	     *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
 	     *	argv[optind+2] IP		192.168.195.186
@@ -1156,6 +2598,26 @@ main(int argc, char **argv)
 		exit(0);
             }
 
+	} else if (burst) {
+	    int i;
+
+	    if (dad || !unsolicited) {
+		fprintf(stderr, "send_arp: -B requires -U or -A\n");
+		exit(2);
+	    }
+	    for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "-"))
+		    burst_read(stdin);
+		else
+		    burst_add(argv[i]);
+	    }
+	    if (optind == argc)
+		burst_read(stdin);
+	    if (!burst_num) {
+		fprintf(stderr, "send_arp: no addresses given\n");
+		exit(2);
+	    }
+	    target = NULL;
 	} else {
 	    argc -= optind;
 	    argv += optind;
@@ -1186,7 +2648,15 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (inet_aton(target, &dst) != 1) {
+	if (!target) {
+		/* burst mode, every packet carries its own address */
+	} else if (inet_pton(AF_INET6, target, &dst6) == 1) {
+		if (dad || !unsolicited) {
+			fprintf(stderr, "send_arp: IPv6 addresses need -U or -A\n");
+			exit(2);
+		}
+		na_mode = 1;
+	} else if (inet_aton(target, &dst) != 1) {
 		struct hostent *hp;
 		char *idn = target;
 #ifdef USE_IDN
@@ -1213,6 +2683,11 @@ main(int argc, char **argv)
 		memcpy(&dst, hp->h_addr, 4);
 	}
 
+	if (npeers && (dad || !unsolicited || burst || na_mode)) {
+		fprintf(stderr, "send_arp: -N needs -U or -A and an IPv4 address\n");
+		exit(2);
+	}
+
 	if (source && inet_aton(source, &src) != 1) {
 		fprintf(stderr, "arping: invalid source %s\n", source);
 		exit(2);
@@ -1221,7 +2696,8 @@ main(int argc, char **argv)
 	if (!dad && unsolicited && src.s_addr == 0)
 		src = dst;
 
-	if (!dad || src.s_addr) {
+	/* in burst mode every packet carries its own address */
+	if (!burst && !na_mode && (!dad || src.s_addr)) {
 		struct sockaddr_in saddr;
 		int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
 
@@ -1287,36 +2763,95 @@ main(int argc, char **argv)
 			printf("Interface \"%s\" is not ARPable (no ll address)\n", device.name);
 		exit(dad?0:2);
 	}
+	if (na_mode && ((struct sockaddr_ll *)&me)->sll_hatype != ARPHRD_ETHER) {
+		fprintf(stderr, "send_arp: IPv6 needs an Ethernet device\n");
+		exit(2);
+	}
 
 	he = me;
 
 	set_device_broadcast(&device, ((struct sockaddr_ll *)&he)->sll_addr,
 			     ((struct sockaddr_ll *)&he)->sll_halen);
 
-	if (!quiet) {
+	if (!quiet && na_mode) {
+		char buf[INET6_ADDRSTRLEN];
+
+		printf("Sending unsolicited NAs for %s on %s\n",
+		       inet_ntop(AF_INET6, &dst6, buf, sizeof(buf)), device.name);
+	} else if (!quiet && !burst) {
 		printf("ARPING %s ", inet_ntoa(dst));
 		printf("from %s %s\n",  inet_ntoa(src), device.name ? : "");
 	}
 
-	if (!src.s_addr && !dad) {
+	if (!src.s_addr && !dad && !burst && !na_mode) {
 		fprintf(stderr, "arping: no source address in not-DAD mode\n");
 		exit(2);
 	}
 
+	if (npeers)
+		verify_open();
+
 	drop_capabilities();
 
-	set_signal(SIGINT, finish);
-	set_signal(SIGALRM, catcher);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("arping: timerfd_create");
+		exit(2);
+	}
+
+	if (burst) {
+		if (!quiet)
+			printf("Announcing %d addresses on %s\n",
+			       burst_num, device.name);
+		burst_run(s, (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
+	}
 
-	catcher();
+	set_signal(SIGINT, interrupt);
+
+	if (npeers)
+		verify_resolve(s, (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
+
+	pace_arm(pace_next());
 
 	while(1) {
 		sigset_t sset, osset;
 		unsigned char packet[4096];
 		struct sockaddr_storage from;
 		socklen_t alen = sizeof(from);
+		struct pollfd pfd[4];
 		int cc;
 
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = tfd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = verify_fd;
+		pfd[2].events = POLLIN;
+		pfd[3].fd = verify_tfd;
+		pfd[3].events = POLLIN;
+		if (poll(pfd, 4, -1) < 0) {
+			if (errno != EINTR)
+				perror("arping: poll");
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			pace_wait();
+			catcher();
+		}
+		if (pfd[2].revents & POLLIN)
+			verify_recv();
+		if (pfd[3].revents & POLLIN) {
+			uint64_t expired;
+
+			if (read(verify_tfd, &expired, sizeof(expired)) > 0)
+				verify_probe();
+			if (announce_done && verify_complete())
+				finish();
+		}
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
 		if ((cc = recvfrom(s, packet, sizeof(packet), 0,
 				   (struct sockaddr *)&from, &alen)) < 0) {
 			perror("arping: recvfrom");
@@ -1324,12 +2859,9 @@ main(int argc, char **argv)
 		}
 
 		sigemptyset(&sset);
-		sigaddset(&sset, SIGALRM);
 		sigaddset(&sset, SIGINT);
 		sigprocmask(SIG_BLOCK, &sset, &osset);
 		recv_pack(packet, cc, (struct sockaddr_ll *)&from);
 		sigprocmask(SIG_SETMASK, &osset, NULL);
 	}
 }
-
-
@@ -153,6 +153,48 @@ typedef struct sfex_lockdata_ondisk {
 	uint8_t nodename[256];
 } sfex_lockdata_ondisk;
 
+/*
+ * sfex_device --- an opened meta-data device
+ *
+ * fd is opened with O_DIRECT|O_SYNC, buf is a sector sized, aligned I/O
+ * buffer owned by the device and sector_size is the logical sector size
+ * of the device. Each device has its own buffer, so different devices may
+ * be accessed from different threads at the same time.
+ */
+typedef struct sfex_device {
+  const char *path;
+  int fd;
+  void *buf;
+  unsigned long sector_size;
+} sfex_device;
+
+/*
+ * sfex_lockops --- lock data I/O used by the lock protocol
+ *
+ * sfex_acquire_lock() and sfex_update_lock() access the lock data and wait
+ * only through these, so that the same protocol runs against a device in
+ * sfex_daemon and against a simulated disk in sfex_sim.
+ *
+ * read_lock, write_lock --- read or write the lock data, 0 or -1 on error
+ *
+ * wait --- sleep for the given number of milliseconds
+ */
+typedef struct sfex_lockops {
+  int (*read_lock) (void *ctx, sfex_lockdata *ldata);
+  int (*write_lock) (void *ctx, const sfex_lockdata *ldata);
+  void (*wait) (void *ctx, unsigned long msec);
+  void *ctx;
+} sfex_lockops;
+
+/* results of sfex_acquire_lock() and sfex_update_lock() */
+#define SFEX_LOCK_OK 0
+#define SFEX_LOCK_EREAD -1	/* reading lock data failed */
+#define SFEX_LOCK_EWRITE -2	/* writing lock data failed */
+#define SFEX_LOCK_HELD -3	/* the lock is held by another node */
+#define SFEX_LOCK_COLLISION -4	/* another node took the lock meanwhile */
+#define SFEX_LOCK_EREAD_COLLISION -5	/* reading back for collision detection failed */
+#define SFEX_LOCK_EWRITE_EXTEND -6	/* writing the extended lock failed */
+
 /* character for lock status. This is used in sfex_lockdata.status */
 #define SFEX_STATUS_UNLOCK 'u' /* unlock */
 #define SFEX_STATUS_LOCK 'l'	/* lock */
@@ -12,6 +12,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include "sfex.h"
 #include "sfex_lib.h"
 
@@ -28,81 +33,598 @@ static time_t monitor_interval = 10;
 
 static sfex_controldata cdata;
 static sfex_lockdata ldata;
-static sfex_lockdata ldata_new;
 
 static const char *device;
 const char *progname;
 char *nodename;
 static const char *rsc_id = "sfex";
 
+/*
+ * real-time heartbeat mode (-R fifo|deadline)
+ *
+ * The lock update loop runs in its own thread under SCHED_FIFO or
+ * SCHED_DEADLINE with all pages locked, while the main thread and the
+ * log drain thread stay on the normal scheduler. Messages emitted by the
+ * heartbeat thread go into a single-producer/single-consumer ring and are
+ * passed to cl_log by the drain thread, so a stalled syslog can't hold up
+ * a lock update.
+ */
+#define SFEX_RT_NONE		0
+#define SFEX_RT_FIFO		1
+#define SFEX_RT_DEADLINE	2
+
+#define SFEX_RT_PRIORITY	50
+#define SFEX_DL_RUNTIME_NS	(20 * 1000 * 1000)	/* 20 msec */
+#define SFEX_DL_PERIOD_NS	(1000 * 1000 * 1000)	/* 1 sec */
+#define SFEX_THREAD_STACK	(256 * 1024)
+
+#define SFEX_LOG_SLOTS		64	/* must be a power of 2 */
+#define SFEX_LOG_MSGLEN		256
+#define SFEX_LOG_DRAIN_MSEC	100
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE		6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK	0x01
+#endif
+
+struct sfex_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+struct sfex_log_slot {
+	int priority;
+	char msg[SFEX_LOG_MSGLEN];
+};
+
+static int rt_mode = SFEX_RT_NONE;
+static pthread_mutex_t lock_io_mutex;
+
+static struct sfex_log_slot log_ring[SFEX_LOG_SLOTS];
+static unsigned int log_head;	/* written by the heartbeat thread only */
+static unsigned int log_tail;	/* written by the drain thread only */
+static unsigned int log_dropped;
+
+/*
+ * quorum mode (more than one device given)
+ *
+ * The same lock index is held on every device and the lock is considered
+ * held while a majority of the devices confirm it. Each device is served
+ * by its own I/O thread; quorum_io() hands an operation to all idle
+ * devices and returns as soon as a majority have completed it, so a
+ * device that hangs or fails only drops out of the quorum. A device whose
+ * previous operation has not finished yet is skipped for the new one.
+ */
+#define SFEX_MAX_DEVICES	9
+
+#define SFEX_OP_NONE		0
+#define SFEX_OP_CHECK		1
+#define SFEX_OP_READ		2
+#define SFEX_OP_WRITE		3
+
+struct sfex_member {
+	sfex_device dev;
+	sfex_controldata cdata;
+	sfex_lockdata ldata;	/* data read by / to be written by the op */
+	pthread_t tid;
+	pid_t ktid;		/* kernel thread id, once the thread runs */
+	pthread_cond_t work;
+	int alive;		/* device was opened */
+	int checked;		/* control data was checked */
+	int op;			/* pending or running op, SFEX_OP_NONE if idle */
+	unsigned int seq;	/* sequence number of the op */
+	unsigned int done_seq;	/* sequence number of the last completed op */
+	int result;		/* result of the last completed op */
+	int degraded;		/* last op failed or was skipped */
+};
+
+static struct sfex_member members[SFEX_MAX_DEVICES];
+static int num_devices;
+static pthread_mutex_t quorum_mutex;
+static pthread_cond_t quorum_done;
+static unsigned int quorum_seq;
+static pid_t workers_pid;
+
+#define QUORUM (num_devices / 2 + 1)
+
+/* how long to wait for the remaining devices once a majority is done */
+#define SFEX_QUORUM_GRACE_MSEC	500
+
 static void usage(FILE *dist) {
-	  fprintf(dist, "usage: %s [-i <index>] [-c <collision_timeout>] [-t <lock_timeout>] <device>\n", progname);
+	  fprintf(dist, "usage: %s [-i <index>] [-c <collision_timeout>] [-t <lock_timeout>] [-R fifo|deadline] <device> [<device>...]\n", progname);
 }
 
-static void acquire_lock(void)
+/*
+ * hb_log --- log from the heartbeat path
+ *
+ * In real-time mode the message is formatted into the log ring and this
+ * never blocks; if the ring is full the message is dropped and counted.
+ * Otherwise it is a plain cl_log call.
+ */
+static void hb_log(int priority, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void hb_log(int priority, const char *fmt, ...)
 {
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
-		exit(EXIT_FAILURE);
+	va_list ap;
+	unsigned int head, tail;
+	struct sfex_log_slot *slot;
+
+	va_start(ap, fmt);
+	if (rt_mode == SFEX_RT_NONE) {
+		char buf[SFEX_LOG_MSGLEN];
+
+		vsnprintf(buf, sizeof(buf), fmt, ap);
+		va_end(ap);
+		cl_log(priority, "%s", buf);
+		return;
+	}
+
+	head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= SFEX_LOG_SLOTS) {
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
 	}
+	slot = &log_ring[head & (SFEX_LOG_SLOTS - 1)];
+	slot->priority = priority;
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&log_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_drain --- pass queued heartbeat messages on to cl_log
+ *
+ * Normally called by the drain thread. The heartbeat thread calls it with
+ * wait=0 on its exit paths to flush what it can without blocking.
+ */
+static void log_drain(int wait)
+{
+	static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+	unsigned int head, tail, dropped;
+
+	if (wait)
+		pthread_mutex_lock(&drain_mutex);
+	else if (pthread_mutex_trylock(&drain_mutex) != 0)
+		return;
 
-	if ((ldata.status == SFEX_STATUS_LOCK) && (strncmp(nodename, (const char*)(ldata.nodename), sizeof(ldata.nodename)))) {
-		unsigned int t = lock_timeout;
-		while (t > 0)
-			t = sleep(t);
-		read_lockdata(&cdata, &ldata_new, lock_index);
-		if (ldata.count != ldata_new.count) {
-			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
-			exit(2);
+	tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		struct sfex_log_slot *slot = &log_ring[tail & (SFEX_LOG_SLOTS - 1)];
+
+		cl_log(slot->priority, "%s", slot->msg);
+		tail++;
+		__atomic_store_n(&log_tail, tail, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		cl_log(LOG_WARNING, "%u heartbeat log messages dropped\n", dropped);
+	}
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *log_drain_thread(void *arg)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = SFEX_LOG_DRAIN_MSEC * 1000 * 1000,
+	};
+
+	while (1) {
+		log_drain(1);
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static void *quorum_worker(void *arg)
+{
+	struct sfex_member *m = arg;
+
+	pthread_mutex_lock(&quorum_mutex);
+	m->ktid = syscall(SYS_gettid);
+	pthread_cond_broadcast(&quorum_done);
+	while (1) {
+		sfex_lockdata ld;
+		unsigned int seq;
+		int op, ret = -1;
+
+		while (m->op == SFEX_OP_NONE)
+			pthread_cond_wait(&m->work, &quorum_mutex);
+		op = m->op;
+		seq = m->seq;
+		ld = m->ldata;
+		pthread_mutex_unlock(&quorum_mutex);
+
+		switch (op) {
+		case SFEX_OP_CHECK:
+			ret = lock_index_check_dev(&m->dev, &m->cdata, lock_index);
+			break;
+		case SFEX_OP_READ:
+			ret = read_lockdata_dev(&m->dev, &m->cdata, &ld, lock_index);
+			break;
+		case SFEX_OP_WRITE:
+			ret = write_lockdata_dev(&m->dev, &m->cdata, &ld, lock_index);
+			break;
 		}
+
+		pthread_mutex_lock(&quorum_mutex);
+		if (op == SFEX_OP_READ && ret == 0)
+			m->ldata = ld;
+		if (op == SFEX_OP_CHECK && ret == 0)
+			m->checked = 1;
+		m->result = ret;
+		m->done_seq = seq;
+		m->op = SFEX_OP_NONE;
+		pthread_cond_broadcast(&quorum_done);
 	}
+	return NULL;
+}
 
-	/* The lock acquisition is possible because it was not updated. */
-	ldata.status = SFEX_STATUS_LOCK;
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	strncpy((char*)(ldata.nodename), nodename, sizeof(ldata.nodename) - 1);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "write_lockdata failed\n");
-		exit(EXIT_FAILURE);
+/*
+ * start_workers --- start one I/O thread per device
+ *
+ * Threads don't survive daemon(), so this is called again whenever the
+ * process id has changed since the workers were started. Workers run
+ * with all signals blocked.
+ */
+static void start_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_condattr_t cattr;
+	sigset_t all, saved;
+	int i;
+
+	if (workers_pid == getpid())
+		return;
+
+	pthread_mutex_init(&quorum_mutex, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&quorum_done, &cattr);
+	pthread_condattr_destroy(&cattr);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, SFEX_THREAD_STACK);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0; i < num_devices; i++) {
+		struct sfex_member *m = &members[i];
+		int ret;
+
+		m->op = SFEX_OP_NONE;
+		m->ktid = 0;
+		if (!m->alive)
+			continue;
+		pthread_cond_init(&m->work, NULL);
+		ret = pthread_create(&m->tid, &attr, quorum_worker, m);
+		if (ret != 0) {
+			cl_log(LOG_ERR, "can't create I/O thread for %s: %s\n",
+					m->dev.path, strerror(ret));
+			m->alive = 0;
+		}
 	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	pthread_attr_destroy(&attr);
+	workers_pid = getpid();
+}
 
-	/* detect the collision of lock */
-	/* The collision occurs when two or more nodes do the reservation 
-	   processing of the lock at the same time. It waits for collision_timeout 
-	   seconds to detect this,and whether the superscription of lock data by 
-	   another node is done is checked. If the superscription was done by 
-	   another node, the lock acquisition with the own node is given up.  
-	 */
-	{
-		unsigned int t = collision_timeout;
-		while (t > 0)
-			t = sleep(t);
-		if (read_lockdata(&cdata, &ldata_new, lock_index) == -1) {
-			cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
+/*
+ * quorum_io --- run an operation on the devices in parallel
+ *
+ * The operation is given to every device that is alive, idle and, if
+ * targets is not NULL, selected in targets. For SFEX_OP_WRITE the data
+ * in members[].ldata is written. We wait until all of them are done, or
+ * at most SFEX_QUORUM_GRACE_MSEC longer once a majority has succeeded,
+ * but never longer than monitor_interval: devices that hang that long
+ * are left out, which costs the quorum if they are a majority.
+ * ok[] is set for each device that completed the operation successfully
+ * before we returned. Return value is the number of such devices.
+ *
+ * SIGTERM is kept blocked while we wait, so that quit_handler() can't
+ * run while quorum_mutex is held.
+ */
+static int quorum_io(int op, const int *targets, int *ok)
+{
+	sigset_t set, saved;
+	struct timespec grace, limit;
+	unsigned int seq;
+	int sel[SFEX_MAX_DEVICES];
+	int i, dispatched = 0, finished, succeeded, in_grace = 0;
+
+	/* targets and ok may be the same array */
+	for (i = 0; i < num_devices; i++)
+		sel[i] = targets ? targets[i] : 1;
+
+	start_workers();
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &saved);
+	pthread_mutex_lock(&quorum_mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &limit);
+	limit.tv_sec += monitor_interval;
+	seq = ++quorum_seq;
+	for (i = 0; i < num_devices; i++) {
+		struct sfex_member *m = &members[i];
+
+		ok[i] = 0;
+		if (!m->alive || !sel[i] || (op != SFEX_OP_CHECK && !m->checked))
+			continue;
+		if (m->op != SFEX_OP_NONE) {
+			if (!m->degraded)
+				hb_log(LOG_WARNING, "%s: previous I/O has not completed, skipping device\n",
+						m->dev.path);
+			m->degraded = 1;
+			continue;
+		}
+		m->op = op;
+		m->seq = seq;
+		pthread_cond_signal(&m->work);
+		dispatched++;
+	}
+
+	while (1) {
+		finished = succeeded = 0;
+		for (i = 0; i < num_devices; i++) {
+			if (members[i].done_seq == seq) {
+				finished++;
+				if (members[i].result == 0)
+					succeeded++;
+			}
+		}
+		if (finished == dispatched)
+			break;
+		if (succeeded >= QUORUM && !in_grace) {
+			clock_gettime(CLOCK_MONOTONIC, &grace);
+			grace.tv_nsec += SFEX_QUORUM_GRACE_MSEC * 1000 * 1000;
+			grace.tv_sec += grace.tv_nsec / 1000000000;
+			grace.tv_nsec %= 1000000000;
+			in_grace = 1;
 		}
-		if (strncmp((char*)(ldata.nodename), (const char*)(ldata_new.nodename), sizeof(ldata.nodename))) {
-			cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
-			exit(2);
+		if (in_grace) {
+			if (pthread_cond_timedwait(&quorum_done, &quorum_mutex, &grace) == ETIMEDOUT)
+				break;
+		} else if (pthread_cond_timedwait(&quorum_done, &quorum_mutex, &limit) == ETIMEDOUT) {
+			hb_log(LOG_ERR, "I/O on %d of %d devices did not complete within %ld sec\n",
+					dispatched - finished, num_devices, (long)monitor_interval);
+			break;
 		}
 	}
 
-	/* extension of lock */
-	/* Validly time of the lock is extended. It is because of spending at 
-	   the collision_timeout seconds to detect the collision. */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
+	succeeded = 0;
+	for (i = 0; i < num_devices; i++) {
+		struct sfex_member *m = &members[i];
+
+		if (m->done_seq != seq)
+			continue;
+		ok[i] = (m->result == 0);
+		succeeded += ok[i];
+		if (ok[i] && m->degraded) {
+			hb_log(LOG_INFO, "%s: device is back in the quorum\n", m->dev.path);
+			m->degraded = 0;
+		} else if (!ok[i] && !m->degraded) {
+			hb_log(LOG_WARNING, "%s: I/O failed, device dropped from the quorum\n", m->dev.path);
+			m->degraded = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&quorum_mutex);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return succeeded;
+}
+
+static int is_mine(const sfex_lockdata *ld)
+{
+	return ld->status == SFEX_STATUS_LOCK
+		&& !strncmp((const char*)(ld->nodename), nodename, sizeof(ld->nodename));
+}
+
+static void quorum_release_lock(void);
+
+static int dev_read_lock(void *ctx, sfex_lockdata *ld)
+{
+	return read_lockdata(&cdata, ld, lock_index);
+}
+
+static int dev_write_lock(void *ctx, const sfex_lockdata *ld)
+{
+	return write_lockdata(&cdata, ld, lock_index);
+}
+
+static void dev_wait(void *ctx, unsigned long msec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000 * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static const sfex_lockops dev_lockops = {
+	dev_read_lock, dev_write_lock, dev_wait, NULL
+};
+
+/*
+ * lock data I/O on several devices, for the same protocol
+ *
+ * A read is made on the devices still taking part and reports one lock
+ * data for all of them: ours if a majority of the devices show us,
+ * otherwise another node's if any device shows one (for update_lock,
+ * only if a majority shows one; else the read fails), otherwise an
+ * unlocked one. Its count moves whenever the counter has moved on a
+ * device held by another node at the previous read, so the holder is
+ * seen alive if it updates any device. Once a majority shows us, only
+ * those devices take part.
+ *
+ * A write advances the counter of every device taking part, keeping
+ * each device's own count, and sets the status and node name given.
+ */
+struct quorum_lockctx {
+	int majority;			/* another node only if on a majority */
+	int ok[SFEX_MAX_DEVICES];	/* devices taking part */
+	int held[SFEX_MAX_DEVICES];	/* held by another node at the last read */
+	int count[SFEX_MAX_DEVICES];	/* counter at the last read */
+	int view;			/* count reported by the last read */
+};
+
+static struct quorum_lockctx qctx;
+
+static void quorum_lockctx_init(int majority)
+{
+	int i;
+
+	memset(&qctx, 0, sizeof(qctx));
+	qctx.majority = majority;
+	for (i = 0; i < num_devices; i++)
+		qctx.ok[i] = 1;
+}
+
+static int quorum_read_lock(void *ctx, sfex_lockdata *ld)
+{
+	struct quorum_lockctx *q = ctx;
+	const sfex_lockdata *other = NULL;
+	int i, n, mine = 0, others = 0, moved = 0;
+
+	n = quorum_io(SFEX_OP_READ, q->ok, q->ok);
+	for (i = 0; i < num_devices; i++) {
+		const sfex_lockdata *d = &members[i].ldata;
+
+		if (!q->ok[i]) {
+			q->held[i] = 0;
+			continue;
+		}
+		if (q->held[i] && d->count != q->count[i])
+			moved = 1;
+		q->held[i] = d->status == SFEX_STATUS_LOCK && !is_mine(d);
+		q->count[i] = d->count;
+		if (q->held[i]) {
+			other = d;
+			others++;
+		} else if (is_mine(d)) {
+			mine++;
+		}
+	}
+	if (moved)
+		q->view = SFEX_NEXT_COUNT(q->view);
+
+	if (n < QUORUM) {
+		hb_log(LOG_ERR, "can't read lock data from a majority of devices\n");
+		return -1;
+	}
+	memset(ld, 0, sizeof(*ld));
+	ld->count = q->view;
+	if (mine >= QUORUM) {
+		for (i = 0; i < num_devices; i++)
+			q->ok[i] = q->ok[i] && is_mine(&members[i].ldata);
+		ld->status = SFEX_STATUS_LOCK;
+		strncpy(ld->nodename, nodename, sizeof(ld->nodename) - 1);
+	} else if (other != NULL && (!q->majority || others >= QUORUM)) {
+		ld->status = SFEX_STATUS_LOCK;
+		memcpy(ld->nodename, other->nodename, sizeof(ld->nodename));
+	} else if (q->majority) {
+		hb_log(LOG_ERR, "lock not confirmed by a majority of devices\n");
+		return -1;
+	} else {
+		ld->status = SFEX_STATUS_UNLOCK;
+	}
+	return 0;
+}
+
+static int quorum_write_lock(void *ctx, const sfex_lockdata *ld)
+{
+	struct quorum_lockctx *q = ctx;
+	int i;
+
+	for (i = 0; i < num_devices; i++) {
+		sfex_lockdata *d = &members[i].ldata;
+
+		if (!q->ok[i])
+			continue;
+		d->status = ld->status;
+		d->count = SFEX_NEXT_COUNT(d->count);
+		memcpy(d->nodename, ld->nodename, sizeof(d->nodename));
+	}
+	if (quorum_io(SFEX_OP_WRITE, q->ok, q->ok) < QUORUM) {
+		hb_log(LOG_ERR, "can't write lock data to a majority of devices\n");
+		return -1;
+	}
+	return 0;
+}
+
+static const sfex_lockops quorum_lockops = {
+	quorum_read_lock, quorum_write_lock, dev_wait, &qctx
+};
+
+static void acquire_lock(void)
+{
+	const sfex_lockops *ops = &dev_lockops;
+	int i, n;
+
+	if (num_devices > 1) {
+		quorum_lockctx_init(0);
+		ops = &quorum_lockops;
+	}
+
+	switch (sfex_acquire_lock(ops, nodename, lock_timeout * 1000,
+				collision_timeout * 1000, &ldata)) {
+	case SFEX_LOCK_OK:
+		break;
+	case SFEX_LOCK_EREAD:
+		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
+		exit(EXIT_FAILURE);
+	case SFEX_LOCK_EWRITE:
+		cl_log(LOG_ERR, "write_lockdata failed\n");
+		exit(EXIT_FAILURE);
+	case SFEX_LOCK_HELD:
+		cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
+		exit(2);
+	case SFEX_LOCK_EREAD_COLLISION:
+		cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
+		/* fall through: our lock can't be confirmed */
+	case SFEX_LOCK_COLLISION:
+		cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
+		exit(2);
+	case SFEX_LOCK_EWRITE_EXTEND:
 		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
 		exit(EXIT_FAILURE);
 	}
-	cl_log(LOG_INFO, "lock acquired\n");
+	if (num_devices == 1) {
+		cl_log(LOG_INFO, "lock acquired\n");
+		return;
+	}
+	for (i = 0, n = 0; i < num_devices; i++)
+		n += qctx.ok[i];
+	cl_log(LOG_INFO, "lock acquired on %d of %d devices\n", n, num_devices);
 }
 
+/*
+ * error_todo --- have the cluster manager fail the resource
+ *
+ * Other threads may hold the glib or syslog locks at the fork, so the
+ * child only execs; everything is logged by the parent beforehand.
+ */
 static void error_todo (void)
 {
+	hb_log(LOG_INFO, "Execute \"crm_resource -F -r %s --node %s\" command\n", rsc_id, nodename);
 	if (fork() == 0) {
-		cl_log(LOG_INFO, "Execute \"crm_resource -F -r %s --node %s\" command\n", rsc_id, nodename);
 		execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "--node", nodename, NULL);
+		_exit(127);
 	} else {
+		if (rt_mode != SFEX_RT_NONE)
+			log_drain(0);
 		exit(EXIT_FAILURE);
 	}
 }
@@ -115,37 +637,48 @@ static void failure_todo(void)
 	/*execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "--node", nodename, NULL); */
 	int ret;
 
-	cl_log(LOG_INFO, "Force reboot node %s\n", nodename);
+	hb_log(LOG_INFO, "Force reboot node %s\n", nodename);
 	ret = write(sysrq_fd, "b\n", 2);
 	if (ret == -1) {
-		cl_log(LOG_ERR, "%s\n", strerror(errno));
+		hb_log(LOG_ERR, "%s\n", strerror(errno));
 	}
 	close(sysrq_fd);
+	if (rt_mode != SFEX_RT_NONE)
+		log_drain(0);
 	exit(EXIT_FAILURE);
 #endif
 }
 
+/*
+ * update_lock --- periodic lock update
+ *
+ * With several devices the node is fenced only if a majority of them
+ * shows another owner. Anything short of a majority still showing us
+ * (devices unreadable, or a minority taken over) is a read error.
+ */
 static void update_lock(void)
 {
-	/* read lock data */
-	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "read_lockdata failed in update_lock\n");
-		error_todo();
-		exit(EXIT_FAILURE);
+	const sfex_lockops *ops = &dev_lockops;
+
+	if (num_devices > 1) {
+		quorum_lockctx_init(1);
+		ops = &quorum_lockops;
 	}
 
-	/* check current lock status */
-	/* if own node is not locking, lock update is failed */
-	if (ldata.status != SFEX_STATUS_LOCK || strncmp((const char*)(ldata.nodename), nodename, sizeof(ldata.nodename))) {
-		cl_log(LOG_ERR, "can't update lock.\n");
+	switch (sfex_update_lock(ops, nodename, &ldata)) {
+	case SFEX_LOCK_OK:
+		break;
+	case SFEX_LOCK_EREAD:
+		hb_log(LOG_ERR, "read_lockdata failed in update_lock\n");
+		error_todo();
+		exit(EXIT_FAILURE);
+	case SFEX_LOCK_HELD:
+		/* if own node is not locking, lock update is failed */
+		hb_log(LOG_ERR, "can't update lock.\n");
 		failure_todo();
 		exit(EXIT_FAILURE); 
-	}
-
-	/* lock update */
-	ldata.count = SFEX_NEXT_COUNT(ldata.count);
-	if (write_lockdata(&cdata, &ldata, lock_index) == -1) {
-		cl_log(LOG_ERR, "write_lockdata failed in update_lock\n");
+	default:
+		hb_log(LOG_ERR, "write_lockdata failed in update_lock\n");
 		error_todo();
 		exit(EXIT_FAILURE);
 	}
@@ -155,6 +688,11 @@ static void release_lock(void)
 {
 	/* The only thing I care about in release_lock(), is to terminate the process */
 	   
+	if (num_devices > 1) {
+		quorum_release_lock();
+		return;
+	}
+
 	/* read lock data */
 	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in release_lock\n");
@@ -178,6 +716,199 @@ static void release_lock(void)
 	cl_log(LOG_INFO, "lock released\n");
 }
 
+static void quorum_release_lock(void)
+{
+	int ok[SFEX_MAX_DEVICES];
+	int i, n;
+
+	quorum_io(SFEX_OP_READ, NULL, ok);
+	for (i = 0, n = 0; i < num_devices; i++) {
+		if (ok[i] && is_mine(&members[i].ldata)) {
+			members[i].ldata.status = SFEX_STATUS_UNLOCK;
+			n++;
+		} else {
+			ok[i] = 0;
+		}
+	}
+	if (n == 0) {
+		cl_log(LOG_ERR, "lock was already released.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (quorum_io(SFEX_OP_WRITE, ok, ok) < n)
+		cl_log(LOG_ERR, "write_lockdata failed on some devices in release_lock\n");
+	cl_log(LOG_INFO, "lock released\n");
+}
+
+/*
+ * set_deadline --- put thread tid (0: the calling thread) under
+ * SCHED_DEADLINE
+ *
+ * The reservation is small and periodic; the thread sleeps between lock
+ * updates, so only the CPU time used for an update counts against it.
+ * RESET_ON_FORK is required so that error_todo() is still able to fork.
+ */
+static int set_deadline(pid_t tid)
+{
+#ifdef SYS_sched_setattr
+	struct sfex_sched_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+	attr.sched_runtime = SFEX_DL_RUNTIME_NS;
+	attr.sched_deadline = SFEX_DL_PERIOD_NS;
+	attr.sched_period = SFEX_DL_PERIOD_NS;
+	return syscall(SYS_sched_setattr, tid, &attr, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * set_worker_sched --- give a device I/O thread the scheduling of the
+ * heartbeat thread, which waits for it
+ *
+ * Return value is 0 or an errno value.
+ */
+static int set_worker_sched(struct sfex_member *m)
+{
+	struct sched_param param;
+	pid_t tid;
+
+	if (rt_mode == SFEX_RT_FIFO) {
+		param.sched_priority = SFEX_RT_PRIORITY;
+		return pthread_setschedparam(m->tid, SCHED_FIFO, &param);
+	}
+
+	pthread_mutex_lock(&quorum_mutex);
+	while (m->ktid == 0)
+		pthread_cond_wait(&quorum_done, &quorum_mutex);
+	tid = m->ktid;
+	pthread_mutex_unlock(&quorum_mutex);
+	return set_deadline(tid) == -1 ? errno : 0;
+}
+
+static void *heartbeat_thread(void *arg)
+{
+	struct timespec next;
+
+	if (rt_mode == SFEX_RT_DEADLINE && set_deadline(0) == -1) {
+		hb_log(LOG_ERR, "can't set SCHED_DEADLINE: %s\n", strerror(errno));
+		pthread_mutex_lock(&lock_io_mutex);
+		release_lock();
+		log_drain(1);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sleep to absolute times so that the update period does not drift
+	   by the time spent doing the I/O. */
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1) {
+		next.tv_sec += monitor_interval;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		pthread_mutex_lock(&lock_io_mutex);
+		update_lock();
+		pthread_mutex_unlock(&lock_io_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * run_realtime --- run the heartbeat in a real-time thread
+ *
+ * This does not return. SIGTERM is blocked in every thread and collected
+ * here with sigwait(), so that releasing the lock can't interleave with
+ * an update in progress: both go through lock_io_mutex, which uses
+ * priority inheritance to keep the heartbeat thread from being starved by
+ * the main thread.
+ */
+static void run_realtime(void)
+{
+	pthread_attr_t attr;
+	pthread_mutexattr_t mattr;
+	pthread_t hb_tid, drain_tid;
+	sigset_t set;
+	int ret;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		cl_log(LOG_ERR, "mlockall failed: %s\n", strerror(errno));
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&lock_io_mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	if (num_devices > 1) {
+		int i;
+
+		/* the device I/O threads work for the heartbeat thread, so
+		   they run under its policy: SCHED_FIFO at the same priority,
+		   or a SCHED_DEADLINE reservation of their own */
+		start_workers();
+		for (i = 0; i < num_devices; i++) {
+			if (!members[i].alive)
+				continue;
+			ret = set_worker_sched(&members[i]);
+			if (ret != 0) {
+				cl_log(LOG_ERR, "can't set %s for the I/O thread of %s: %s\n",
+						rt_mode == SFEX_RT_FIFO ? "SCHED_FIFO" : "SCHED_DEADLINE",
+						members[i].dev.path, strerror(ret));
+				release_lock();
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, SFEX_THREAD_STACK);
+	ret = pthread_create(&drain_tid, &attr, log_drain_thread, NULL);
+	if (ret != 0) {
+		cl_log(LOG_ERR, "can't create log thread: %s\n", strerror(ret));
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+
+	if (rt_mode == SFEX_RT_FIFO) {
+		struct sched_param param;
+
+		param.sched_priority = SFEX_RT_PRIORITY;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	ret = pthread_create(&hb_tid, &attr, heartbeat_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		cl_log(LOG_ERR, "can't create heartbeat thread: %s\n", strerror(ret));
+		release_lock();
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		int signo;
+
+		if (sigwait(&set, &signo) != 0 || signo != SIGTERM)
+			continue;
+		cl_log(LOG_INFO, "SIGTERM received. now releasing lock\n");
+		pthread_mutex_lock(&lock_io_mutex);
+		release_lock();
+		log_drain(1);
+		cl_log(LOG_INFO, "Shutdown sfex_daemon with EXIT_SUCCESS\n");
+		exit(EXIT_SUCCESS);
+	}
+}
+
 static void quit_handler(int signo, siginfo_t *info, void *context)
 {
 	cl_log(LOG_INFO, "quit_handler called. now releasing lock\n");
@@ -201,7 +932,7 @@ int main(int argc, char *argv[])
 	/* read command line option */
 	opterr = 0;
 	while (1) {
-		int c = getopt(argc, argv, "hi:c:t:m:n:r:");
+		int c = getopt(argc, argv, "hi:c:t:m:n:r:R:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -281,6 +1012,16 @@ int main(int argc, char *argv[])
 					rsc_id = strdup(optarg);
 				}
 				break;
+			case 'R':           /* -R fifo|deadline */
+				if (strcmp(optarg, "fifo") == 0) {
+					rt_mode = SFEX_RT_FIFO;
+				} else if (strcmp(optarg, "deadline") == 0) {
+					rt_mode = SFEX_RT_DEADLINE;
+				} else {
+					cl_log(LOG_ERR, "invalid scheduling policy %s. it must be fifo or deadline.\n", optarg);
+					exit(4);
+				}
+				break;
 			case '?':           /* error */
 				usage(stderr);
 				exit(4);
@@ -291,14 +1032,30 @@ int main(int argc, char *argv[])
 		cl_log(LOG_ERR, "no device specified.\n");
 		usage(stderr);
 		exit(EXIT_FAILURE);
-	} else if (optind + 1 < argc) {
+	} else if (optind + SFEX_MAX_DEVICES < argc) {
 		cl_log(LOG_ERR, "too many arguments.\n");
 		usage(stderr);
 		exit(EXIT_FAILURE);
 	}
 	device = argv[optind];
+	num_devices = argc - optind;
+
+	if (num_devices == 1) {
+		prepare_lock(device);
+	} else {
+		int i, n = 0;
 
-	prepare_lock(device);
+		for (i = 0; i < num_devices; i++) {
+			if (open_device(&members[i].dev, argv[optind + i]) == 0) {
+				members[i].alive = 1;
+				n++;
+			}
+		}
+		if (n < QUORUM) {
+			cl_log(LOG_ERR, "can't open a majority of %d devices\n", num_devices);
+			exit(EXIT_FAILURE);
+		}
+	}
 #if !SFEX_TESTING
 	sysrq_fd = open("/proc/sysrq-trigger", O_WRONLY);
 	if (sysrq_fd == -1) {
@@ -307,9 +1064,19 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	ret = lock_index_check(&cdata, lock_index);
-	if (ret == -1)
-		exit(EXIT_FAILURE);
+	if (num_devices == 1) {
+		ret = lock_index_check(&cdata, lock_index);
+		if (ret == -1)
+			exit(EXIT_FAILURE);
+	} else {
+		int ok[SFEX_MAX_DEVICES];
+
+		/* a device without valid control data never takes part */
+		if (quorum_io(SFEX_OP_CHECK, NULL, ok) < QUORUM) {
+			cl_log(LOG_ERR, "lock_index_check failed on a majority of devices\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	{
 		struct sigaction sig_act;
@@ -335,6 +1102,12 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (rt_mode != SFEX_RT_NONE) {
+		cl_log(LOG_INFO, "SFeX Daemon started (%s heartbeat thread).\n",
+				rt_mode == SFEX_RT_FIFO ? "SCHED_FIFO" : "SCHED_DEADLINE");
+		run_realtime();
+	}
+
 	cl_make_realtime(-1, -1, 128, 128);
 	
 	cl_log(LOG_INFO, "SFeX Daemon started.\n");
@@ -161,16 +161,10 @@ main(int argc, char *argv[]) {
   init_controldata(&cdata, sector_size, numlocks);
   init_lockdata(&ldata);
 
-  /* write out control data and lock data */
-  write_controldata(&cdata);
-  {
-    int index;
-    for (index = 1; index <= numlocks; index++)
-      if (write_lockdata(&cdata, &ldata, index) == -1) {
-        fprintf(stderr, "%s: ERROR: cannot write lock data (index=%d).\n",
-                progname, index);
-        exit(3);
-      }
+  /* write out control data and lock data in one go, and verify them */
+  if (write_metadata(&cdata, &ldata) == -1) {
+    fprintf(stderr, "%s: ERROR: cannot write meta-data.\n", progname);
+    exit(3);
   }
 
   exit(0);
@@ -45,42 +45,70 @@
 #include "sfex.h"
 #include "sfex_lib.h"
 
-static void *locked_mem;
-static int dev_fd;
+/* largest single write done by write_metadata() */
+#define SFEX_INIT_CHUNK (1024 * 1024)
+
+static sfex_device default_dev = { NULL, -1, NULL, 0 };
 unsigned long sector_size = 0;
 
+/*
+ * open_device --- open a meta-data device
+ *
+ * We open the device for direct synchronous I/O, get its sector size and
+ * allocate an aligned I/O buffer for it. Return value is 0 on success and
+ * -1 on error. Errors are logged.
+ *
+ * dev --- device to set up
+ *
+ * path --- device file name
+ */
 int
-prepare_lock (const char *device)
+open_device (sfex_device * dev, const char *path)
 {
   int sec_tmp = 0;
 
+  dev->path = path;
   do {
-    dev_fd = open (device, O_RDWR | O_DIRECT | O_SYNC);
-    if (dev_fd == -1) {
+    dev->fd = open (path, O_RDWR | O_DIRECT | O_SYNC);
+    if (dev->fd == -1) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
       cl_log(LOG_ERR, "can't open device %s: %s\n",
-		    device, strerror (errno));
-      exit (3);
+		    path, strerror (errno));
+      return -1;
     }
     break;
   }
   while (1);
 
-  ioctl(dev_fd, BLKSSZGET, &sec_tmp);
-  sector_size = (unsigned long)sec_tmp;
-  if (sector_size == 0) {
-	  cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
-	  exit(EXIT_FAILURE);
+  ioctl(dev->fd, BLKSSZGET, &sec_tmp);
+  dev->sector_size = (unsigned long)sec_tmp;
+  if (dev->sector_size == 0) {
+	  cl_log(LOG_ERR, "Get sector size of %s failed: %s\n", path, strerror(errno));
+	  close(dev->fd);
+	  dev->fd = -1;
+	  return -1;
   }
 
   if (posix_memalign
-      ((void **) (&locked_mem), SFEX_ODIRECT_ALIGNMENT,
-       sector_size) != 0) {
+      ((void **) (&dev->buf), SFEX_ODIRECT_ALIGNMENT,
+       dev->sector_size) != 0) {
     cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
-    exit (3);
+    close(dev->fd);
+    dev->fd = -1;
+    return -1;
   }
-  memset (locked_mem, 0, sector_size);
+  memset (dev->buf, 0, dev->sector_size);
+
+  return 0;
+}
+
+int
+prepare_lock (const char *device)
+{
+  if (open_device (&default_dev, device) == -1)
+    exit (3);
+  sector_size = default_dev.sector_size;
 
   return 0;
 }
@@ -164,22 +192,16 @@ init_lockdata (sfex_lockdata * ldata)
 }
 
 /*
- * write_controldata --- write control data into file
+ * format_controldata --- format control data into a block
  *
- * We write sfex_controldata struct into file. We open a file with 
- * synchronization mode and write out control data.
+ * block --- buffer of cdata->blocksize bytes
  *
  * cdata --- pointer of control data
- *
- * device --- name of target file
  */
-void
-write_controldata (const sfex_controldata * cdata)
+static void
+format_controldata (void *buf, const sfex_controldata * cdata)
 {
-  sfex_controldata_ondisk *block;
-  int fd;
-
-  block = (sfex_controldata_ondisk *) (locked_mem);
+  sfex_controldata_ondisk *block = buf;
 
   /* We write control data into the buffer with given format. */
   /* We write the offset value of each field of the control data directly.
@@ -197,8 +219,57 @@ write_controldata (const sfex_controldata * cdata)
 	    (unsigned)cdata->blocksize);
   snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
 	    cdata->numlocks);
+}
+
+/*
+ * format_lockdata --- format lock data into a block
+ *
+ * block --- buffer of cdata->blocksize bytes
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- pointer for lock data
+ */
+static void
+format_lockdata (void *buf, const sfex_controldata * cdata,
+		 const sfex_lockdata * ldata)
+{
+  sfex_lockdata_ondisk *block = buf;
+
+  /* We write lock data into buffer with given format */
+  /* We write the offset value of each field of the control data directly.
+   * Because a point using this value is limited to two places, we do not 
+   * use macro. If you chage the following offset values, you must change 
+   * values in the read_lockdata() function.
+   */
+  memset (block, 0, cdata->blocksize);
+  block->status = ldata->status;
+  snprintf ((char *) (block->count), sizeof (block->count), "%d",
+	    ldata->count);
+  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
+	    ldata->nodename);
+}
 
-  fd = dev_fd;
+/*
+ * write_controldata --- write control data into file
+ *
+ * We write sfex_controldata struct into file. We open a file with 
+ * synchronization mode and write out control data.
+ *
+ * cdata --- pointer of control data
+ *
+ * device --- name of target file
+ */
+void
+write_controldata (const sfex_controldata * cdata)
+{
+  void *block;
+  int fd;
+
+  block = default_dev.buf;
+  format_controldata (block, cdata);
+
+  fd = default_dev.fd;
   if (lseek (fd, 0, SEEK_SET) == -1) {
     cl_log(LOG_ERR, "can't seek file pointer: %s\n",
 		  strerror (errno));
@@ -221,6 +292,86 @@ write_controldata (const sfex_controldata * cdata)
   while (1);
 }
 
+/*
+ * write_metadata --- write the whole meta-data area into file
+ *
+ * We build the control data and cdata->numlocks copies of ldata in one
+ * aligned buffer and write it with as few large writes as possible,
+ * instead of one write per block. Then the area is read back and
+ * compared, so that the caller knows the meta-data really is on the
+ * disk. Return value is 0 on success and -1 on error.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- pointer for lock data written into every lock slot
+ */
+int
+write_metadata (const sfex_controldata * cdata, const sfex_lockdata * ldata)
+{
+  size_t len = cdata->blocksize * (cdata->numlocks + 1);
+  char *area, *check;
+  size_t off;
+  int index, ret = -1;
+
+  if (posix_memalign ((void **) &area, SFEX_ODIRECT_ALIGNMENT, len) != 0
+      || posix_memalign ((void **) &check, SFEX_ODIRECT_ALIGNMENT, len) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+    exit (3);
+  }
+
+  format_controldata (area, cdata);
+  for (index = 1; index <= cdata->numlocks; index++)
+    format_lockdata (area + cdata->blocksize * index, cdata, ldata);
+
+  /* write in chunks of whole blocks */
+  for (off = 0; off < len; ) {
+    size_t n = len - off;
+    ssize_t s;
+
+    if (n > SFEX_INIT_CHUNK)
+      n = SFEX_INIT_CHUNK - SFEX_INIT_CHUNK % cdata->blocksize;
+    s = pwrite (default_dev.fd, area + off, n, off);
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't write meta-data: %s\n", strerror (errno));
+      goto out;
+    }
+    if (s == 0 || s % cdata->blocksize) {
+      cl_log(LOG_ERR, "can't write meta-data atomically.\n");
+      goto out;
+    }
+    off += s;
+  }
+
+  /* verify pass */
+  for (off = 0; off < len; ) {
+    ssize_t s = pread (default_dev.fd, check + off, len - off, off);
+
+    if (s == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      cl_log(LOG_ERR, "can't read back meta-data: %s\n", strerror (errno));
+      goto out;
+    }
+    if (s == 0) {
+      cl_log(LOG_ERR, "can't read back meta-data: device too small\n");
+      goto out;
+    }
+    off += s;
+  }
+  if (memcmp (area, check, len)) {
+    cl_log(LOG_ERR, "meta-data verification failed\n");
+    goto out;
+  }
+  ret = 0;
+
+out:
+  free (area);
+  free (check);
+  return ret;
+}
+
 /*
  * write_lockdata --- write lock data into file
  *
@@ -239,24 +390,25 @@ int
 write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
 		int index)
 {
-  sfex_lockdata_ondisk *block;
+  return write_lockdata_dev (&default_dev, cdata, ldata, index);
+}
+
+/*
+ * write_lockdata_dev --- write lock data into given device
+ *
+ * Same as write_lockdata(), but for the given device.
+ */
+int
+write_lockdata_dev (sfex_device * dev, const sfex_controldata * cdata,
+		    const sfex_lockdata * ldata, int index)
+{
+  void *block;
   int fd;
 
-  block = (sfex_lockdata_ondisk *) locked_mem;
-  /* We write lock data into buffer with given format */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the read_lockdata() function.
-   */
-  memset (block, 0, cdata->blocksize);
-  block->status = ldata->status;
-  snprintf ((char *) (block->count), sizeof (block->count), "%d",
-	    ldata->count);
-  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
-	    ldata->nodename);
+  block = dev->buf;
+  format_lockdata (block, cdata, ldata);
 
-  fd = dev_fd;
+  fd = dev->fd;
 
   /* seek a file pointer to given position */
   if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
@@ -297,12 +449,23 @@ write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
  */
 int
 read_controldata (sfex_controldata * cdata)
+{
+  return read_controldata_dev (&default_dev, cdata);
+}
+
+/*
+ * read_controldata_dev --- read control data from given device
+ *
+ * Same as read_controldata(), but for the given device.
+ */
+int
+read_controldata_dev (sfex_device * dev, sfex_controldata * cdata)
 {
   sfex_controldata_ondisk *block;
 
-  block = (sfex_controldata_ondisk *) (locked_mem);
+  block = (sfex_controldata_ondisk *) (dev->buf);
 
-  if (lseek (dev_fd, 0, SEEK_SET) == -1) {
+  if (lseek (dev->fd, 0, SEEK_SET) == -1) {
     cl_log(LOG_ERR, "can't seek file pointer: %s\n",
 		  strerror (errno));
     return -1;
@@ -310,7 +473,7 @@ read_controldata (sfex_controldata * cdata)
 
   /* read data from file */
   do {
-	  ssize_t s = read (dev_fd, block, sector_size);
+	  ssize_t s = read (dev->fd, block, dev->sector_size);
 	  if (s == -1) {
 		  if (errno == EINTR || errno == EAGAIN)
 			  continue;
@@ -375,13 +538,25 @@ read_controldata (sfex_controldata * cdata)
 int
 read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
 	       int index)
+{
+  return read_lockdata_dev (&default_dev, cdata, ldata, index);
+}
+
+/*
+ * read_lockdata_dev --- read lock data from given device
+ *
+ * Same as read_lockdata(), but for the given device.
+ */
+int
+read_lockdata_dev (sfex_device * dev, const sfex_controldata * cdata,
+		   sfex_lockdata * ldata, int index)
 {
   sfex_lockdata_ondisk *block;
   int fd;
 
-  block = (sfex_lockdata_ondisk *) (locked_mem);
+  block = (sfex_lockdata_ondisk *) (dev->buf);
 
-  fd = dev_fd;
+  fd = dev->fd;
 
   /* seek a file pointer to given position */
   if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
@@ -449,7 +624,18 @@ read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
 int
 lock_index_check(sfex_controldata * cdata, int index)
 {
-        if (read_controldata(cdata) == -1) {
+        return lock_index_check_dev(&default_dev, cdata, index);
+}
+
+/*
+ * lock_index_check_dev --- check the value of index on given device
+ *
+ * Same as lock_index_check(), but for the given device.
+ */
+int
+lock_index_check_dev(sfex_device * dev, sfex_controldata * cdata, int index)
+{
+        if (read_controldata_dev(dev, cdata) == -1) {
                 cl_log(LOG_ERR, "%s\n", "read_controldata failed in lock_index_check");
                 return -1;
         }
@@ -466,9 +652,115 @@ lock_index_check(sfex_controldata * cdata, int index)
                 return -1;
         }
 
-        if (cdata->blocksize != sector_size) {
+        if (cdata->blocksize != dev->sector_size) {
                 cl_log(LOG_ERR, "sector_size is not the same as the blocksize.\n");
                 return -1;
         }
         return 0;
 }
+
+/*
+ * sfex_acquire_lock --- lock acquisition protocol
+ *
+ * If another node holds the lock, we wait lock_timeout and take the lock
+ * only if its counter has not moved meanwhile. After writing our lock we
+ * wait collision_timeout and read it back to detect another node that
+ * was acquiring at the same time. Finally the counter is incremented
+ * once more, because collision_timeout was spent from the validity of
+ * the lock. Return value is one of SFEX_LOCK_*; on SFEX_LOCK_OK ldata
+ * holds the lock data as last written. A failed read after lock_timeout
+ * is reported as SFEX_LOCK_HELD, since the lock may still be in use.
+ *
+ * ops --- lock data I/O
+ *
+ * node --- our node name
+ *
+ * lock_timeout_ms, collision_timeout_ms --- timeouts in milliseconds
+ *
+ * ldata --- pointer for lock data
+ */
+int
+sfex_acquire_lock (const sfex_lockops * ops, const char *node,
+		   unsigned long lock_timeout_ms,
+		   unsigned long collision_timeout_ms, sfex_lockdata * ldata)
+{
+  sfex_lockdata ldata_new;
+
+  if (ops->read_lock (ops->ctx, ldata) == -1)
+    return SFEX_LOCK_EREAD;
+
+  if (ldata->status == SFEX_STATUS_LOCK
+      && strncmp (node, (const char *) (ldata->nodename),
+		  sizeof (ldata->nodename))) {
+    ops->wait (ops->ctx, lock_timeout_ms);
+    /* if the counter can't be read again, it can't be shown unchanged */
+    if (ops->read_lock (ops->ctx, &ldata_new) == -1)
+      return SFEX_LOCK_HELD;
+    if (ldata->count != ldata_new.count)
+      return SFEX_LOCK_HELD;
+  }
+
+  /* The lock acquisition is possible because it was not updated. */
+  ldata->status = SFEX_STATUS_LOCK;
+  ldata->count = SFEX_NEXT_COUNT (ldata->count);
+  strncpy ((char *) (ldata->nodename), node, sizeof (ldata->nodename) - 1);
+  ldata->nodename[sizeof (ldata->nodename) - 1] = 0;
+  if (ops->write_lock (ops->ctx, ldata) == -1)
+    return SFEX_LOCK_EWRITE;
+
+  /* detect the collision of lock */
+  /* The collision occurs when two or more nodes do the reservation 
+     processing of the lock at the same time. It waits for collision_timeout 
+     seconds to detect this,and whether the superscription of lock data by 
+     another node is done is checked. If the superscription was done by 
+     another node, the lock acquisition with the own node is given up.  
+   */
+  ops->wait (ops->ctx, collision_timeout_ms);
+  if (ops->read_lock (ops->ctx, &ldata_new) == -1)
+    return SFEX_LOCK_EREAD_COLLISION;
+  if (strncmp ((char *) (ldata->nodename), (const char *) (ldata_new.nodename),
+	       sizeof (ldata->nodename)))
+    return SFEX_LOCK_COLLISION;
+
+  /* extension of lock */
+  /* Validly time of the lock is extended. It is because of spending at 
+     the collision_timeout seconds to detect the collision. */
+  ldata->count = SFEX_NEXT_COUNT (ldata->count);
+  if (ops->write_lock (ops->ctx, ldata) == -1)
+    return SFEX_LOCK_EWRITE_EXTEND;
+
+  return SFEX_LOCK_OK;
+}
+
+/*
+ * sfex_update_lock --- periodic lock update
+ *
+ * We check that we still hold the lock and increment its counter. Return
+ * value is one of SFEX_LOCK_*; SFEX_LOCK_HELD means the lock has been
+ * lost to another node.
+ *
+ * ops --- lock data I/O
+ *
+ * node --- our node name
+ *
+ * ldata --- pointer for lock data
+ */
+int
+sfex_update_lock (const sfex_lockops * ops, const char *node,
+		  sfex_lockdata * ldata)
+{
+  if (ops->read_lock (ops->ctx, ldata) == -1)
+    return SFEX_LOCK_EREAD;
+
+  /* if own node is not locking, lock update is failed */
+  if (ldata->status != SFEX_STATUS_LOCK
+      || strncmp ((const char *) (ldata->nodename), node,
+		  sizeof (ldata->nodename)))
+    return SFEX_LOCK_HELD;
+
+  ldata->count = SFEX_NEXT_COUNT (ldata->count);
+  if (ops->write_lock (ops->ctx, ldata) == -1)
+    return SFEX_LOCK_EWRITE;
+
+  return SFEX_LOCK_OK;
+}
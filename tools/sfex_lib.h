@@ -33,10 +33,18 @@ char *get_nodename(void);
 void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks);
 void init_lockdata(sfex_lockdata *ldata);
 void write_controldata(const sfex_controldata *cdata);
+int write_metadata(const sfex_controldata *cdata, const sfex_lockdata *ldata);
 int write_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
 int read_controldata(sfex_controldata *cdata);
 int read_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
 int prepare_lock(const char *device);
 int lock_index_check(sfex_controldata * cdata, int index);
+int open_device(sfex_device *dev, const char *path);
+int write_lockdata_dev(sfex_device *dev, const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
+int read_controldata_dev(sfex_device *dev, sfex_controldata *cdata);
+int read_lockdata_dev(sfex_device *dev, const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
+int lock_index_check_dev(sfex_device *dev, sfex_controldata *cdata, int index);
+int sfex_acquire_lock(const sfex_lockops *ops, const char *node, unsigned long lock_timeout_ms, unsigned long collision_timeout_ms, sfex_lockdata *ldata);
+int sfex_update_lock(const sfex_lockops *ops, const char *node, sfex_lockdata *ldata);
 
 #endif /* LIB_H */
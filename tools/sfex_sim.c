@@ -0,0 +1,642 @@
+/*-------------------------------------------------------------------------
+ *
+ * Shared Disk File EXclusiveness Control Program(SF-EX)
+ *
+ * sfex_sim.c --- Simulate lock contention and takeover between nodes.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *-------------------------------------------------------------------------
+ *
+ * sfex_sim [-n <nodes>] [-r <rounds>] [-x <scenario>] [-m <monitor_interval>]
+ *          [-t <lock_timeout>[,...]] [-c <collision_timeout>[,...]]
+ *          [-d <io_delay>] [-j <io_jitter>] [-p <stall_permille>]
+ *          [-S <stall_time>] [-f <device>] [-i <index>]
+ *
+ * Every simulated node is a thread running sfex_acquire_lock() and
+ * sfex_update_lock(), the same code sfex_daemon uses, against either an
+ * in-memory lock block or, with -f, a real device initialized by
+ * sfex_init (e.g. a loop device). All times are in milliseconds. Each I/O
+ * takes io_delay plus up to io_jitter, and stalls for stall_time with
+ * the given probability.
+ *
+ * Scenarios:
+ *
+ * contention --- all nodes try to take a free lock at the same time.
+ * More than one winner is a split-brain, no winner a false collision.
+ *
+ * takeover --- node 0 holds the lock and dies, the other nodes try to
+ * take it over, retrying while it is held. The latency is measured from
+ * the death of node 0 to the first successful acquisition.
+ *
+ * partition --- node 0 holds the lock and its I/O stalls for stall_time
+ * while the other nodes try to take the lock over. Any time during which
+ * two nodes believe they hold the lock is a split-brain; it is reported
+ * as the longest such overlap.
+ *
+ * exit code --- 0 - no round ended with two holders. 1 - at least one did.
+ * 4 - The mistake is found in the command line parameter.
+ *
+ *-------------------------------------------------------------------------*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sfex.h"
+#include "sfex_lib.h"
+
+#define SIM_MAX_NODES 16
+#define SIM_MAX_SETTINGS 16
+
+#define SIM_CONTENTION 0x1
+#define SIM_TAKEOVER 0x2
+#define SIM_PARTITION 0x4
+
+const char *progname;
+char *nodename;
+
+typedef struct sim_node {
+  int id;
+  char name[32];
+  unsigned int seed;
+  sfex_device dev;
+  sfex_controldata cdata;
+  sfex_lockops ops;
+  sfex_lockdata ldata;
+
+  /* forced stall: the first I/O at or after stall_at waits stall_len */
+  double stall_at;
+  unsigned long stall_len;
+
+  /* results of a round */
+  int result;
+  double held_from;		/* 0 if the lock was never acquired */
+  double held_until;		/* 0 while the lock is still believed held */
+} sim_node;
+
+static sim_node nodes[SIM_MAX_NODES];
+static int num_nodes = 2;
+static int rounds = 20;
+static int scenarios = SIM_CONTENTION | SIM_TAKEOVER | SIM_PARTITION;
+static unsigned long monitor_interval = 100;
+static unsigned long lock_timeouts[SIM_MAX_SETTINGS] = { 300 };
+static int num_lock_timeouts = 1;
+static unsigned long collision_timeouts[SIM_MAX_SETTINGS] = { 50 };
+static int num_collision_timeouts = 1;
+static unsigned long io_delay = 1;
+static unsigned long io_jitter = 2;
+static unsigned long stall_permille = 0;
+static unsigned long stall_time = 0;	/* 0: lock_timeout + monitor_interval */
+static const char *device;
+static int lock_index = 1;
+
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sfex_lockdata disk;
+
+/* the current round */
+static unsigned long cur_lock_timeout;
+static unsigned long cur_collision_timeout;
+static pthread_barrier_t start_barrier;
+static int round_over;		/* set by the main thread, read by the nodes */
+static double challenge_at;
+static double holder_dies_at;
+
+static int
+is_round_over (void)
+{
+  return __atomic_load_n (&round_over, __ATOMIC_ACQUIRE);
+}
+
+static void
+usage (FILE * dist)
+{
+  fprintf (dist,
+	   "usage: %s [-n <nodes>] [-r <rounds>] [-x contention|takeover|partition]\n"
+	   "       [-m <monitor_interval>] [-t <lock_timeout>[,...]] [-c <collision_timeout>[,...]]\n"
+	   "       [-d <io_delay>] [-j <io_jitter>] [-p <stall_permille>] [-S <stall_time>]\n"
+	   "       [-f <device>] [-i <index>]\n", progname);
+}
+
+static double
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+sleep_ms (double msec)
+{
+  struct timespec ts;
+
+  if (msec <= 0)
+    return;
+  ts.tv_sec = (time_t) (msec / 1000);
+  ts.tv_nsec = (long) ((msec - ts.tv_sec * 1000.0) * 1000000.0);
+  while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+/*
+ * sim_io --- one simulated I/O
+ *
+ * The I/O takes effect in the middle of its delay. Stalls delay it
+ * before it takes effect, so a write that stalls lands late with the
+ * data it was given.
+ */
+static int
+sim_io (sim_node * n, int write, sfex_lockdata * ld)
+{
+  double delay = io_delay + (io_jitter ? rand_r (&n->seed) % (io_jitter + 1) : 0);
+  int ret = 0;
+
+  if (stall_permille && (unsigned long) (rand_r (&n->seed) % 1000) < stall_permille)
+    sleep_ms (stall_time);
+  if (n->stall_len && now_ms () >= n->stall_at) {
+    sleep_ms (n->stall_len);
+    n->stall_len = 0;
+  }
+  sleep_ms (delay / 2);
+
+  if (device) {
+    if (write)
+      ret = write_lockdata_dev (&n->dev, &n->cdata, ld, lock_index);
+    else
+      ret = read_lockdata_dev (&n->dev, &n->cdata, ld, lock_index);
+  } else {
+    pthread_mutex_lock (&disk_mutex);
+    if (write)
+      disk = *ld;
+    else
+      *ld = disk;
+    pthread_mutex_unlock (&disk_mutex);
+  }
+
+  sleep_ms (delay / 2);
+  return ret;
+}
+
+static int
+sim_read_lock (void *ctx, sfex_lockdata * ld)
+{
+  return sim_io (ctx, 0, ld);
+}
+
+static int
+sim_write_lock (void *ctx, const sfex_lockdata * ld)
+{
+  sfex_lockdata tmp = *ld;
+
+  return sim_io (ctx, 1, &tmp);
+}
+
+static void
+sim_wait (void *ctx, unsigned long msec)
+{
+  sleep_ms (msec);
+}
+
+static void
+reset_disk (void)
+{
+  sfex_lockdata ld;
+
+  init_lockdata (&ld);
+  if (device) {
+    if (write_lockdata_dev (&nodes[0].dev, &nodes[0].cdata, &ld, lock_index) == -1) {
+      fprintf (stderr, "%s: ERROR: cannot reset lock data.\n", progname);
+      exit (3);
+    }
+  } else {
+    disk = ld;
+  }
+}
+
+static void
+reset_node (sim_node * n)
+{
+  n->stall_at = 0;
+  n->stall_len = 0;
+  n->result = 0;
+  n->held_from = 0;
+  n->held_until = 0;
+}
+
+/*
+ * hold --- keep updating the lock as sfex_daemon does
+ *
+ * Returns when the round is over, when the node dies at holder_dies_at
+ * (node 0 in the takeover scenario) or when the lock is found lost.
+ */
+static void
+hold (sim_node * n)
+{
+  while (!is_round_over ()) {
+    int ret;
+
+    sleep_ms (monitor_interval);
+    if (n->id == 0 && holder_dies_at > 0 && now_ms () >= holder_dies_at) {
+      n->held_until = holder_dies_at;
+      return;
+    }
+    if (is_round_over ())
+      return;
+    ret = sfex_update_lock (&n->ops, n->name, &n->ldata);
+    if (ret != SFEX_LOCK_OK) {
+      n->result = ret;
+      n->held_until = now_ms ();
+      return;
+    }
+  }
+}
+
+static void *
+contender (void *arg)
+{
+  sim_node *n = arg;
+
+  pthread_barrier_wait (&start_barrier);
+  n->result = sfex_acquire_lock (&n->ops, n->name, cur_lock_timeout,
+				 cur_collision_timeout, &n->ldata);
+  if (n->result == SFEX_LOCK_OK)
+    n->held_from = now_ms ();
+  return NULL;
+}
+
+/*
+ * challenger --- try to take the lock over until it succeeds
+ *
+ * Like a cluster manager restarting a failed start, a node retries while
+ * the lock is held or a collision was detected. On success it keeps the
+ * lock updated.
+ */
+static void *
+challenger (void *arg)
+{
+  sim_node *n = arg;
+
+  pthread_barrier_wait (&start_barrier);
+  sleep_ms (challenge_at - now_ms ());
+  while (!is_round_over ()) {
+    n->result = sfex_acquire_lock (&n->ops, n->name, cur_lock_timeout,
+				   cur_collision_timeout, &n->ldata);
+    if (n->result == SFEX_LOCK_OK) {
+      n->held_from = now_ms ();
+      hold (n);
+      return NULL;
+    }
+    sleep_ms (monitor_interval);
+  }
+  return NULL;
+}
+
+static void *
+holder (void *arg)
+{
+  sim_node *n = arg;
+
+  pthread_barrier_wait (&start_barrier);
+  hold (n);
+  return NULL;
+}
+
+/*
+ * take_lock --- make node 0 the holder before a round starts
+ */
+static void
+take_lock (sim_node * n)
+{
+  int ret;
+
+  ret = sfex_acquire_lock (&n->ops, n->name, cur_lock_timeout,
+			   cur_collision_timeout, &n->ldata);
+  if (ret != SFEX_LOCK_OK) {
+    fprintf (stderr, "%s: ERROR: node 0 can't take a free lock (%d).\n",
+	     progname, ret);
+    exit (3);
+  }
+  n->held_from = now_ms ();
+}
+
+/*
+ * max_overlap --- longest time two nodes both believed to hold the lock
+ *
+ * *open is set if two nodes still held the lock at the end of the round.
+ */
+static double
+max_overlap (double end, int *open)
+{
+  double max = 0;
+  int i, j;
+
+  *open = 0;
+  for (i = 0; i < num_nodes; i++) {
+    for (j = i + 1; j < num_nodes; j++) {
+      double from, until;
+
+      if (nodes[i].held_from <= 0 || nodes[j].held_from <= 0)
+	continue;
+      from = nodes[i].held_from > nodes[j].held_from
+	? nodes[i].held_from : nodes[j].held_from;
+      until = end;
+      if (nodes[i].held_until > 0 && nodes[i].held_until < until)
+	until = nodes[i].held_until;
+      if (nodes[j].held_until > 0 && nodes[j].held_until < until)
+	until = nodes[j].held_until;
+      if (until > from && until - from > max)
+	max = until - from;
+      if (nodes[i].held_until <= 0 && nodes[j].held_until <= 0)
+	*open = 1;
+    }
+  }
+  return max;
+}
+
+typedef struct sim_stats {
+  int rounds;
+  int acquired;			/* rounds in which the lock was taken */
+  int split;			/* rounds with two holders at some time */
+  int open_split;		/* rounds ending with two holders */
+  int false_collision;		/* contention rounds without a winner */
+  double lat_sum, lat_max;	/* takeover latency */
+  double overlap_max;
+} sim_stats;
+
+static void
+run_round (int scenario, sim_stats * st)
+{
+  pthread_t tids[SIM_MAX_NODES];
+  double start, end, first = 0, overlap;
+  int i, winners = 0, open;
+  unsigned long stall = stall_time ? stall_time
+    : cur_lock_timeout + monitor_interval;
+
+  reset_disk ();
+  for (i = 0; i < num_nodes; i++)
+    reset_node (&nodes[i]);
+  __atomic_store_n (&round_over, 0, __ATOMIC_RELEASE);
+  holder_dies_at = 0;
+  pthread_barrier_init (&start_barrier, NULL, num_nodes);
+
+  if (scenario == SIM_CONTENTION) {
+    for (i = 0; i < num_nodes; i++)
+      pthread_create (&tids[i], NULL, contender, &nodes[i]);
+    for (i = 0; i < num_nodes; i++)
+      pthread_join (tids[i], NULL);
+    end = now_ms ();
+  } else {
+    take_lock (&nodes[0]);
+    /* let the other nodes start at a random point of the update cycle */
+    start = now_ms () + rand_r (&nodes[0].seed) % (monitor_interval + 1);
+    challenge_at = start;
+    if (scenario == SIM_TAKEOVER) {
+      holder_dies_at = start;
+    } else {
+      nodes[0].stall_at = start;
+      nodes[0].stall_len = stall;
+    }
+    pthread_create (&tids[0], NULL, holder, &nodes[0]);
+    for (i = 1; i < num_nodes; i++)
+      pthread_create (&tids[i], NULL, challenger, &nodes[i]);
+
+    /* long enough for a takeover and for node 0 to notice it */
+    sleep_ms (start - now_ms () + stall + 2 * cur_lock_timeout
+	      + 2 * cur_collision_timeout + 4 * monitor_interval);
+    end = now_ms ();
+    __atomic_store_n (&round_over, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < num_nodes; i++)
+      pthread_join (tids[i], NULL);
+
+    for (i = 1; i < num_nodes; i++) {
+      if (nodes[i].held_from > 0 && (first <= 0 || nodes[i].held_from < first))
+	first = nodes[i].held_from;
+    }
+    if (first > 0 && scenario == SIM_TAKEOVER) {
+      st->lat_sum += first - start;
+      if (first - start > st->lat_max)
+	st->lat_max = first - start;
+    }
+  }
+  pthread_barrier_destroy (&start_barrier);
+
+  for (i = 0; i < num_nodes; i++) {
+    if (nodes[i].held_from > 0 && !(scenario != SIM_CONTENTION && i == 0))
+      winners++;
+  }
+  st->rounds++;
+  if (winners)
+    st->acquired++;
+  else if (scenario == SIM_CONTENTION)
+    st->false_collision++;
+
+  overlap = max_overlap (end, &open);
+  if (overlap > 0)
+    st->split++;
+  if (open)
+    st->open_split++;
+  if (overlap > st->overlap_max)
+    st->overlap_max = overlap;
+}
+
+static const char *
+scenario_name (int scenario)
+{
+  switch (scenario) {
+  case SIM_CONTENTION:
+    return "contention";
+  case SIM_TAKEOVER:
+    return "takeover";
+  default:
+    return "partition";
+  }
+}
+
+static int
+parse_list (const char *arg, unsigned long *list, const char *what)
+{
+  char *copy = strdup (arg), *tok, *save = NULL;
+  int n = 0;
+
+  for (tok = strtok_r (copy, ",", &save); tok; tok = strtok_r (NULL, ",", &save)) {
+    char *end;
+    unsigned long l = strtoul (tok, &end, 10);
+
+    if (*end || l < 1 || n >= SIM_MAX_SETTINGS) {
+      fprintf (stderr, "%s: ERROR: invalid %s %s.\n", progname, what, arg);
+      exit (4);
+    }
+    list[n++] = l;
+  }
+  free (copy);
+  if (n == 0) {
+    fprintf (stderr, "%s: ERROR: invalid %s %s.\n", progname, what, arg);
+    exit (4);
+  }
+  return n;
+}
+
+static unsigned long
+parse_num (const char *arg, unsigned long min, unsigned long max,
+	   const char *what)
+{
+  char *end;
+  unsigned long l = strtoul (arg, &end, 10);
+
+  if (*end || l < min || l > max) {
+    fprintf (stderr,
+	     "%s: ERROR: %s %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+	     progname, what, arg, min, max);
+    exit (4);
+  }
+  return l;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int status = 0;
+  int i, t, c, x;
+
+  progname = get_progname (argv[0]);
+  cl_log_set_entity (progname);
+  cl_log_enable_stderr (TRUE);
+
+  opterr = 0;
+  while (1) {
+    int opt = getopt (argc, argv, "hn:r:x:m:t:c:d:j:p:S:f:i:");
+    if (opt == -1)
+      break;
+    switch (opt) {
+    case 'h':
+      usage (stdout);
+      exit (0);
+    case 'n':
+      num_nodes = parse_num (optarg, 2, SIM_MAX_NODES, "nodes");
+      break;
+    case 'r':
+      rounds = parse_num (optarg, 1, 1000000, "rounds");
+      break;
+    case 'x':
+      if (!strcmp (optarg, "contention"))
+	scenarios = SIM_CONTENTION;
+      else if (!strcmp (optarg, "takeover"))
+	scenarios = SIM_TAKEOVER;
+      else if (!strcmp (optarg, "partition"))
+	scenarios = SIM_PARTITION;
+      else {
+	fprintf (stderr, "%s: ERROR: unknown scenario %s.\n", progname, optarg);
+	exit (4);
+      }
+      break;
+    case 'm':
+      monitor_interval = parse_num (optarg, 1, 3600000, "monitor_interval");
+      break;
+    case 't':
+      num_lock_timeouts = parse_list (optarg, lock_timeouts, "lock_timeout");
+      break;
+    case 'c':
+      num_collision_timeouts = parse_list (optarg, collision_timeouts,
+					   "collision_timeout");
+      break;
+    case 'd':
+      io_delay = parse_num (optarg, 0, 3600000, "io_delay");
+      break;
+    case 'j':
+      io_jitter = parse_num (optarg, 0, 3600000, "io_jitter");
+      break;
+    case 'p':
+      stall_permille = parse_num (optarg, 0, 1000, "stall_permille");
+      break;
+    case 'S':
+      stall_time = parse_num (optarg, 0, 3600000, "stall_time");
+      break;
+    case 'f':
+      device = optarg;
+      break;
+    case 'i':
+      lock_index = parse_num (optarg, SFEX_MIN_NUMLOCKS, SFEX_MAX_NUMLOCKS,
+			      "index");
+      break;
+    case '?':
+      usage (stderr);
+      exit (4);
+    }
+  }
+  if (optind < argc) {
+    fprintf (stderr, "%s: ERROR: too many arguments.\n", progname);
+    usage (stderr);
+    exit (4);
+  }
+
+  for (i = 0; i < num_nodes; i++) {
+    sim_node *n = &nodes[i];
+
+    n->id = i;
+    n->seed = (unsigned int) time (NULL) ^ (i * 2654435761U);
+    snprintf (n->name, sizeof (n->name), "sim-node-%d", i);
+    n->ops.read_lock = sim_read_lock;
+    n->ops.write_lock = sim_write_lock;
+    n->ops.wait = sim_wait;
+    n->ops.ctx = n;
+    /* every node has its own file descriptor and buffer, as on a
+       real cluster */
+    if (device) {
+      if (open_device (&n->dev, device) == -1
+	  || lock_index_check_dev (&n->dev, &n->cdata, lock_index) == -1)
+	exit (3);
+    }
+  }
+
+  printf ("%-10s %8s %8s %6s %6s %6s %6s %6s %9s %9s %9s\n",
+	  "scenario", "lock_to", "coll_to", "rounds", "taken", "split",
+	  "open", "falsec", "lat_avg", "lat_max", "ovl_max");
+  for (x = SIM_CONTENTION; x <= SIM_PARTITION; x <<= 1) {
+    if (!(scenarios & x))
+      continue;
+    for (t = 0; t < num_lock_timeouts; t++) {
+      for (c = 0; c < num_collision_timeouts; c++) {
+	sim_stats st;
+	int r;
+
+	memset (&st, 0, sizeof (st));
+	cur_lock_timeout = lock_timeouts[t];
+	cur_collision_timeout = collision_timeouts[c];
+	for (r = 0; r < rounds; r++)
+	  run_round (x, &st);
+
+	printf ("%-10s %8lu %8lu %6d %6d %6d %6d %6d %9.1f %9.1f %9.1f\n",
+		scenario_name (x), cur_lock_timeout, cur_collision_timeout,
+		st.rounds, st.acquired, st.split, st.open_split,
+		st.false_collision,
+		x == SIM_TAKEOVER && st.acquired ? st.lat_sum / st.acquired : 0.0,
+		st.lat_max, st.overlap_max);
+	fflush (stdout);
+	if (st.open_split)
+	  status = 1;
+      }
+    }
+  }
+
+  exit (status);
+}
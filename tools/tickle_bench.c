@@ -0,0 +1,266 @@
+/*
+   Time the ways tickle_tcp can checksum its packets
+
+   tickle_bench [-n packets] [-r rounds] [-s seed]
+
+	Makes up that many random tickles (100000 by default), half IPv4
+	and half IPv6, laid out in batches the way tickle_tcp queues
+	them, and fills in their TCP checksums, rounds times (10), with
+
+	  full		tcp_checksum()/tcp_checksum6() over every packet,
+			the way tickle_tcp first did it,
+	  scalar, sse2, avx2
+			csum_batch() with the given kernel, the way
+			tickle_tcp does it now (with the fastest one).
+
+	Every method's checksums are checked against "full".  Kernels
+	this CPU does not have are skipped.
+
+	Not installed: "make tickle_bench".
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include "tickle_csum.h"
+
+#define BATCH	64	/* TICKLE_BATCH */
+
+/* as in tickle_tcp.c */
+union tickle_pkt {
+	struct {
+		struct iphdr ip;
+		struct tcphdr tcp;
+	} ip4;
+	struct {
+		struct ip6_hdr ip6;
+		struct tcphdr tcp;
+	} ip6;
+};
+
+static const char *cmdname = "tickle_bench";
+static union tickle_pkt tmpl4, tmpl6;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: %s [-n packets] [-r rounds] [-s seed]\n", cmdname);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void init_templates(void)
+{
+	tmpl4.ip4.ip.version  = 4;
+	tmpl4.ip4.ip.ihl      = sizeof(tmpl4.ip4.ip)/4;
+	tmpl4.ip4.ip.tot_len  = htons(sizeof(tmpl4.ip4));
+	tmpl4.ip4.ip.ttl      = 255;
+	tmpl4.ip4.ip.protocol = IPPROTO_TCP;
+	tmpl4.ip4.tcp.th_flags = TH_ACK;
+	tmpl4.ip4.tcp.th_off  = sizeof(tmpl4.ip4.tcp)/4;
+	tmpl4.ip4.tcp.th_win  = htons(1234);
+	tmpl4.ip4.tcp.th_sum  = tcp_checksum((uint16_t *)&tmpl4.ip4.tcp, sizeof(tmpl4.ip4.tcp), &tmpl4.ip4.ip);
+
+	tmpl6.ip6.ip6.ip6_vfc  = 0x60;
+	tmpl6.ip6.ip6.ip6_plen = htons(20);
+	tmpl6.ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+	tmpl6.ip6.ip6.ip6_hlim = 64;
+	tmpl6.ip6.tcp.th_flags = TH_ACK;
+	tmpl6.ip6.tcp.th_off  = sizeof(tmpl6.ip6.tcp)/4;
+	tmpl6.ip6.tcp.th_win  = htons(1234);
+	tmpl6.ip6.tcp.th_sum  = tcp_checksum6((uint16_t *)&tmpl6.ip6.tcp, sizeof(tmpl6.ip6.tcp), &tmpl6.ip6.ip6);
+}
+
+static void random_bytes(void *p, size_t len)
+{
+	unsigned char *b = p;
+
+	while (len--) {
+		*b++ = random();
+	}
+}
+
+/* n4 IPv4 packets, then n6 IPv6 ones */
+static void make_packets(union tickle_pkt *pkts, int n4, int n6)
+{
+	union tickle_pkt *p;
+	int j;
+
+	for (j = 0; j < n4 + n6; j++) {
+		p = &pkts[j];
+		if (j < n4) {
+			*p = tmpl4;
+			random_bytes(&p->ip4.ip.saddr, 8);
+			random_bytes(&p->ip4.tcp.th_sport, 4);
+			if (random() % 2) {
+				p->ip4.tcp.th_flags |= TH_RST;
+			}
+		} else {
+			*p = tmpl6;
+			random_bytes(&p->ip6.ip6.ip6_src, 32);
+			random_bytes(&p->ip6.tcp.th_sport, 4);
+			if (random() % 2) {
+				p->ip6.tcp.th_flags |= TH_RST;
+			}
+		}
+	}
+}
+
+enum method { M_FULL, M_SCALAR, M_SSE2, M_AVX2, M_COUNT };
+
+static const char *method_name[M_COUNT] = {
+	"full", "scalar", "sse2", "avx2",
+};
+
+static const enum csum_impl method_impl[M_COUNT] = {
+	0, CSUM_SCALAR, CSUM_SSE2, CSUM_AVX2,
+};
+
+static void checksum(enum method m, union tickle_pkt *pkts, int n4, int n6)
+{
+	union tickle_pkt *p;
+	int j, n;
+
+	switch (m) {
+	case M_FULL:
+		for (j = 0; j < n4 + n6; j++) {
+			p = &pkts[j];
+			if (j < n4) {
+				p->ip4.tcp.th_sum = 0;
+				p->ip4.tcp.th_sum = tcp_checksum((uint16_t *)&p->ip4.tcp, sizeof(p->ip4.tcp), &p->ip4.ip);
+			} else {
+				p->ip6.tcp.th_sum = 0;
+				p->ip6.tcp.th_sum = tcp_checksum6((uint16_t *)&p->ip6.tcp, sizeof(p->ip6.tcp), &p->ip6.ip6);
+			}
+		}
+		break;
+	default:
+		for (j = 0; j < n4; j += BATCH) {
+			n = n4 - j < BATCH ? n4 - j : BATCH;
+			csum_batch(method_impl[m], &pkts[j], sizeof(*pkts), n,
+				   offsetof(union tickle_pkt, ip4.ip.saddr), 8 + sizeof(struct tcphdr),
+				   offsetof(union tickle_pkt, ip4.tcp.th_sum), TCP_CSUM_BASE);
+		}
+		for (j = n4; j < n4 + n6; j += BATCH) {
+			n = n4 + n6 - j < BATCH ? n4 + n6 - j : BATCH;
+			csum_batch(method_impl[m], &pkts[j], sizeof(*pkts), n,
+				   offsetof(union tickle_pkt, ip6.ip6.ip6_src), 32 + sizeof(struct tcphdr),
+				   offsetof(union tickle_pkt, ip6.tcp.th_sum), TCP_CSUM_BASE);
+		}
+		break;
+	}
+}
+
+static uint16_t sum_of(const union tickle_pkt *p, int v4)
+{
+	uint16_t sum = v4 ? p->ip4.tcp.th_sum : p->ip6.tcp.th_sum;
+
+	/* 0 and 0xffff are the same in one's complement */
+	return sum == 0 ? 0xffff : sum;
+}
+
+int main(int argc, char **argv)
+{
+	union tickle_pkt *pkts;
+	uint16_t *want;
+	int npkts = 100000, rounds = 10, n4, n6;
+	unsigned int seed = 1;
+	double t0, t, t_full = 0;
+	int c, j, r, m, rc = 0;
+	unsigned long bad;
+
+	cmdname = argv[0];
+	while ((c = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			if ((npkts = atoi(optarg)) < 2) {
+				usage();
+			}
+			break;
+		case 'r':
+			if ((rounds = atoi(optarg)) < 1) {
+				usage();
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc) {
+		usage();
+	}
+
+	pkts = calloc(npkts, sizeof(*pkts));
+	want = calloc(npkts, sizeof(*want));
+	if (pkts == NULL || want == NULL) {
+		fprintf(stderr, "%s: out of memory\n", cmdname);
+		return 1;
+	}
+	srandom(seed);
+	init_templates();
+	n4 = npkts / 2;
+	n6 = npkts - n4;
+	make_packets(pkts, n4, n6);
+
+	checksum(M_FULL, pkts, n4, n6);
+	for (j = 0; j < npkts; j++) {
+		want[j] = sum_of(&pkts[j], j < n4);
+	}
+
+	printf("%-8s %10s %10s %9s %s\n", "method", "ns/packet", "Mpackets/s", "speedup", "");
+	for (m = 0; m < M_COUNT; m++) {
+		if (m >= M_SCALAR && !csum_impl_supported(method_impl[m])) {
+			printf("%-8s %10s\n", method_name[m], "-");
+			continue;
+		}
+		t0 = now();
+		for (r = 0; r < rounds; r++) {
+			checksum(m, pkts, n4, n6);
+		}
+		t = (now() - t0) / ((double)rounds * npkts);
+		if (m == M_FULL) {
+			t_full = t;
+		}
+		bad = 0;
+		for (j = 0; j < npkts; j++) {
+			if (sum_of(&pkts[j], j < n4) != want[j]) {
+				bad++;
+			}
+		}
+		printf("%-8s %10.2f %10.1f %8.1fx %s\n", method_name[m], t * 1e9,
+		       1e-6 / t, t_full / t, bad ? "MISMATCH" : "ok");
+		rc |= bad != 0;
+	}
+	free(pkts);
+	free(want);
+	return rc;
+}
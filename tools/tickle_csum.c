@@ -0,0 +1,361 @@
+/* 
+   TCP checksums for tickle_tcp
+
+   Split out of tickle_tcp.c, so tickle_bench can time them.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "tickle_csum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Read the data bytewise: the packets are built through struct
+ * members, and reading them back through a uint16_t pointer lets
+ * the compiler move the checksum ahead of the stores it depends on.
+ */
+static uint32_t uint16_checksum(uint16_t *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t sum=0;
+	while (n >= 2) {
+		sum += ((uint32_t)p[0] << 8) | p[1];
+		p += 2;
+		n -= 2;
+	}
+	if (n == 1) {
+		sum += (uint32_t)p[0] << 8;
+	}
+	return sum;
+}
+
+uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
+{
+	uint32_t sum = uint16_checksum(data, n);
+	uint16_t sum2;
+	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
+				sizeof(ip->saddr));
+	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
+				sizeof(ip->daddr));
+	sum += ip->protocol + n;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum2 = htons(sum);
+	sum2 = ~sum2;
+	if (sum2 == 0) {
+		return 0xFFFF;
+	}
+	return sum2;
+}
+
+uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
+{
+	uint32_t phdr[2];
+	uint32_t sum = 0;
+	uint16_t sum2;
+
+	memset(phdr, 0, sizeof(phdr));
+
+	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
+	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
+
+	phdr[0] = htonl(n);
+	phdr[1] = htonl(ip6->ip6_nxt);
+	sum += uint16_checksum((uint16_t *)phdr, 8);
+
+	sum += uint16_checksum(data, n);
+
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum2 = htons(sum);
+	sum2 = ~sum2;
+	if (sum2 == 0) {
+		return 0xFFFF;
+	}
+	return sum2;
+}
+
+static uint32_t fold(uint32_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+/*
+ * csum_batch() kernels.  The base, the pseudo header words not in the
+ * packet, is the precomputed part of every sum; the rest is added up
+ * straight from the packet, checksum field as 0.
+ *
+ * All of them add up the words as they are in memory, which works just
+ * as well for a one's complement sum (RFC 1071, 2.(B)) as long as the
+ * result is stored the same way, and base is swapped to match.
+ */
+static void csum_batch_scalar(unsigned char *p, size_t stride, int n,
+			      size_t off, size_t len, size_t sumoff, uint32_t base)
+{
+	uint16_t sum, w;
+	uint32_t s;
+	size_t i;
+
+	base = htons(fold(base));
+	for (; n > 0; n--, p += stride) {
+		memset(p + sumoff, 0, 2);
+		s = base;
+		for (i = off; i < off + len; i += 2) {
+			memcpy(&w, p + i, 2);
+			s += w;
+		}
+		sum = ~fold(s);
+		memcpy(p + sumoff, &sum, 2);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The SIMD kernels load 16 byte blocks: as many whole ones as fit in
+ * the run of bytes, and, if some are left over, one more ending at its
+ * end.  mask keeps only the bytes of a block that are to be counted:
+ * not those the last block has in common with the one before, and
+ * not the checksum field.  So nothing outside the run is read, and the
+ * checksum field needs no clearing first.
+ */
+#define MAXBLOCKS	8
+
+struct csum_plan {
+	int n;
+	size_t at[MAXBLOCKS];
+	unsigned char mask[MAXBLOCKS][16];
+};
+
+static int make_plan(struct csum_plan *pl, size_t off, size_t len, size_t sumoff)
+{
+	size_t whole = len / 16, k, j, pos;
+
+	if (len < 16 || whole + (len % 16 != 0) > MAXBLOCKS) {
+		return -1;
+	}
+	pl->n = 0;
+	for (k = 0; k < whole; k++) {
+		pl->at[pl->n++] = off + 16 * k;
+	}
+	if (len % 16) {
+		pl->at[pl->n++] = off + len - 16;
+	}
+	for (k = 0; k < (size_t)pl->n; k++) {
+		for (j = 0; j < 16; j++) {
+			pos = pl->at[k] + j;
+			pl->mask[k][j] = (k < whole || pos >= off + 16 * whole)
+				      && (pos < sumoff || pos >= sumoff + 2) ? 0xff : 0;
+		}
+	}
+	return 0;
+}
+
+/* Four 32 bit partial sums of the counted words at p */
+__attribute__((target("sse2")))
+static inline __m128i sum_sse2(const unsigned char *p, const struct csum_plan *pl,
+			       const __m128i *mask)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero, v;
+	int k;
+
+	for (k = 0; k < pl->n; k++) {
+		v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + pl->at[k])), mask[k]);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+	}
+	return acc;
+}
+
+/* The partial sums of a, b, c and d, added up: one lane each */
+__attribute__((target("sse2")))
+static inline __m128i reduce4_sse2(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	__m128i ab = _mm_add_epi32(_mm_unpacklo_epi32(a, b), _mm_unpackhi_epi32(a, b));
+	__m128i cd = _mm_add_epi32(_mm_unpacklo_epi32(c, d), _mm_unpackhi_epi32(c, d));
+
+	return _mm_add_epi32(_mm_unpacklo_epi64(ab, cd), _mm_unpackhi_epi64(ab, cd));
+}
+
+/* base added to every lane, folded to 16 bits and inverted */
+__attribute__((target("sse2")))
+static inline __m128i finish_sse2(__m128i s, uint32_t base)
+{
+	const __m128i lo = _mm_set1_epi32(0xFFFF);
+
+	s = _mm_add_epi32(s, _mm_set1_epi32(base));
+	s = _mm_add_epi32(_mm_and_si128(s, lo), _mm_srli_epi32(s, 16));
+	s = _mm_add_epi32(_mm_and_si128(s, lo), _mm_srli_epi32(s, 16));
+	return _mm_xor_si128(s, lo);
+}
+
+static inline void put_sum(unsigned char *p, size_t sumoff, int sum)
+{
+	uint16_t s = sum;
+
+	memcpy(p + sumoff, &s, 2);
+}
+
+__attribute__((target("sse2")))
+static void csum_batch_sse2(unsigned char *p, size_t stride, int n,
+			    const struct csum_plan *pl, size_t sumoff, uint32_t base)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i mask[MAXBLOCKS], s;
+	int k;
+
+	for (k = 0; k < pl->n; k++) {
+		mask[k] = _mm_loadu_si128((const __m128i *)pl->mask[k]);
+	}
+	for (; n >= 4; n -= 4, p += 4 * stride) {
+		s = reduce4_sse2(sum_sse2(p, pl, mask),
+				 sum_sse2(p + stride, pl, mask),
+				 sum_sse2(p + 2 * stride, pl, mask),
+				 sum_sse2(p + 3 * stride, pl, mask));
+		s = finish_sse2(s, base);
+		put_sum(p, sumoff, _mm_extract_epi16(s, 0));
+		put_sum(p + stride, sumoff, _mm_extract_epi16(s, 2));
+		put_sum(p + 2 * stride, sumoff, _mm_extract_epi16(s, 4));
+		put_sum(p + 3 * stride, sumoff, _mm_extract_epi16(s, 6));
+	}
+	for (; n > 0; n--, p += stride) {
+		s = reduce4_sse2(sum_sse2(p, pl, mask), zero, zero, zero);
+		s = finish_sse2(s, base);
+		put_sum(p, sumoff, _mm_extract_epi16(s, 0));
+	}
+}
+
+/* The SSE2 kernel, for p in the low lane and q in the high one */
+__attribute__((target("avx2")))
+static inline __m256i sum_avx2(const unsigned char *p, const unsigned char *q,
+			       const struct csum_plan *pl, const __m256i *mask)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero, v;
+	int k;
+
+	for (k = 0; k < pl->n; k++) {
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *)(p + pl->at[k]))),
+			_mm_loadu_si128((const __m128i *)(q + pl->at[k])), 1);
+		v = _mm256_and_si256(v, mask[k]);
+		acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+		acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+	}
+	return acc;
+}
+
+/* Eight packets at a time, packets j and j + 4 sharing a register */
+__attribute__((target("avx2")))
+static void csum_batch_avx2(unsigned char *p, size_t stride, int n,
+			    const struct csum_plan *pl, size_t sumoff, uint32_t base)
+{
+	const __m256i lo = _mm256_set1_epi32(0xFFFF);
+	__m256i mask[MAXBLOCKS], a, b, c, d, ab, cd, s;
+	uint32_t sums[8];
+	int k;
+
+	for (k = 0; k < pl->n; k++) {
+		mask[k] = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *)pl->mask[k]));
+	}
+	for (; n >= 8; n -= 8, p += 8 * stride) {
+		a = sum_avx2(p, p + 4 * stride, pl, mask);
+		b = sum_avx2(p + stride, p + 5 * stride, pl, mask);
+		c = sum_avx2(p + 2 * stride, p + 6 * stride, pl, mask);
+		d = sum_avx2(p + 3 * stride, p + 7 * stride, pl, mask);
+		ab = _mm256_add_epi32(_mm256_unpacklo_epi32(a, b), _mm256_unpackhi_epi32(a, b));
+		cd = _mm256_add_epi32(_mm256_unpacklo_epi32(c, d), _mm256_unpackhi_epi32(c, d));
+		s = _mm256_add_epi32(_mm256_unpacklo_epi64(ab, cd), _mm256_unpackhi_epi64(ab, cd));
+
+		s = _mm256_add_epi32(s, _mm256_set1_epi32(base));
+		s = _mm256_add_epi32(_mm256_and_si256(s, lo), _mm256_srli_epi32(s, 16));
+		s = _mm256_add_epi32(_mm256_and_si256(s, lo), _mm256_srli_epi32(s, 16));
+		_mm256_storeu_si256((__m256i *)sums, _mm256_xor_si256(s, lo));
+		for (k = 0; k < 8; k++) {
+			put_sum(p + k * stride, sumoff, sums[k]);
+		}
+	}
+	if (n) {
+		csum_batch_sse2(p, stride, n, pl, sumoff, base);
+	}
+}
+#endif /* HAVE_X86_SIMD */
+
+int csum_impl_supported(enum csum_impl impl)
+{
+	switch (impl) {
+	case CSUM_BEST:
+	case CSUM_SCALAR:
+		return 1;
+#ifdef HAVE_X86_SIMD
+	case CSUM_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case CSUM_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char *csum_impl_name(enum csum_impl impl)
+{
+	switch (impl) {
+	case CSUM_BEST:
+		return "best";
+	case CSUM_SCALAR:
+		return "scalar";
+	case CSUM_SSE2:
+		return "sse2";
+	case CSUM_AVX2:
+		return "avx2";
+	}
+	return "unknown";
+}
+
+void csum_batch(enum csum_impl impl, void *pkts, size_t stride, int n,
+		size_t off, size_t len, size_t sumoff, uint32_t base)
+{
+	if (impl == CSUM_BEST) {
+		impl = csum_impl_supported(CSUM_AVX2) ? CSUM_AVX2
+		     : csum_impl_supported(CSUM_SSE2) ? CSUM_SSE2
+		     : CSUM_SCALAR;
+	}
+#ifdef HAVE_X86_SIMD
+	if (impl == CSUM_SSE2 || impl == CSUM_AVX2) {
+		struct csum_plan pl;
+
+		/* unless the run is too short, or too long, for them */
+		if (make_plan(&pl, off, len, sumoff) == 0) {
+			base = htons(fold(base));
+			if (impl == CSUM_AVX2) {
+				csum_batch_avx2(pkts, stride, n, &pl, sumoff, base);
+			} else {
+				csum_batch_sse2(pkts, stride, n, &pl, sumoff, base);
+			}
+			return;
+		}
+	}
+#endif
+	csum_batch_scalar(pkts, stride, n, off, len, sumoff, base);
+}
@@ -0,0 +1,55 @@
+/*
+   TCP checksums for tickle_tcp
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_CSUM_H
+#define TICKLE_CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+/* The whole TCP checksum, pseudo header and all, the slow way */
+uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip);
+uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6);
+
+/*
+ * Checksum a batch of n packets, stride bytes apart.  The sum covers
+ * the len bytes at off in each packet, plus base, the part of the
+ * pseudo header that is not in the packet, as a sum of 16 bit words
+ * (TCP_CSUM_BASE for a bare TCP header).  The 16 bit checksum field
+ * at sumoff, which must lie within those bytes, is filled in.
+ *
+ * For IPv4 the addresses (at the end of the IP header) and the TCP
+ * header following them are one run of bytes, for IPv6 too, so that
+ * is one call per batch and address family.
+ */
+#define TCP_CSUM_BASE	(IPPROTO_TCP + 20)
+
+enum csum_impl {
+	CSUM_BEST,		/* the fastest one this CPU has */
+	CSUM_SCALAR,
+	CSUM_SSE2,
+	CSUM_AVX2,
+};
+
+int	csum_impl_supported(enum csum_impl impl);
+const char *csum_impl_name(enum csum_impl impl);
+void	csum_batch(enum csum_impl impl, void *pkts, size_t stride, int n,
+		   size_t off, size_t len, size_t sumoff, uint32_t base);
+
+#endif /* TICKLE_CSUM_H */
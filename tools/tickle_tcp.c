@@ -24,7 +24,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <time.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
@@ -32,8 +35,11 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <net/if.h>
-
-#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include "tickle_csum.h"
 
 typedef union {
 	struct sockaddr     sa;
@@ -47,71 +53,17 @@ static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin);
 static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr);
 int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr);
 int parse_ip_port(const char *addr, sock_addr *saddr);
-int send_tickle_ack(const sock_addr *dst, 
+struct tickle_sender;
+int send_tickle_ack(struct tickle_sender *t,
+		    const sock_addr *dst, 
 		    const sock_addr *src, 
 		    uint32_t seq, uint32_t ack, int rst);
+int flush_tickles(struct tickle_sender *t);
+int capture_connections(const char *ip);
+int read_connections(int fd);
+int write_connections(const char *path);
 static void usage(void);
 
-static uint32_t uint16_checksum(uint16_t *data, size_t n)
-{
-	uint32_t sum=0;
-	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
-		n -= 2;
-	}                      
-	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
-	}
-	return sum;
-}       
-
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
-{
-	uint32_t sum = uint16_checksum(data, n);
-	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
-	sum += ip->protocol + n;
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
-	}
-	return sum2;
-}
-
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
-{
-	uint32_t phdr[2];
-	uint32_t sum = 0;
-	uint16_t sum2;
-
-	memset(phdr, 0, sizeof(phdr));
-
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
-
-	phdr[0] = htonl(n);
-	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
-
-	sum += uint16_checksum(data, n);
-
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
-	}
-	return sum2;
-}
-
 void set_nonblocking(int fd)
 {
 	unsigned v;
@@ -205,144 +157,1312 @@ int parse_ip_port(const char *addr, sock_addr *saddr)
 	return ret;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+/*
+ * The connections to tickle, local address first.  They come from
+ * stdin (the text written by portblock, or a state file), or straight
+ * from the kernel (-l).
+ */
+struct tickle_conn {
+	sock_addr src;
+	sock_addr dst;
+	uint32_t since;		/* first seen, seconds since the epoch */
+	/* with -l, the kernel's socket, for -R */
+	uint32_t ifindex;
+	uint32_t cookie[2];
+};
+
+struct conn_list {
+	struct tickle_conn *c;
+	size_t n, max;
+};
+
+static struct conn_list conns;
+
+static int add_connection(struct conn_list *l, const sock_addr *src,
+			  const sock_addr *dst, uint32_t since)
 {
-	int s;
+	struct tickle_conn *c;
+
+	if (l->n == l->max) {
+		size_t n = l->max ? 2 * l->max : 1024;
+
+		c = realloc(l->c, n * sizeof(*c));
+		if (!c) {
+			fprintf(stderr, "Failed realloc()\n");
+			return -1;
+		}
+		l->c = c;
+		l->max = n;
+	}
+	l->c[l->n].src = *src;
+	l->c[l->n].dst = *dst;
+	l->c[l->n].since = since;
+	l->c[l->n].ifindex = 0;
+	l->c[l->n].cookie[0] = l->c[l->n].cookie[1] = 0;
+	l->n++;
+	return 0;
+}
+
+static const char *addr_str(const sock_addr *a, char *buf, size_t len)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (a->sa.sa_family == AF_INET) {
+		inet_ntop(AF_INET, &a->ip.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(a->ip.sin_port));
+	} else {
+		inet_ntop(AF_INET6, &a->ip6.sin6_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(a->ip6.sin6_port));
+	}
+	return buf;
+}
+
+/*
+ * The state file written by -w: the magic "TCKL", a version byte and
+ * three reserved ones, then a log of records
+ *	kind		1 byte, STATE_OPEN or STATE_CLOSE
+ *	family		1 byte, 4 or 6
+ *	local port	2 bytes, network byte order
+ *	remote port	2 bytes
+ *	first seen	4 bytes, seconds since the epoch
+ *	local address	4 or 16 bytes
+ *	remote address	4 or 16 bytes
+ * The last record for a connection says whether it is still open.
+ *
+ * Every -w appends records for the connections opened and closed since
+ * the last one only, so on a busy address a monitor writes (and the
+ * sync script ships) a few hundred bytes, not the whole table.  Once
+ * the log holds more than twice as many records as open connections it
+ * is rewritten with just the open ones.  A torn last record, say after
+ * a crash, is ignored, and the file rewritten on the next -w.
+ *
+ * Input that does not start with the magic is read as text,
+ * "local_ip:port remote_ip:port" per line, as portblock used to write.
+ */
+#define STATE_MAGIC	"TCKL"
+#define STATE_VERSION	2
+#define STATE_HDRLEN	8
+#define STATE_RECHDR	10
+#define STATE_MAXREC	(STATE_RECHDR + 2 * 16)
+#define STATE_OPEN	1
+#define STATE_CLOSE	2
+#define STATE_SLACK	1024	/* records to allow beyond 2x before compacting */
+
+/* A key sorting connections by family, addresses and ports */
+#define CONN_KEYLEN	(1 + 2 * 16 + 2 * 2)
+
+static void conn_key(const struct tickle_conn *c, unsigned char *key)
+{
+	memset(key, 0, CONN_KEYLEN);
+	if (c->src.sa.sa_family == AF_INET) {
+		key[0] = 4;
+		memcpy(key + 1, &c->src.ip.sin_addr, 4);
+		memcpy(key + 17, &c->dst.ip.sin_addr, 4);
+	} else {
+		key[0] = 6;
+		memcpy(key + 1, &c->src.ip6.sin6_addr, 16);
+		memcpy(key + 17, &c->dst.ip6.sin6_addr, 16);
+	}
+	/* sin_port and sin6_port are at the same offset */
+	memcpy(key + 33, &c->src.ip.sin_port, 2);
+	memcpy(key + 35, &c->dst.ip.sin_port, 2);
+}
+
+static int conn_cmp(const void *a, const void *b)
+{
+	unsigned char ka[CONN_KEYLEN], kb[CONN_KEYLEN];
+
+	conn_key(a, ka);
+	conn_key(b, kb);
+	return memcmp(ka, kb, CONN_KEYLEN);
+}
+
+static size_t put_record(unsigned char *p, int kind, const struct tickle_conn *c)
+{
+	uint32_t since = htonl(c->since);
+	size_t alen;
+
+	p[0] = kind;
+	p[1] = c->src.sa.sa_family == AF_INET ? 4 : 6;
+	memcpy(p + 2, &c->src.ip.sin_port, 2);
+	memcpy(p + 4, &c->dst.ip.sin_port, 2);
+	memcpy(p + 6, &since, 4);
+	if (p[1] == 4) {
+		alen = 4;
+		memcpy(p + STATE_RECHDR, &c->src.ip.sin_addr, 4);
+		memcpy(p + STATE_RECHDR + 4, &c->dst.ip.sin_addr, 4);
+	} else {
+		alen = 16;
+		memcpy(p + STATE_RECHDR, &c->src.ip6.sin6_addr, 16);
+		memcpy(p + STATE_RECHDR + 16, &c->dst.ip6.sin6_addr, 16);
+	}
+	return STATE_RECHDR + 2 * alen;
+}
+
+static void get_addr(const unsigned char *p, int family, uint16_t port, sock_addr *a)
+{
+	memset(a, 0, sizeof(*a));
+	if (family == 4) {
+		a->ip.sin_family = AF_INET;
+		a->ip.sin_port = port;
+		memcpy(&a->ip.sin_addr, p, 4);
+	} else {
+		a->ip6.sin6_family = AF_INET6;
+		a->ip6.sin6_port = port;
+		memcpy(&a->ip6.sin6_addr, p, 16);
+	}
+}
+
+struct state_rec {
+	struct tickle_conn c;
+	size_t seq;
+	int kind;
+};
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct state_rec *ra = a, *rb = b;
+	int ret = conn_cmp(&ra->c, &rb->c);
+
+	if (ret) {
+		return ret;
+	}
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/*
+ * Replay the log in buf into l, sorted by conn_cmp.  *nrecs and *valid
+ * tell how many records there were and how much of buf they took.
+ */
+static int read_state(const unsigned char *buf, size_t len, struct conn_list *l,
+		      size_t *nrecs, size_t *valid)
+{
+	const unsigned char *p = buf + STATE_HDRLEN, *end = buf + len;
+	struct state_rec *recs = NULL, *r;
+	size_t n = 0, max = 0, i, alen;
+	uint16_t sport, dport;
+	uint32_t since;
+	int ret = 0;
+
+	*nrecs = 0;
+	*valid = STATE_HDRLEN;
+	if (buf[4] != STATE_VERSION) {
+		fprintf(stderr, "Unknown state file version %d\n", buf[4]);
+		return -1;
+	}
+	while (end - p >= STATE_RECHDR) {
+		if ((p[0] != STATE_OPEN && p[0] != STATE_CLOSE)
+		    || (p[1] != 4 && p[1] != 6)) {
+			fprintf(stderr, "Bad record in state file at offset %lu\n",
+				(unsigned long)(p - buf));
+			break;
+		}
+		alen = p[1] == 4 ? 4 : 16;
+		if ((size_t)(end - p) < STATE_RECHDR + 2 * alen) {
+			break;
+		}
+		if (n == max) {
+			max = max ? 2 * max : 1024;
+			r = realloc(recs, max * sizeof(*r));
+			if (!r) {
+				fprintf(stderr, "Failed realloc()\n");
+				free(recs);
+				return -1;
+			}
+			recs = r;
+		}
+		r = &recs[n];
+		memcpy(&sport, p + 2, 2);
+		memcpy(&dport, p + 4, 2);
+		memcpy(&since, p + 6, 4);
+		get_addr(p + STATE_RECHDR, p[1], sport, &r->c.src);
+		get_addr(p + STATE_RECHDR + alen, p[1], dport, &r->c.dst);
+		r->c.since = ntohl(since);
+		r->kind = p[0];
+		r->seq = n++;
+		p += STATE_RECHDR + 2 * alen;
+	}
+	*nrecs = n;
+	*valid = p - buf;
+
+	/* the last record for a connection has the say */
+	qsort(recs, n, sizeof(*recs), rec_cmp);
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n && conn_cmp(&recs[i].c, &recs[i + 1].c) == 0) {
+			continue;
+		}
+		if (recs[i].kind == STATE_OPEN
+		    && add_connection(l, &recs[i].c.src, &recs[i].c.dst, recs[i].c.since)) {
+			ret = -1;
+			break;
+		}
+	}
+	free(recs);
+	return ret;
+}
+
+static int read_text(char *buf, struct conn_list *l)
+{
+	char *line, *next;
+	char addr1[64], addr2[64];
+	sock_addr src, dst;
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = 0;
+		}
+		if (sscanf(line, "%63s %63s", addr1, addr2) != 2) {
+			continue;
+		}
+		if (parse_ip_port(addr1, &src)) {
+			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+			return -1;
+		}
+		if (parse_ip_port(addr2, &dst)) {
+			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+			return -1;
+		}
+		if (add_connection(l, &src, &dst, 0)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Read all of fd into a buffer, with room for a terminating 0 */
+static unsigned char *read_all(int fd, size_t *lenp)
+{
+	unsigned char *buf = NULL, *b;
+	size_t len = 0, size = 0;
+	ssize_t n;
+
+	do {
+		if (len + 1 >= size) {
+			size = size ? 2 * size : 65536;
+			b = realloc(buf, size);
+			if (!b) {
+				fprintf(stderr, "Failed realloc()\n");
+				free(buf);
+				return NULL;
+			}
+			buf = b;
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 1;
+				continue;
+			}
+			fprintf(stderr, "Failed to read connections (%s)\n", strerror(errno));
+			free(buf);
+			return NULL;
+		}
+		len += n;
+	} while (n > 0);
+	*lenp = len;
+	return buf;
+}
+
+static int is_state(const unsigned char *buf, size_t len)
+{
+	return len >= STATE_HDRLEN && memcmp(buf, STATE_MAGIC, 4) == 0;
+}
+
+/* Read the connections from fd, a state file or text */
+int read_connections(int fd)
+{
+	unsigned char *buf;
+	size_t len, nrecs, valid;
 	int ret;
-	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
+
+	if ((buf = read_all(fd, &len)) == NULL) {
+		return -1;
+	}
+	if (is_state(buf, len)) {
+		ret = read_state(buf, len, &conns, &nrecs, &valid);
+	} else {
+		buf[len] = 0;
+		ret = read_text((char *)buf, &conns);
+	}
+	free(buf);
+	return ret;
+}
+
+static int write_fully(int fd, const char *path, const unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Failed to write %s (%s)\n", path, strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Rewrite path with an OPEN record per connection: to path.new first,
+ * which is fsync'ed and renamed, so whoever picks the file up never
+ * sees it half written.
+ */
+static int compact_state(const char *path)
+{
+	unsigned char *buf, *p;
+	char *tmp;
+	size_t i;
+	int fd, ret = -1;
+
+	buf = malloc(STATE_HDRLEN + conns.n * STATE_MAXREC);
+	tmp = malloc(strlen(path) + sizeof(".new"));
+	if (!buf || !tmp) {
+		fprintf(stderr, "Failed malloc()\n");
+		goto out;
+	}
+	sprintf(tmp, "%s.new", path);
+
+	memset(buf, 0, STATE_HDRLEN);
+	memcpy(buf, STATE_MAGIC, 4);
+	buf[4] = STATE_VERSION;
+	p = buf + STATE_HDRLEN;
+	for (i = 0; i < conns.n; i++) {
+		p += put_record(p, STATE_OPEN, &conns.c[i]);
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (write_fully(fd, tmp, buf, p - buf)) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (fsync(fd) || close(fd)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, path)) {
+		fprintf(stderr, "Failed to rename %s (%s)\n", tmp, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(buf);
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Bring the state file at path up to date with the connections just
+ * captured: append what changed since it was last written, or rewrite
+ * it if that is shorter in the long run (or it is not a state file).
+ * Connections already in the file keep their first seen time.
+ */
+int write_connections(const char *path)
+{
+	struct conn_list old = { NULL, 0, 0 };
+	unsigned char *buf = NULL, *delta = NULL, *p;
+	size_t len = 0, nrecs = 0, valid = 0, ndelta = 0, i, j, k;
+	int fd, cmp, compact = 1, ret = -1;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	if ((buf = read_all(fd, &len)) == NULL) {
+		goto out;
+	}
+	if (is_state(buf, len) && read_state(buf, len, &old, &nrecs, &valid) == 0) {
+		compact = valid != len;
+	}
+
+	/* merge the sorted lists, dropping duplicates from the capture */
+	qsort(conns.c, conns.n, sizeof(*conns.c), conn_cmp);
+	delta = malloc((conns.n + old.n) * STATE_MAXREC);
+	if (!delta) {
+		fprintf(stderr, "Failed malloc()\n");
+		goto out;
+	}
+	p = delta;
+	for (i = j = k = 0; i < conns.n || j < old.n; ) {
+		if (i == conns.n) {
+			cmp = 1;
+		} else if (j == old.n) {
+			cmp = -1;
+		} else {
+			cmp = conn_cmp(&conns.c[i], &old.c[j]);
+		}
+		if (cmp < 0) {
+			p += put_record(p, STATE_OPEN, &conns.c[i]);
+			ndelta++;
+			conns.c[k++] = conns.c[i++];
+		} else if (cmp > 0) {
+			p += put_record(p, STATE_CLOSE, &old.c[j++]);
+			ndelta++;
+		} else {
+			conns.c[i].since = old.c[j++].since;
+			conns.c[k++] = conns.c[i++];
+		}
+		while (i > 0 && i < conns.n && conn_cmp(&conns.c[i], &conns.c[i - 1]) == 0) {
+			i++;
+		}
+	}
+	conns.n = k;
+
+	if (compact || nrecs + ndelta > 2 * conns.n + STATE_SLACK) {
+		ret = compact_state(path);
+		goto out;
+	}
+	ret = 0;
+	if (ndelta == 0) {
+		goto out;
+	}
+	if (lseek(fd, 0, SEEK_END) == (off_t)-1
+	    || write_fully(fd, path, delta, p - delta)) {
+		ret = -1;
+	} else if (fsync(fd)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", path, strerror(errno));
+		ret = -1;
+	}
+out:
+	close(fd);
+	free(buf);
+	free(delta);
+	free(old.c);
+	return ret;
+}
+
+/*
+ * Ask the kernel (NETLINK_SOCK_DIAG) for the established TCP
+ * connections of one address family whose local address is ip.  The
+ * kernel does the filtering, with a one instruction bytecode program:
+ * accept if the source address matches, else jump past the end.
+ */
+static int capture_family(int fd, int family, const sock_addr *ip, uint32_t now)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req;
+	struct rtattr rta;
+	uint32_t bc[(sizeof(struct inet_diag_bc_op)
+		     + sizeof(struct inet_diag_hostcond) + 16) / 4];
+	struct inet_diag_bc_op *op = (struct inet_diag_bc_op *)bc;
+	struct inet_diag_hostcond *cond = (struct inet_diag_hostcond *)(op + 1);
+	struct sockaddr_nl nladdr;
+	struct iovec iov[3];
+	struct msghdr msg;
+	static char buf[32768];
+	struct nlmsghdr *h;
+	int alen = ip->sa.sa_family == AF_INET ? 4 : 16;
+	int bclen = sizeof(*op) + sizeof(*cond) + alen;
+	int len, done = 0;
+
+	memset(bc, 0, sizeof(bc));
+	op->code = INET_DIAG_BC_S_COND;
+	op->yes = bclen;
+	op->no = bclen + 4;
+	cond->family = ip->sa.sa_family;
+	cond->prefix_len = 8 * alen;
+	cond->port = -1;
+	if (ip->sa.sa_family == AF_INET) {
+		memcpy(cond->addr, &ip->ip.sin_addr, 4);
+	} else {
+		memcpy(cond->addr, &ip->ip6.sin6_addr, 16);
+	}
+
+	memset(&rta, 0, sizeof(rta));
+	rta.rta_type = INET_DIAG_REQ_BYTECODE;
+	rta.rta_len = RTA_LENGTH(bclen);
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req) + RTA_SPACE(bclen);
+	req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = family;
+	req.r.sdiag_family = family;
+	req.r.sdiag_protocol = IPPROTO_TCP;
+	req.r.idiag_states = 1 << TCP_ESTABLISHED;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = &rta;
+	iov[1].iov_len = sizeof(rta);
+	iov[2].iov_base = bc;
+	iov[2].iov_len = RTA_ALIGN(bclen);
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &nladdr;
+	msg.msg_namelen = sizeof(nladdr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	if (sendmsg(fd, &msg, 0) < 0) {
+		fprintf(stderr, "Failed to send sock_diag request (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	while (!done) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Failed to read sock_diag reply (%s)\n", strerror(errno));
+			return -1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len);
+		     h = NLMSG_NEXT(h, len)) {
+			struct inet_diag_msg *m = NLMSG_DATA(h);
+			sock_addr src, dst;
+
+			if (h->nlmsg_seq != req.nlh.nlmsg_seq) {
+				continue;
+			}
+			if (h->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+
+				fprintf(stderr, "sock_diag request failed (%s)\n", strerror(-err->error));
+				return -1;
+			}
+			memset(&src, 0, sizeof(src));
+			memset(&dst, 0, sizeof(dst));
+			if (m->idiag_family == AF_INET6 && ip->sa.sa_family == AF_INET) {
+				/* a v4-mapped connection on a v6 socket */
+				src.ip.sin_family = dst.ip.sin_family = AF_INET;
+				memcpy(&src.ip.sin_addr, &m->id.idiag_src[3], 4);
+				memcpy(&dst.ip.sin_addr, &m->id.idiag_dst[3], 4);
+			} else if (m->idiag_family == AF_INET) {
+				src.ip.sin_family = dst.ip.sin_family = AF_INET;
+				memcpy(&src.ip.sin_addr, m->id.idiag_src, 4);
+				memcpy(&dst.ip.sin_addr, m->id.idiag_dst, 4);
+			} else {
+				src.ip6.sin6_family = dst.ip6.sin6_family = AF_INET6;
+				memcpy(&src.ip6.sin6_addr, m->id.idiag_src, 16);
+				memcpy(&dst.ip6.sin6_addr, m->id.idiag_dst, 16);
+				if (IN6_IS_ADDR_LINKLOCAL(&src.ip6.sin6_addr)) {
+					src.ip6.sin6_scope_id = m->id.idiag_if;
+					dst.ip6.sin6_scope_id = m->id.idiag_if;
+				}
+			}
+			src.ip.sin_port = m->id.idiag_sport;
+			dst.ip.sin_port = m->id.idiag_dport;
+			if (add_connection(&conns, &src, &dst, now)) {
+				return -1;
+			}
+			conns.c[conns.n - 1].ifindex = m->id.idiag_if;
+			conns.c[conns.n - 1].cookie[0] = m->id.idiag_cookie[0];
+			conns.c[conns.n - 1].cookie[1] = m->id.idiag_cookie[1];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collect the established TCP connections on the local address ip.
+ * For an IPv4 address that includes connections accepted by IPv6
+ * sockets as v4-mapped addresses, which "ss" lists as [::ffff:a.b.c.d].
+ */
+int capture_connections(const char *ip)
+{
+	sock_addr addr;
+	uint32_t now = time(NULL);
+	int fd, ret;
+
+	if (parse_ip(ip, NULL, 0, &addr)) {
+		return -1;
+	}
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	ret = capture_family(fd, AF_INET6, &addr, now);
+	if (ret == 0 && addr.sa.sa_family == AF_INET) {
+		ret = capture_family(fd, AF_INET, &addr, now);
+	}
+	close(fd);
+	return ret;
+}
+
+/*
+ * -R: have the kernel abort the local end of the connections just
+ * captured (SOCK_DESTROY, in kernels built with INET_DIAG_DESTROY).
+ * That sends the peer an RST with the sequence number it expects.  An
+ * RST made up here would not do: RFC 5961 stacks drop any RST that is
+ * not exactly in sequence.  The socket cookie from the dump makes sure
+ * the kernel aborts that very socket, and not, say, the listener on
+ * the same port.
+ *
+ * Connections reset, or gone already, are dropped from conns.  If the
+ * kernel cannot abort sockets (or we may not), the rest stay in conns,
+ * to be tickled instead.
+ */
+#define RESET_BATCH	64
+
+static unsigned long reset_connections(void)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req[RESET_BATCH];
+	unsigned char keep[RESET_BATCH];
+	static char buf[32768];
+	struct sockaddr_nl nladdr;
+	struct nlmsghdr *h;
+	unsigned long nreset = 0;
+	size_t j, k, n, i, acked;
+	int fd, len, err = 0;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return 0;
+	}
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	for (j = k = 0; j < conns.n && !err; j += n) {
+		n = conns.n - j < RESET_BATCH ? conns.n - j : RESET_BATCH;
+		memset(req, 0, n * sizeof(req[0]));
+		for (i = 0; i < n; i++) {
+			const struct tickle_conn *c = &conns.c[j + i];
+			struct inet_diag_sockid *id = &req[i].r.id;
+
+			req[i].nlh.nlmsg_len = sizeof(req[i]);
+			req[i].nlh.nlmsg_type = SOCK_DESTROY;
+			req[i].nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+			req[i].nlh.nlmsg_seq = j + i + 1;
+			req[i].r.sdiag_family = c->src.sa.sa_family;
+			req[i].r.sdiag_protocol = IPPROTO_TCP;
+			req[i].r.idiag_states = 1 << TCP_ESTABLISHED;
+			id->idiag_sport = c->src.ip.sin_port;
+			id->idiag_dport = c->dst.ip.sin_port;
+			if (c->src.sa.sa_family == AF_INET) {
+				memcpy(id->idiag_src, &c->src.ip.sin_addr, 4);
+				memcpy(id->idiag_dst, &c->dst.ip.sin_addr, 4);
+			} else {
+				memcpy(id->idiag_src, &c->src.ip6.sin6_addr, 16);
+				memcpy(id->idiag_dst, &c->dst.ip6.sin6_addr, 16);
+			}
+			id->idiag_if = c->ifindex;
+			id->idiag_cookie[0] = c->cookie[0];
+			id->idiag_cookie[1] = c->cookie[1];
+			keep[i] = 1;
+		}
+		if (sendto(fd, req, n * sizeof(req[0]), 0,
+			   (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+			err = errno;
+			break;
+		}
+		for (acked = 0; acked < n && !err; ) {
+			len = recv(fd, buf, sizeof(buf), 0);
+			if (len < 0) {
+				if (errno != EINTR) {
+					err = errno;
+				}
+				continue;
+			}
+			for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned)len);
+			     h = NLMSG_NEXT(h, len)) {
+				struct nlmsgerr *e = NLMSG_DATA(h);
+
+				if (h->nlmsg_type != NLMSG_ERROR
+				    || h->nlmsg_seq <= j || h->nlmsg_seq > j + n) {
+					continue;
+				}
+				acked++;
+				i = h->nlmsg_seq - j - 1;
+				if (e->error == 0) {
+					nreset++;
+					keep[i] = 0;
+				} else if (e->error == -ENOENT) {
+					keep[i] = 0;
+				} else if (!err) {
+					err = -e->error;
+				}
+			}
+		}
+		for (i = 0; i < n; i++) {
+			if (keep[i]) {
+				conns.c[k++] = conns.c[j + i];
+			}
+		}
+	}
+	if (err) {
+		fprintf(stderr, "Cannot reset connections (%s), tickling them instead\n",
+			strerror(err));
+		while (j < conns.n) {
+			conns.c[k++] = conns.c[j++];
+		}
+	}
+	conns.n = k;
+	close(fd);
+	return nreset;
+}
+
+/* -P: the local ports whose connections are worth a packet */
+static unsigned char port_set[65536 / 8];
+
+/* A list of ports and ranges, "22,2049,8000-8080" (or "8000:8080") */
+static int parse_ports(const char *s)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	for (;;) {
+		lo = hi = strtoul(s, &end, 10);
+		if (end == s) {
+			return -1;
+		}
+		if (*end == '-' || *end == ':') {
+			s = end + 1;
+			hi = strtoul(s, &end, 10);
+			if (end == s) {
+				return -1;
+			}
+		}
+		if (lo < 1 || hi > 65535 || lo > hi) {
+			return -1;
+		}
+		for (; lo <= hi; lo++) {
+			port_set[lo / 8] |= 1 << (lo % 8);
+		}
+		if (*end == 0) {
+			return 0;
+		}
+		if (*end != ',') {
+			return -1;
+		}
+		s = end + 1;
+	}
+}
+
+/*
+ * Drop the connections that are not worth a packet: with -P those
+ * whose local port is not in the set, with -a those first seen less
+ * than min_age seconds ago.  Connections of unknown age (from a text
+ * list) stay, as do those seen "in the future" by a clock that is
+ * ahead of ours.  Returns how many were dropped.
+ */
+static size_t filter_connections(int by_port, uint32_t min_age)
+{
+	uint32_t now = time(NULL);
+	size_t j, k;
+
+	for (j = k = 0; j < conns.n; j++) {
+		const struct tickle_conn *c = &conns.c[j];
+		unsigned port = ntohs(c->src.ip.sin_port);
+
+		if (by_port && !(port_set[port / 8] & (1 << (port % 8)))) {
+			continue;
+		}
+		if (min_age && c->since && now - c->since < min_age) {
+			continue;
+		}
+		conns.c[k++] = *c;
+	}
+	j = conns.n - k;
+	conns.n = k;
+	return j;
+}
+
+/*
+ * Tickles are queued per address family and handed to the kernel
+ * TICKLE_BATCH at a time with sendmmsg(), on one raw socket per
+ * family that stays open for the whole run.  With -t there are that
+ * many senders, each a thread with its own sockets, batches and share
+ * of the pacing, and the connections are split between them by where
+ * the tickles go to.
+ */
+#define TICKLE_BATCH	64
+#define MAX_THREADS	64
+
+union tickle_pkt {
 	struct {
 		struct iphdr ip;
 		struct tcphdr tcp;
-	} ip4pkt;
+	} ip4;
 	struct {
 		struct ip6_hdr ip6;
 		struct tcphdr tcp;
-	} ip6pkt;
+	} ip6;
+};
 
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		// musl define only one of the two struct for tcphdr in
-		// /usr/include/netinet/tcp.h so we must use it to ensure compatibility
-		ip4pkt.tcp.th_sport = src->ip.sin_port;
-		ip4pkt.tcp.th_dport = dst->ip.sin_port;
-		ip4pkt.tcp.th_seq   = seq;
-		ip4pkt.tcp.th_ack   = ack;
-
-		ip4pkt.tcp.th_flags      = 0;
-		ip4pkt.tcp.th_flags     |= TH_ACK;
-		if (rst) {
-			ip4pkt.tcp.th_flags |= TH_RST;
-		}
-		ip4pkt.tcp.th_off   = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.th_win   = htons(1234);
-		ip4pkt.tcp.th_sum   = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
-			return -1;
-		}
+struct tickle_batch {
+	int fd;
+	int n;
+	struct mmsghdr msgs[TICKLE_BATCH];
+	struct iovec iov[TICKLE_BATCH];
+	union tickle_pkt pkts[TICKLE_BATCH];
+	sock_addr dst[TICKLE_BATCH];
+};
+
+/*
+ * Optional pacing (-p, -b): a token bucket, filled at rate packets
+ * per second up to burst, and one token per packet sent, so a few
+ * million tickles do not hit the upstream switch (or the NIC queue)
+ * all at once.
+ */
+struct tickle_pacer {
+	double rate;		/* 0: no limit */
+	double burst;
+	double tokens;
+	double last;
+};
 
+struct tickle_sender {
+	struct tickle_batch b4, b6;
+	struct tickle_pacer pacer;
+	unsigned long sent;
+	unsigned long errors;
+	int gave_up;		/* the queue stayed full for SEND_GIVEUP */
+
+	/* what run_sender() tickles */
+	const struct tickle_conn *conns;
+	size_t n;
+	int num;
+	int reverse;
+	int ret;
+	pthread_t thread;
+};
+
+static int open_tickle_socket(int family)
+{
+	int s;
+	int ret;
+	uint32_t one = 1;
+
+	s = socket(family, SOCK_RAW, IPPROTO_RAW);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	if (family == AF_INET) {
 		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
 		if (ret != 0) {
 			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
 			close(s);
 			return -1;
 		}
+	}
 
-		set_nonblocking(s);
-		set_close_on_exec(s);
+	/* without it a full device queue drops tickles silently */
+	if (family == AF_INET) {
+		ret = setsockopt(s, SOL_IP, IP_RECVERR, &one, sizeof(one));
+	} else {
+		ret = setsockopt(s, SOL_IPV6, IPV6_RECVERR, &one, sizeof(one));
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Failed to enable send errors (%s)\n", strerror(errno));
+	}
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_sec(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static void init_sender(struct tickle_sender *t, double rate, double burst)
+{
+	memset(t, 0, sizeof(*t));
+	t->b4.fd = t->b6.fd = -1;
+	t->pacer.rate = rate;
+	t->pacer.burst = burst >= 1 ? burst : 1;
+	t->pacer.tokens = t->pacer.burst;
+	t->pacer.last = now_sec();
+}
+
+static void close_sender(struct tickle_sender *t)
+{
+	if (t->b4.fd != -1) {
+		close(t->b4.fd);
+	}
+	if (t->b6.fd != -1) {
+		close(t->b6.fd);
+	}
+}
+
+/* How many of n packets may go now; waits until at least one may */
+static int pace(struct tickle_pacer *pc, int n)
+{
+	double t;
+
+	if (pc->rate <= 0) {
+		return n;
+	}
+	for (;;) {
+		t = now_sec();
+		pc->tokens += (t - pc->last) * pc->rate;
+		pc->last = t;
+		if (pc->tokens > pc->burst) {
+			pc->tokens = pc->burst;
 		}
-		break;
+		if (pc->tokens >= 1) {
+			break;
+		}
+		sleep_sec((1 - pc->tokens) / pc->rate);
+	}
+	if (n > (int)pc->tokens) {
+		n = (int)pc->tokens;
+	}
+	pc->tokens -= n;
+	return n;
+}
 
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		// musl define only one of the two struct for tcphdr in
-		// /usr/include/netinet/tcp.h so we must use it to ensure compatibility
-		ip6pkt.tcp.th_sport = src->ip6.sin6_port;
-		ip6pkt.tcp.th_dport = dst->ip6.sin6_port;
-		ip6pkt.tcp.th_seq   = seq;
-		ip6pkt.tcp.th_ack   = ack;
-		ip6pkt.tcp.th_flags      = 0;
-		ip6pkt.tcp.th_flags     |= TH_ACK;
-		if (rst) {
-			ip6pkt.tcp.th_flags |= TH_RST;
-		}
-		ip6pkt.tcp.th_off   = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.th_win   = htons(1234);
-		ip6pkt.tcp.th_sum   = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
-			return -1;
-                }
+/*
+ * A full socket buffer (EAGAIN) or device queue (ENOBUFS) is waited
+ * out, backing off up to SEND_BACKOFF_MAX.  After SEND_GIVEUP without
+ * any progress the rest of the batch is dropped, and from then on a
+ * full queue drops the rest of a batch at once instead of being waited
+ * out again.  Any other error drops just the packet it is for, and the
+ * rest still goes out.  The drops are counted in t->errors.
+ */
+#define SEND_BACKOFF_MIN	0.001
+#define SEND_BACKOFF_MAX	0.1
+#define SEND_GIVEUP		5.0
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+static void flush_batch(struct tickle_sender *t, struct tickle_batch *b)
+{
+	struct tickle_pacer *pc = &t->pacer;
+	int sent = 0;
+	int ret, n;
+	double backoff = SEND_BACKOFF_MIN, stalled = 0;
+	char addr[INET6_ADDRSTRLEN];
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+	/* the addresses and the TCP header are one run of bytes */
+	if (b == &t->b4) {
+		csum_batch(CSUM_BEST, b->pkts, sizeof(b->pkts[0]), b->n,
+			   offsetof(union tickle_pkt, ip4.ip.saddr), 8 + sizeof(struct tcphdr),
+			   offsetof(union tickle_pkt, ip4.tcp.th_sum), TCP_CSUM_BASE);
+	} else {
+		csum_batch(CSUM_BEST, b->pkts, sizeof(b->pkts[0]), b->n,
+			   offsetof(union tickle_pkt, ip6.ip6.ip6_src), 32 + sizeof(struct tcphdr),
+			   offsetof(union tickle_pkt, ip6.tcp.th_sum), TCP_CSUM_BASE);
+	}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
+	while (sent < b->n) {
+		n = pace(pc, b->n - sent);
+		ret = sendmmsg(b->fd, &b->msgs[sent], n, 0);
+		if (ret < 0) {
+			/* put the tokens back, nothing went out */
+			pc->tokens += pc->rate > 0 ? n : 0;
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				if (!t->gave_up && stalled < SEND_GIVEUP) {
+					sleep_sec(backoff);
+					stalled += backoff;
+					backoff = backoff * 2 < SEND_BACKOFF_MAX ? backoff * 2 : SEND_BACKOFF_MAX;
+					continue;
+				}
+				fprintf(stderr, "Dropping %d tickle acks, the send queue is full (%s)\n",
+					b->n - sent, strerror(errno));
+				t->errors += b->n - sent;
+				t->gave_up = 1;
+				break;
+			}
+			if (b->dst[sent].sa.sa_family == AF_INET) {
+				inet_ntop(AF_INET, &b->dst[sent].ip.sin_addr, addr, sizeof(addr));
+			} else {
+				inet_ntop(AF_INET6, &b->dst[sent].ip6.sin6_addr, addr, sizeof(addr));
+			}
+			fprintf(stderr, "Failed sendmmsg to %s (%s)\n", addr, strerror(errno));
+			t->errors++;
+			ret = 1;
+		} else {
+			if (ret < n && pc->rate > 0) {
+				pc->tokens += n - ret;
+			}
+			t->sent += ret;
 		}
-		break;
+		sent += ret;
+		backoff = SEND_BACKOFF_MIN;
+		stalled = 0;
+	}
+	b->n = 0;
+}
+
+/* Send whatever is still queued; fails if any tickle was dropped */
+int flush_tickles(struct tickle_sender *t)
+{
+	flush_batch(t, &t->b4);
+	flush_batch(t, &t->b6);
+	return t->errors ? -1 : 0;
+}
 
+/*
+ * Every tickle is a copy of one of these, made once, with the addresses,
+ * ports, sequence numbers and flags filled in.  The TCP checksums of a
+ * batch are all filled in at once, by csum_batch(), when it is sent.
+ */
+static union tickle_pkt tmpl4, tmpl6;
+
+static void init_templates(void)
+{
+	memset(&tmpl4, 0, sizeof(tmpl4));
+	tmpl4.ip4.ip.version  = 4;
+	tmpl4.ip4.ip.ihl      = sizeof(tmpl4.ip4.ip)/4;
+	tmpl4.ip4.ip.tot_len  = htons(sizeof(tmpl4.ip4));
+	tmpl4.ip4.ip.ttl      = 255;
+	tmpl4.ip4.ip.protocol = IPPROTO_TCP;
+	tmpl4.ip4.ip.check    = 0;	/* the kernel fills it in */
+	// musl define only one of the two struct for tcphdr in
+	// /usr/include/netinet/tcp.h so we must use it to ensure compatibility
+	tmpl4.ip4.tcp.th_flags = TH_ACK;
+	tmpl4.ip4.tcp.th_off  = sizeof(tmpl4.ip4.tcp)/4;
+	tmpl4.ip4.tcp.th_win  = htons(1234);
+
+	memset(&tmpl6, 0, sizeof(tmpl6));
+	tmpl6.ip6.ip6.ip6_vfc  = 0x60;
+	tmpl6.ip6.ip6.ip6_plen = htons(20);
+	tmpl6.ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+	tmpl6.ip6.ip6.ip6_hlim = 64;
+	tmpl6.ip6.tcp.th_flags = TH_ACK;
+	tmpl6.ip6.tcp.th_off  = sizeof(tmpl6.ip6.tcp)/4;
+	tmpl6.ip6.tcp.th_win  = htons(1234);
+}
+
+int send_tickle_ack(struct tickle_sender *t,
+		    const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	struct tickle_batch *b;
+	union tickle_pkt *pkt;
+	struct tcphdr *tcp;
+
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		b = &t->b4;
+		break;
+	case AF_INET6:
+		b = &t->b6;
+		break;
 	default:
 		fprintf(stderr, "Not an ipv4/v6 address\n");
 		return -1;
 	}
 
+	if (b->fd == -1 && (b->fd = open_tickle_socket(src->ip.sin_family)) == -1) {
+		return -1;
+	}
+	pkt = &b->pkts[b->n];
+
+	if (src->ip.sin_family == AF_INET) {
+		pkt->ip4 = tmpl4.ip4;
+		pkt->ip4.ip.saddr = src->ip.sin_addr.s_addr;
+		pkt->ip4.ip.daddr = dst->ip.sin_addr.s_addr;
+		tcp = &pkt->ip4.tcp;
+
+		b->dst[b->n].ip = dst->ip;
+		b->iov[b->n].iov_len = sizeof(pkt->ip4);
+		b->msgs[b->n].msg_hdr.msg_namelen = sizeof(dst->ip);
+	} else {
+		pkt->ip6 = tmpl6.ip6;
+		pkt->ip6.ip6.ip6_src = src->ip6.sin6_addr;
+		pkt->ip6.ip6.ip6_dst = dst->ip6.sin6_addr;
+		tcp = &pkt->ip6.tcp;
+
+		/* a raw socket takes the port for the protocol */
+		b->dst[b->n].ip6 = dst->ip6;
+		b->dst[b->n].ip6.sin6_port = 0;
+		b->iov[b->n].iov_len = sizeof(pkt->ip6);
+		b->msgs[b->n].msg_hdr.msg_namelen = sizeof(dst->ip6);
+	}
+	/* sin_port and sin6_port are at the same offset */
+	tcp->th_sport = src->ip.sin_port;
+	tcp->th_dport = dst->ip.sin_port;
+	tcp->th_seq   = seq;
+	tcp->th_ack   = ack;
+	if (rst) {
+		tcp->th_flags |= TH_RST;
+	}
+
+	b->iov[b->n].iov_base = pkt;
+	b->msgs[b->n].msg_hdr.msg_name = &b->dst[b->n];
+	b->msgs[b->n].msg_hdr.msg_iov = &b->iov[b->n];
+	b->msgs[b->n].msg_hdr.msg_iovlen = 1;
+	b->n++;
+
+	if (b->n == TICKLE_BATCH) {
+		flush_batch(t, b);
+	}
+	return 0;
+}
+
+/* Send num tickles for every connection of the sender's share */
+static void *run_sender(void *arg)
+{
+	struct tickle_sender *t = arg;
+	char addr1[64], addr2[64];
+	size_t j;
+	int i;
+
+	t->ret = 0;
+	for (j = 0; j < t->n; j++) {
+		const sock_addr *src = t->reverse ? &t->conns[j].dst : &t->conns[j].src;
+		const sock_addr *dst = t->reverse ? &t->conns[j].src : &t->conns[j].dst;
+
+		for (i = 1; i <= t->num; i++) {
+			if (send_tickle_ack(t, dst, src, 0, 0, 0)) {
+				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
+					addr_str(src, addr1, sizeof(addr1)),
+					addr_str(dst, addr2, sizeof(addr2)));
+				t->ret = -1;
+				return NULL;
+			}
+		}
+	}
+	if (flush_tickles(t)) {
+		t->ret = -1;
+	}
+	return NULL;
+}
+
+/* Which sender gets the tickles to this address and port */
+static unsigned shard_of(const sock_addr *dst, unsigned nshards)
+{
+	const unsigned char *p;
+	size_t len, i;
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	if (dst->sa.sa_family == AF_INET) {
+		p = (const unsigned char *)&dst->ip.sin_addr;
+		len = 4;
+	} else {
+		p = (const unsigned char *)&dst->ip6.sin6_addr;
+		len = 16;
+	}
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	/* many clients may be behind one NAT address: the port, too */
+	p = (const unsigned char *)&dst->ip.sin_port;
+	h = (h ^ p[0]) * 16777619u;
+	h = (h ^ p[1]) * 16777619u;
+	return h % nshards;
+}
+
+/*
+ * Reorder conns so that every sender's share is one slice of it, and
+ * hand the slices out.
+ */
+static int split_connections(struct tickle_sender *senders, int nthreads, int reverse)
+{
+	struct tickle_conn *sorted;
+	size_t count[MAX_THREADS + 1] = { 0 };
+	unsigned char *shard;
+	size_t j;
+	int k;
+
+	if (nthreads == 1) {
+		senders[0].conns = conns.c;
+		senders[0].n = conns.n;
+		return 0;
+	}
+	sorted = malloc(conns.n * sizeof(*sorted));
+	shard = malloc(conns.n);
+	if ((!sorted || !shard) && conns.n) {
+		fprintf(stderr, "Failed malloc()\n");
+		free(sorted);
+		free(shard);
+		return -1;
+	}
+	for (j = 0; j < conns.n; j++) {
+		shard[j] = shard_of(reverse ? &conns.c[j].src : &conns.c[j].dst, nthreads);
+		count[shard[j] + 1]++;
+	}
+	for (k = 0; k < nthreads; k++) {
+		senders[k].conns = sorted + count[k];
+		senders[k].n = count[k + 1];
+		count[k + 1] += count[k];
+	}
+	for (j = 0; j < conns.n; j++) {
+		sorted[count[shard[j]]++] = conns.c[j];
+	}
+	free(shard);
+	free(conns.c);
+	conns.c = sorted;
+	conns.max = conns.n;
 	return 0;
 }
 
 static void usage(void)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -r ] [ -p pps [ -b burst ] ]\n");
+	printf("                                     [ -t threads ] [ -v ] [ -l ip [ -w statefile | -R ] ]\n");
+	printf("                                     [ -P ports ] [ -a age ]\n");
 	printf("Please note that this program need to read the list of\n");
 	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("The list may also be a state file written with -w.\n");
+	printf("  -n num        send num tickles per connection\n");
+	printf("  -r            swap local and remote, to tickle ourselves\n");
+	printf("  -p pps        send at most pps tickles per second\n");
+	printf("  -b burst      and at most burst at once (default %d)\n", TICKLE_BATCH);
+	printf("  -t threads    send from that many threads (at most %d)\n", MAX_THREADS);
+	printf("  -v            report how many tickles went out how fast\n");
+	printf("  -l ip         take the established connections on the local\n");
+	printf("                address ip from the kernel instead of stdin\n");
+	printf("  -w statefile  with -l, write them to statefile, do not tickle\n");
+	printf("  -R            with -l, have the kernel reset them (the peer gets\n");
+	printf("                an RST), tickle only those it cannot reset\n");
+	printf("  -P ports      only the connections on these local ports,\n");
+	printf("                as in \"22,2049,8000-8080\"\n");
+	printf("  -a age        only the connections first seen at least age\n");
+	printf("                seconds ago (needs a state file on stdin)\n");
 	exit(1);
 }
 
-#define OPTION_STRING "n:h"
+#define OPTION_STRING "n:hrp:b:t:vl:w:RP:a:"
 
 int main(int argc, char *argv[])
 {
-	int optchar, i, num = 1, cont = 1;
-	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
+	int optchar, num = 1, cont = 1, reverse = 0, verbose = 0;
+	int nthreads = 1, k, ret = 0, reset = 0, by_port = 0;
+	uint32_t min_age = 0;
+	double pps = 0, burst = TICKLE_BATCH, t0, elapsed;
+	const char *local_ip = NULL, *statefile = NULL;
+	struct tickle_sender *senders;
+	unsigned long sent = 0, errors = 0, nreset = 0;
+	size_t skipped;
 
 	while(cont) {
 		optchar = getopt(argc, argv, OPTION_STRING);
@@ -350,6 +1470,44 @@ int main(int argc, char *argv[])
 		case 'n':
 			num = atoi(optarg);
 			break;
+		case 'r':
+			reverse = 1;
+			break;
+		case 'p':
+			pps = atof(optarg);
+			break;
+		case 'b':
+			burst = atof(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS) {
+				fprintf(stderr, "-t wants 1 to %d threads.\n", MAX_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'l':
+			local_ip = optarg;
+			break;
+		case 'w':
+			statefile = optarg;
+			break;
+		case 'R':
+			reset = 1;
+			break;
+		case 'P':
+			if (parse_ports(optarg)) {
+				fprintf(stderr, "Bad port list '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			by_port = 1;
+			break;
+		case 'a':
+			min_age = strtoul(optarg, NULL, 10);
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -363,27 +1521,90 @@ int main(int argc, char *argv[])
 			break;
 		};
 	}
+	if (statefile && !local_ip) {
+		fprintf(stderr, "-w needs -l, please use '-h' for usage.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (reset && (!local_ip || statefile)) {
+		fprintf(stderr, "-R needs -l (and no -w), please use '-h' for usage.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (min_age && local_ip) {
+		/* what the kernel has now is all "just seen" */
+		fprintf(stderr, "-a needs a state file on stdin, not -l.\n");
+		exit(EXIT_FAILURE);
+	}
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
-
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
+	if (local_ip) {
+		if (capture_connections(local_ip)) {
+			fprintf(stderr, "Failed to get the connections on %s\n", local_ip);
 			return -1;
 		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
-			return -1;
+		if (statefile) {
+			return write_connections(statefile) ? -1 : 0;
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
+	} else if (read_connections(STDIN_FILENO)) {
+		return -1;
+	}
+	skipped = filter_connections(by_port, min_age);
+	if (reset) {
+		nreset = reset_connections();
+	}
+
+	senders = calloc(nthreads, sizeof(*senders));
+	if (!senders) {
+		fprintf(stderr, "Failed calloc()\n");
+		return -1;
+	}
+	for (k = 0; k < nthreads; k++) {
+		/* the senders share the rate, and the burst */
+		init_sender(&senders[k], pps / nthreads, burst / nthreads);
+		senders[k].num = num;
+		senders[k].reverse = reverse;
+	}
+	if (split_connections(senders, nthreads, reverse)) {
+		return -1;
+	}
+	init_templates();
+
+	t0 = now_sec();
+	if (nthreads == 1) {
+		run_sender(&senders[0]);
+	} else {
+		for (k = 0; k < nthreads; k++) {
+			if (pthread_create(&senders[k].thread, NULL, run_sender, &senders[k])) {
+				fprintf(stderr, "Failed to start sender thread\n");
 				return -1;
 			}
 		}
+		for (k = 0; k < nthreads; k++) {
+			pthread_join(senders[k].thread, NULL);
+		}
+	}
+	elapsed = now_sec() - t0;
 
+	for (k = 0; k < nthreads; k++) {
+		sent += senders[k].sent;
+		errors += senders[k].errors;
+		if (senders[k].ret) {
+			ret = -1;
+		}
+		close_sender(&senders[k]);
 	}
-	return 0;
+	if (verbose) {
+		if (by_port || min_age) {
+			fprintf(stderr, "Skipped %lu connections\n", (unsigned long)skipped);
+		}
+		if (reset) {
+			fprintf(stderr, "Reset %lu connections\n", nreset);
+		}
+		fprintf(stderr, "Sent %lu tickle acks in %.3fs, %.0f per second, %d thread%s\n",
+			sent, elapsed, elapsed > 0 ? sent / elapsed : 0.0,
+			nthreads, nthreads > 1 ? "s" : "");
+	}
+	if (errors) {
+		fprintf(stderr, "%lu tickle acks could not be sent\n", errors);
+	}
+	free(senders);
+	return ret;
 }